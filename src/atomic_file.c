@@ -0,0 +1,54 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+
+#include "atomic_file.h"
+
+int atomic_file_temp(char *temp, size_t size, const char *path)
+{
+	return snprintf(temp, size, "%s%s", path, ATOMIC_FILE_TEMP_SUFFIX) < (int)size ? 0 : -1;
+}
+
+/* Sync the directory holding path, making a rename in it durable */
+static int atomic_file_sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+
+	if (slash == NULL)
+	{
+		strcpy(dir, ".");
+	}
+	else if (slash == path)
+	{
+		strcpy(dir, "/");
+	}
+	else
+	{
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+	}
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	int ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+int atomic_file_commit(int fd, const char *temp, const char *path)
+{
+	if (fsync(fd) != 0 || rename(temp, path) != 0 || atomic_file_sync_dir(path) != 0)
+	{
+		csp_print("Failed to replace '%s': %d\n", path, errno);
+		return -1;
+	}
+	return 0;
+}
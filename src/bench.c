@@ -0,0 +1,309 @@
+/**
+ * Loopback benchmark of the upload receive path.
+ *
+ * A stand-in DTP server thread streams a synthetic payload over the CSP
+ * loopback interface. The receiving side runs every packet through the same
+ * session hooks, sink, resume map and checksum as a real upload.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+#include "crc32.h"
+#include "file_sink.h"
+#include "upload_pool.h"
+#include "upload_stats.h"
+#include "vmem_dtp_server.h"
+
+#include "dtp/dtp_session.h"
+
+/* Hooks libdtp uses for sessions started by dtp_client_main */
+dtp_opt_session_hooks_cfg default_session_hooks;
+
+#define BENCH_ADDRESS 1
+#define BENCH_PORT 20
+#define BENCH_SERVER_PORT 21
+/* A receive that idles this long ends the run */
+#define BENCH_IDLE_TIMEOUT_MS 1000
+
+typedef struct
+{
+	uint64_t size;
+	uint32_t mtu;
+	uint32_t window;
+	uint32_t checksum; // CRC-32 of the payload as sent
+	atomic_uint received;
+} bench_run_t;
+
+/* Counters of /proc/self/io, zero when the kernel lacks task I/O accounting */
+typedef struct
+{
+	uint64_t syscr;
+	uint64_t syscw;
+} bench_io_t;
+
+static void bench_read_io(bench_io_t *io)
+{
+	char key[32];
+	unsigned long long value;
+	FILE *f = fopen("/proc/self/io", "r");
+
+	memset(io, 0, sizeof(*io));
+	if (f == NULL)
+	{
+		return;
+	}
+	while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2)
+	{
+		if (strcmp(key, "syscr") == 0)
+		{
+			io->syscr = value;
+		}
+		else if (strcmp(key, "syscw") == 0)
+		{
+			io->syscw = value;
+		}
+	}
+	fclose(f);
+}
+
+static double bench_cpu_seconds(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static void *bench_router(void *param)
+{
+	(void)param;
+	while (1)
+	{
+		csp_route_work();
+	}
+	return NULL;
+}
+
+/* Stand-in DTP server, sends every packet of the payload once */
+static void *bench_server(void *param)
+{
+	bench_run_t *run = param;
+	uint32_t payload = run->mtu - DTP_PACKET_HEADER_SIZE;
+	uint32_t count = (run->size + payload - 1) / payload;
+	uint64_t state = 0x9E3779B97F4A7C15ull;
+	uint32_t crc = 0xFFFFFFFF;
+
+	for (uint32_t seq = 0; seq < count; seq++)
+	{
+		// Keep no more than a window of packets in flight, like a paced DTP server
+		while (seq - atomic_load_explicit(&run->received, memory_order_acquire) >= run->window)
+		{
+			sched_yield();
+		}
+
+		csp_packet_t *packet;
+		while ((packet = csp_buffer_get(run->mtu)) == NULL)
+		{
+			sched_yield();
+		}
+
+		uint32_t len = seq == count - 1 ? run->size - (uint64_t)seq * payload : payload;
+		uint8_t *data = &packet->data[DTP_PACKET_HEADER_SIZE];
+		for (uint32_t i = 0; i < len; i += sizeof(state))
+		{
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			memcpy(&data[i], &state, len - i < sizeof(state) ? len - i : sizeof(state));
+		}
+		crc = crc32_update(crc, data, len);
+
+		packet->data32[0] = seq;
+		packet->length = DTP_PACKET_HEADER_SIZE + len;
+		csp_sendto(CSP_PRIO_NORM, BENCH_ADDRESS, BENCH_PORT, BENCH_SERVER_PORT, CSP_O_NONE, packet);
+	}
+
+	run->checksum = ~crc;
+	return NULL;
+}
+
+static int bench_run(const char *dir, uint64_t size, uint32_t mtu, uint32_t window)
+{
+	static csp_socket_t sock = {.opts = CSP_SO_CONN_LESS};
+	static bool bound = false;
+	char path[PATH_MAX];
+	bench_run_t run = {.size = size, .mtu = mtu, .window = window};
+	dtp_thread_args_t *context;
+	upload_sink_t *sink;
+	struct rusage before, after;
+	bench_io_t io_before, io_after;
+	pthread_t server;
+
+	if (!bound)
+	{
+		csp_bind(&sock, BENCH_PORT);
+		bound = true;
+	}
+
+	snprintf(path, sizeof(path), "%s/upload_bench_%" PRIu64 ".bin", dir, size);
+	context = upload_pool_acquire(path);
+	sink = &context->sink;
+	if (upload_sink_open(sink, path, mtu, false, UPLOAD_COMPRESSION_NONE, NULL) != 0)
+	{
+		fprintf(stderr, "Could not create %s\n", path);
+		upload_pool_release(context);
+		return -1;
+	}
+	sink->stats = upload_stats_claim(0, BENCH_ADDRESS);
+	upload_stats_start(sink->stats);
+	upload_sink_bind(sink);
+
+	uint64_t start = upload_stats_now();
+	getrusage(RUSAGE_SELF, &before);
+	bench_read_io(&io_before);
+	pthread_create(&server, NULL, bench_server, &run);
+
+	uint32_t payload = mtu - DTP_PACKET_HEADER_SIZE;
+	uint32_t count = (size + payload - 1) / payload;
+	uint32_t received = 0;
+	while (received < count)
+	{
+		csp_packet_t *packet = csp_recvfrom(&sock, BENCH_IDLE_TIMEOUT_MS);
+		if (packet == NULL)
+		{
+			break;
+		}
+		file_sink_session_hooks.on_data_packet(NULL, packet);
+		csp_buffer_free(packet);
+		atomic_store_explicit(&run.received, ++received, memory_order_release);
+	}
+
+	pthread_join(server, NULL);
+	uint32_t checksum = upload_sink_checksum(sink);
+	upload_sink_bind(NULL);
+	upload_sink_close(sink, received == count ? UPLOAD_SINK_COMMIT : UPLOAD_SINK_KEEP);
+
+	uint64_t elapsed = upload_stats_now() - start;
+	getrusage(RUSAGE_SELF, &after);
+	bench_read_io(&io_after);
+	upload_stats_finish(sink->stats, UPLOAD_CLIENT_DTP_RESULT_OK, checksum);
+
+	double seconds = elapsed / 1e9;
+	printf("%12" PRIu64 " B %9.3f s %9.3f MB/s cpu %7.3f s rss %6ld KiB syscr %6" PRIu64 " syscw %8" PRIu64 " csw %6ld/%-6ld lost %u crc %s\n",
+		   size, seconds, size / seconds / 1e6,
+		   bench_cpu_seconds(&after) - bench_cpu_seconds(&before), after.ru_maxrss,
+		   io_after.syscr - io_before.syscr, io_after.syscw - io_before.syscw,
+		   after.ru_nvcsw - before.ru_nvcsw, after.ru_nivcsw - before.ru_nivcsw,
+		   count - received, checksum == run.checksum ? "ok" : "MISMATCH");
+
+	unlink(path);
+	upload_pool_release(context);
+	return received == count && checksum == run.checksum ? 0 : -1;
+}
+
+/* Parse a size with an optional K, M or G suffix */
+static uint64_t bench_parse_size(const char *arg)
+{
+	char *end;
+	uint64_t size = strtoull(arg, &end, 10);
+	switch (*end)
+	{
+	case 'G':
+		size *= 1024;
+		/* fallthrough */
+	case 'M':
+		size *= 1024;
+		/* fallthrough */
+	case 'K':
+		size *= 1024;
+		break;
+	}
+	return size;
+}
+
+static void print_help(void)
+{
+	printf("Usage: upload_bench [options] [size...]\n"
+		   " -d <dir>     directory for the received files (default /tmp)\n"
+		   " -m <mtu>     DTP MTU (default 200)\n"
+		   " -w <packets> packets in flight (default 8)\n"
+		   " -h           print help\n"
+		   "Sizes take a K, M or G suffix, the default is 1K 64K 1M 16M 256M 1G\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *default_sizes[] = {"1K", "64K", "1M", "16M", "256M", "1G"};
+	const char *dir = "/tmp";
+	uint32_t mtu = 200;
+	uint32_t window = 8;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:w:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			dir = optarg;
+			break;
+		case 'm':
+			mtu = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'h':
+			print_help();
+			exit(EXIT_SUCCESS);
+		default:
+			print_help();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (mtu <= DTP_PACKET_HEADER_SIZE || mtu > CSP_BUFFER_SIZE || window < 1)
+	{
+		fprintf(stderr, "Invalid MTU or window\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (upload_pool_reserve(1) != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	csp_init();
+	csp_if_lo.addr = BENCH_ADDRESS;
+	csp_rtable_set(BENCH_ADDRESS, csp_id_get_host_bits(), &csp_if_lo, CSP_NO_VIA_ADDRESS);
+
+	pthread_t router;
+	pthread_create(&router, NULL, bench_router, NULL);
+
+	int failures = 0;
+	if (optind < argc)
+	{
+		for (int i = optind; i < argc; i++)
+		{
+			failures += bench_run(dir, bench_parse_size(argv[i]), mtu, window) != 0;
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]); i++)
+		{
+			failures += bench_run(dir, bench_parse_size(default_sizes[i]), mtu, window) != 0;
+		}
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
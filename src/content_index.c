@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <csp/csp.h>
+
+#include "content_index.h"
+#include "atomic_file.h"
+
+/* Copy size when the destination cannot be linked to the entry */
+#define CONTENT_INDEX_COPY_CHUNK (64 * 1024)
+/* Next to each entry, what it looked like when it was last hashed */
+#define CONTENT_INDEX_STAMP_SUFFIX ".stat"
+
+typedef struct
+{
+	uint64_t size;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} content_index_stamp_t;
+
+static const char *index_dir = NULL;
+
+int content_index_init(const char *dir)
+{
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+	{
+		csp_print("Cannot create content index '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+	index_dir = dir;
+	return 0;
+}
+
+bool content_index_enabled(void)
+{
+	return index_dir != NULL;
+}
+
+static int content_index_entry(char *path, size_t size, const uint8_t hash[CONTENT_INDEX_HASH_SIZE])
+{
+	char hex[2 * CONTENT_INDEX_HASH_SIZE + 1];
+
+	for (int i = 0; i < CONTENT_INDEX_HASH_SIZE; i++)
+	{
+		snprintf(&hex[2 * i], 3, "%02x", hash[i]);
+	}
+	return snprintf(path, size, "%s/%s", index_dir, hex) < (int)size ? 0 : -1;
+}
+
+static void content_index_stamp(content_index_stamp_t *stamp, const struct stat *st)
+{
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->size = st->st_size;
+	stamp->ino = st->st_ino;
+	stamp->mtime_sec = st->st_mtim.tv_sec;
+	stamp->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int content_index_stamp_path(char *path, size_t size, const char *entry)
+{
+	return snprintf(path, size, "%s%s", entry, CONTENT_INDEX_STAMP_SUFFIX) < (int)size ? 0 : -1;
+}
+
+/* Record that the entry was hashed as it is now, a torn record only costs another hash */
+static void content_index_stamp_save(const char *entry, const struct stat *st)
+{
+	char path[PATH_MAX];
+	content_index_stamp_t stamp;
+
+	if (content_index_stamp_path(path, sizeof(path), entry) != 0)
+	{
+		return;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return;
+	}
+	content_index_stamp(&stamp, st);
+	if (write(fd, &stamp, sizeof(stamp)) != sizeof(stamp))
+	{
+		unlink(path);
+	}
+	close(fd);
+}
+
+/* True if the entry has not been touched since it was last hashed */
+static bool content_index_stamp_matches(const char *entry, const struct stat *st)
+{
+	char path[PATH_MAX];
+	content_index_stamp_t stored, stamp;
+
+	if (content_index_stamp_path(path, sizeof(path), entry) != 0)
+	{
+		return false;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+	ssize_t got = read(fd, &stored, sizeof(stored));
+	close(fd);
+
+	content_index_stamp(&stamp, st);
+	return got == sizeof(stored) && memcmp(&stored, &stamp, sizeof(stamp)) == 0;
+}
+
+/* Copy the entry into temp, for destinations on another filesystem */
+static int content_index_copy(int src, const char *temp)
+{
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	off_t offset = 0;
+	while (1)
+	{
+		ssize_t n = copy_file_range(src, &offset, fd, NULL, CONTENT_INDEX_COPY_CHUNK, 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0)
+		{
+			// Older kernels copy within one filesystem only
+			uint8_t buf[CONTENT_INDEX_COPY_CHUNK];
+			n = pread(src, buf, sizeof(buf), offset);
+			if (n > 0 && write(fd, buf, n) != n)
+			{
+				n = -1;
+			}
+			offset += n > 0 ? n : 0;
+		}
+		if (n <= 0)
+		{
+			close(fd);
+			return n == 0 ? 0 : -1;
+		}
+	}
+}
+
+int content_index_fetch(const uint8_t hash[CONTENT_INDEX_HASH_SIZE], const char *dest)
+{
+	char entry[PATH_MAX];
+	char temp[PATH_MAX];
+	uint8_t digest[CONTENT_INDEX_HASH_SIZE];
+	struct stat entry_st, dest_st;
+
+	if (index_dir == NULL || content_index_entry(entry, sizeof(entry), hash) != 0 ||
+		atomic_file_temp(temp, sizeof(temp), dest) != 0)
+	{
+		return -1;
+	}
+
+	int src = open(entry, O_RDONLY | O_CLOEXEC);
+	if (src < 0)
+	{
+		return -1;
+	}
+
+	if (fstat(src, &entry_st) != 0)
+	{
+		close(src);
+		return -1;
+	}
+
+	// The entry shares its inode with a destination, which may have been written in place.
+	// Hashing is left for when its size, inode or mtime moved, the request waits for this.
+	if (!content_index_stamp_matches(entry, &entry_st))
+	{
+		char stamp[PATH_MAX];
+		if (sha256_file(src, digest) != 0 || memcmp(digest, hash, sizeof(digest)) != 0)
+		{
+			csp_print("Content index entry '%s' changed, dropping it\n", entry);
+			unlink(entry);
+			if (content_index_stamp_path(stamp, sizeof(stamp), entry) == 0)
+			{
+				unlink(stamp);
+			}
+			close(src);
+			return -1;
+		}
+		content_index_stamp_save(entry, &entry_st);
+	}
+
+	if (stat(dest, &dest_st) == 0 && entry_st.st_dev == dest_st.st_dev && entry_st.st_ino == dest_st.st_ino)
+	{
+		close(src);
+		return 0;
+	}
+
+	int ret = -1;
+	unlink(temp);
+	if (link(entry, temp) == 0 || content_index_copy(src, temp) == 0)
+	{
+		int fd = open(temp, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			ret = atomic_file_commit(fd, temp, dest);
+			close(fd);
+		}
+	}
+	if (ret != 0)
+	{
+		unlink(temp);
+	}
+	close(src);
+	return ret;
+}
+
+int content_index_add(const uint8_t hash[CONTENT_INDEX_HASH_SIZE], const char *path)
+{
+	char entry[PATH_MAX];
+	uint8_t digest[CONTENT_INDEX_HASH_SIZE];
+
+	if (index_dir == NULL || content_index_entry(entry, sizeof(entry), hash) != 0)
+	{
+		return -1;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	struct stat st;
+	int ret = sha256_file(fd, digest);
+	if (ret == 0)
+	{
+		ret = fstat(fd, &st);
+	}
+	close(fd);
+	if (ret != 0 || memcmp(digest, hash, sizeof(digest)) != 0)
+	{
+		csp_print("SHA-256 of '%s' does not match its request, not indexed\n", path);
+		return -1;
+	}
+
+	// An existing entry has the same content, checked again when it is used
+	if (link(path, entry) != 0)
+	{
+		if (errno == EEXIST)
+		{
+			return 0;
+		}
+		csp_print("Cannot add '%s' to the content index: %s\n", path, strerror(errno));
+		return -1;
+	}
+	content_index_stamp_save(entry, &st);
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32.h"
+
+/* Reflected IEEE 802.3 polynomial */
+#define CRC32_POLY 0xEDB88320u
+/* x is primitive modulo the polynomial, its powers repeat every 2^32 - 1 */
+#define CRC32_ORDER 0xFFFFFFFFu
+
+static uint32_t crc32_table[8][256];
+static uint32_t crc32_x2n[32]; // x^(2^n) modulo the polynomial
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/* a * b modulo the polynomial, both reflected */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1u << 31;
+	uint32_t p = 0;
+
+	if (a == 0)
+	{
+		return 0;
+	}
+
+	while (1)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+			{
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return p;
+}
+
+static void crc32_init(void)
+{
+	for (uint32_t n = 0; n < 256; n++)
+	{
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+		{
+			c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		}
+		crc32_table[0][n] = c;
+	}
+
+	for (uint32_t n = 0; n < 256; n++)
+	{
+		for (int k = 1; k < 8; k++)
+		{
+			uint32_t c = crc32_table[k - 1][n];
+			crc32_table[k][n] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+		}
+	}
+
+	uint32_t p = 1u << 30; // x^1
+	for (int n = 0; n < 32; n++)
+	{
+		crc32_x2n[n] = p;
+		p = crc32_multmodp(p, p);
+	}
+}
+
+/* x^e modulo the polynomial */
+static uint32_t crc32_xpow(uint32_t e)
+{
+	uint32_t p = 1u << 31; // x^0
+	for (int k = 0; e; e >>= 1, k++)
+	{
+		if (e & 1)
+		{
+			p = crc32_multmodp(crc32_x2n[k], p);
+		}
+	}
+	return p;
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len && ((uintptr_t)p & 7))
+	{
+		crc = __crc32b(crc, *p++);
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32d(crc, word);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+	{
+		crc = __crc32b(crc, *p++);
+	}
+	return crc;
+}
+
+#else
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	pthread_once(&crc32_once, crc32_init);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len && ((uintptr_t)p & 7))
+	{
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+
+	// Slicing-by-8, one table lookup per input byte but no serial dependency
+	while (len >= 8)
+	{
+		uint32_t lo, hi;
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo ^= crc;
+		crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+			  crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+			  crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+			  crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+#endif
+
+	while (len--)
+	{
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xFF];
+	}
+	return crc;
+}
+
+#endif
+
+/*
+ * The raw CRC of a file is the sum of the raw CRC of each chunk multiplied by
+ * x^(8 * bytes following the chunk). The size is not known until the end, so
+ * each chunk is scaled by x^(-8 * end of chunk) and the sum by x^(8 * size).
+ */
+uint32_t crc32_acc_add(uint32_t acc, uint64_t offset, const void *data, size_t len)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	uint32_t shift = (uint32_t)(((offset + len) * 8) % CRC32_ORDER);
+	return acc ^ crc32_multmodp(crc32_update(0, data, len), crc32_xpow(shift ? CRC32_ORDER - shift : 0));
+}
+
+uint32_t crc32_acc_final(uint32_t acc, uint64_t size)
+{
+	pthread_once(&crc32_once, crc32_init);
+
+	uint32_t shift = crc32_xpow((uint32_t)((size * 8) % CRC32_ORDER));
+	// Account for the initial value of the standard CRC, then invert
+	return ~(crc32_multmodp(acc, shift) ^ crc32_multmodp(0xFFFFFFFF, shift));
+}
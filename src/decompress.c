@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+
+#ifdef UPLOAD_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "decompress.h"
+#include "atomic_file.h"
+
+bool decompress_supported(upload_compression_t type)
+{
+	switch (type)
+	{
+	case UPLOAD_COMPRESSION_NONE:
+		return true;
+#ifdef UPLOAD_HAVE_ZSTD
+	case UPLOAD_COMPRESSION_ZSTD:
+		return true;
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+	case UPLOAD_COMPRESSION_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+int decompress_flush(decompress_t *dec)
+{
+	const uint8_t *buf = dec->out;
+	size_t remaining = dec->out_used;
+
+	if (dec->delta)
+	{
+		dec->out_used = 0;
+		dec->error |= delta_feed(dec->delta, buf, remaining) != 0;
+		return dec->error ? -1 : 0;
+	}
+
+	while (remaining > 0)
+	{
+		ssize_t written = write(dec->fd, buf, remaining);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			dec->error = true;
+			return -1;
+		}
+		buf += written;
+		remaining -= written;
+	}
+	dec->out_used = 0;
+	return 0;
+}
+
+int decompress_mem_init(decompress_mem_t *mem)
+{
+#ifdef UPLOAD_HAVE_ZSTD
+	ZSTD_DCtx *zstd = ZSTD_createDCtx();
+	if (zstd == NULL)
+	{
+		return -1;
+	}
+	ZSTD_DCtx_setParameter(zstd, ZSTD_d_windowLogMax, DECOMPRESS_ZSTD_WINDOW_LOG);
+	mem->ctx[UPLOAD_COMPRESSION_ZSTD] = zstd;
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+	LZ4F_dctx *lz4;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4, LZ4F_VERSION)))
+	{
+		decompress_mem_free(mem);
+		return -1;
+	}
+	mem->ctx[UPLOAD_COMPRESSION_LZ4] = lz4;
+#endif
+	(void)mem;
+	return 0;
+}
+
+void decompress_mem_free(decompress_mem_t *mem)
+{
+#ifdef UPLOAD_HAVE_ZSTD
+	ZSTD_freeDCtx(mem->ctx[UPLOAD_COMPRESSION_ZSTD]);
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+	LZ4F_freeDecompressionContext(mem->ctx[UPLOAD_COMPRESSION_LZ4]);
+#endif
+	for (int i = 0; i < UPLOAD_COMPRESSION_COUNT; i++)
+	{
+		mem->ctx[i] = NULL;
+	}
+}
+
+/* Reset the context of an encoding for a new stream */
+static void decompress_ctx_reset(decompress_mem_t *mem, upload_compression_t type)
+{
+	switch (type)
+	{
+#ifdef UPLOAD_HAVE_ZSTD
+	case UPLOAD_COMPRESSION_ZSTD:
+		ZSTD_DCtx_reset(mem->ctx[type], ZSTD_reset_session_only);
+		break;
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+	case UPLOAD_COMPRESSION_LZ4:
+		LZ4F_resetDecompressionContext(mem->ctx[type]);
+		break;
+#endif
+	default:
+		(void)mem;
+		break;
+	}
+}
+
+int decompress_open(decompress_t *dec, upload_compression_t type, const char *path, delta_t *delta, decompress_mem_t *mem)
+{
+	dec->type = type;
+	dec->ctx = NULL;
+	dec->delta = delta;
+	dec->fd = -1;
+	dec->consumed = 0;
+	dec->produced = 0;
+	dec->done = true;
+	dec->error = false;
+	dec->in = mem->in;
+	dec->out = mem->out;
+	dec->out_used = 0;
+
+	if (!decompress_supported(type))
+	{
+		csp_print("Compression type %u is not supported\n", type);
+		return -1;
+	}
+	decompress_ctx_reset(mem, type);
+	dec->ctx = mem->ctx[type];
+
+	if (delta == NULL)
+	{
+		if (strlen(path) >= sizeof(dec->path) || atomic_file_temp(dec->temp, sizeof(dec->temp), path) != 0)
+		{
+			return -1;
+		}
+		strcpy(dec->path, path);
+		dec->fd = open(dec->temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (dec->fd < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int decompress_feed(decompress_t *dec, const void *data, size_t len)
+{
+	size_t pos = 0;
+	bool full;
+
+	if (dec->error)
+	{
+		return -1;
+	}
+
+	// Keep going while there is input left or the decoder filled the output
+	do
+	{
+		size_t space = DECOMPRESS_OUT_SIZE - dec->out_used;
+		size_t produced = 0;
+
+		switch (dec->type)
+		{
+		case UPLOAD_COMPRESSION_NONE:
+			// Uncompressed delta, passed on as it is
+			produced = len - pos < space ? len - pos : space;
+			memcpy(dec->out + dec->out_used, (const uint8_t *)data + pos, produced);
+			pos += produced;
+			break;
+#ifdef UPLOAD_HAVE_ZSTD
+		case UPLOAD_COMPRESSION_ZSTD:
+		{
+			ZSTD_inBuffer in = {data, len, pos};
+			ZSTD_outBuffer out = {dec->out + dec->out_used, space, 0};
+			size_t ret = ZSTD_decompressStream(dec->ctx, &out, &in);
+			if (ZSTD_isError(ret))
+			{
+				csp_print("zstd: %s\n", ZSTD_getErrorName(ret));
+				dec->error = true;
+				return -1;
+			}
+			produced = out.pos;
+			// Once a frame ended, a call without input already expects the next one
+			if (in.pos > pos || produced > 0)
+			{
+				dec->done = ret == 0;
+			}
+			pos = in.pos;
+			break;
+		}
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+		case UPLOAD_COMPRESSION_LZ4:
+		{
+			size_t src_size = len - pos;
+			produced = space;
+			size_t ret = LZ4F_decompress(dec->ctx, dec->out + dec->out_used, &produced, (const uint8_t *)data + pos, &src_size, NULL);
+			if (LZ4F_isError(ret))
+			{
+				csp_print("lz4: %s\n", LZ4F_getErrorName(ret));
+				dec->error = true;
+				return -1;
+			}
+			if (src_size > 0 || produced > 0)
+			{
+				dec->done = ret == 0;
+			}
+			pos += src_size;
+			break;
+		}
+#endif
+		default:
+			dec->error = true;
+			return -1;
+		}
+
+		dec->out_used += produced;
+		dec->produced += produced;
+		full = produced == space;
+		if (full && decompress_flush(dec) != 0)
+		{
+			return -1;
+		}
+	} while (pos < len || full);
+
+	dec->consumed += len;
+	return 0;
+}
+
+int decompress_catch_up(decompress_t *dec, int src_fd, uint64_t end)
+{
+	while (dec->consumed < end && !dec->error)
+	{
+		uint64_t wanted = end - dec->consumed;
+		size_t len = wanted < DECOMPRESS_IN_SIZE ? wanted : DECOMPRESS_IN_SIZE;
+
+		ssize_t got = pread(src_fd, dec->in, len, dec->consumed);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			dec->error = true;
+			break;
+		}
+		decompress_feed(dec, dec->in, got);
+	}
+	return dec->error ? -1 : 0;
+}
+
+int decompress_close(decompress_t *dec, bool complete)
+{
+	int ret = 0;
+
+	decompress_flush(dec);
+	if (complete && (dec->error || !dec->done))
+	{
+		csp_print("Encoded payload is %s\n", dec->error ? "corrupt" : "truncated");
+		ret = -1;
+	}
+
+	if (dec->fd >= 0)
+	{
+		if (complete && ret == 0 && atomic_file_commit(dec->fd, dec->temp, dec->path) != 0)
+		{
+			ret = -1;
+		}
+		close(dec->fd);
+		if (!complete || ret != 0)
+		{
+			// Decoded again from the start when the upload is resumed
+			unlink(dec->temp);
+		}
+	}
+	dec->ctx = NULL;
+	dec->fd = -1;
+	dec->in = NULL;
+	dec->out = NULL;
+	return ret;
+}
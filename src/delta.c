@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+
+#include "delta.h"
+#include "atomic_file.h"
+#include "crc32.h"
+
+enum
+{
+	DELTA_STATE_FIELD, // collecting the header or the arguments of op
+	DELTA_STATE_OP,
+	DELTA_STATE_BYTES, // payload of a DATA or ADD operation
+	DELTA_STATE_END,
+};
+
+/* Internal op while the header is collected */
+#define DELTA_OP_HEADER 0xFF
+
+static uint32_t delta_u32(const uint8_t *p)
+{
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t delta_u64(const uint8_t *p)
+{
+	return delta_u32(p) | (uint64_t)delta_u32(p + 4) << 32;
+}
+
+static void delta_fail(delta_t *delta, const char *reason)
+{
+	csp_print("Delta for '%s': %s\n", delta->path, reason);
+	delta->error = true;
+}
+
+static int delta_flush(delta_t *delta)
+{
+	const uint8_t *buf = delta->out;
+	size_t remaining = delta->out_used;
+
+	while (remaining > 0)
+	{
+		ssize_t written = write(delta->fd, buf, remaining);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			delta_fail(delta, "write failed");
+			return -1;
+		}
+		buf += written;
+		remaining -= written;
+	}
+	delta->out_used = 0;
+	return 0;
+}
+
+/* Room for up to len more output bytes, 0 on failure */
+static size_t delta_space(delta_t *delta, uint64_t len)
+{
+	if (delta->out_used == DELTA_OUT_SIZE && delta_flush(delta) != 0)
+	{
+		return 0;
+	}
+	size_t space = DELTA_OUT_SIZE - delta->out_used;
+	return len < space ? len : space;
+}
+
+/* Read len base bytes at offset into the output buffer */
+static int delta_read_base(delta_t *delta, uint64_t offset, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t got = pread(delta->base_fd, delta->out + delta->out_used, len, offset);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			delta_fail(delta, "read past the end of the base");
+			return -1;
+		}
+		delta->out_used += got;
+		offset += got;
+		len -= got;
+	}
+	return 0;
+}
+
+/* CRC-32 of the whole base, -1 if it cannot be read */
+static int delta_base_checksum(delta_t *delta)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	off_t offset = 0;
+	ssize_t got;
+
+	// The output buffer is still empty while the patcher is opened
+	while ((got = pread(delta->base_fd, delta->out, DELTA_OUT_SIZE, offset)) != 0)
+	{
+		if (got < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		crc = crc32_update(crc, delta->out, got);
+		offset += got;
+	}
+	delta->base_crc = ~crc;
+	return 0;
+}
+
+static void delta_copy(delta_t *delta, uint64_t offset, uint32_t len)
+{
+	while (len > 0 && !delta->error)
+	{
+		size_t n = delta_space(delta, len);
+		if (n == 0 || delta_read_base(delta, offset, n) != 0)
+		{
+			return;
+		}
+		offset += n;
+		len -= n;
+	}
+}
+
+static void delta_add(delta_t *delta, const uint8_t *diff, size_t len)
+{
+	while (len > 0 && !delta->error)
+	{
+		size_t n = delta_space(delta, len);
+		uint8_t *out = delta->out + delta->out_used;
+		if (n == 0 || delta_read_base(delta, delta->base_offset, n) != 0)
+		{
+			return;
+		}
+		for (size_t i = 0; i < n; i++)
+		{
+			out[i] += diff[i];
+		}
+		delta->base_offset += n;
+		diff += n;
+		len -= n;
+	}
+}
+
+static void delta_data(delta_t *delta, const uint8_t *data, size_t len)
+{
+	while (len > 0 && !delta->error)
+	{
+		size_t n = delta_space(delta, len);
+		if (n == 0)
+		{
+			return;
+		}
+		memcpy(delta->out + delta->out_used, data, n);
+		delta->out_used += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Count output of an operation against the size from the header */
+static bool delta_grow(delta_t *delta, uint64_t len)
+{
+	if (len > delta->size - delta->produced)
+	{
+		delta_fail(delta, "output exceeds the announced size");
+		return false;
+	}
+	delta->produced += len;
+	return true;
+}
+
+/* The header or the arguments of the current operation are complete */
+static void delta_field_done(delta_t *delta)
+{
+	const uint8_t *f = delta->field;
+
+	delta->state = DELTA_STATE_OP;
+	switch (delta->op)
+	{
+	case DELTA_OP_HEADER:
+		delta->size = delta_u64(&f[4]);
+		if (delta_u32(f) != DELTA_MAGIC)
+		{
+			delta_fail(delta, "bad magic");
+		}
+		else if (delta->base_crc != delta_u32(&f[12]))
+		{
+			delta_fail(delta, "base file does not match");
+		}
+		break;
+	case DELTA_OP_COPY:
+		if (delta_grow(delta, delta_u32(&f[8])))
+		{
+			delta_copy(delta, delta_u64(f), delta_u32(&f[8]));
+		}
+		break;
+	case DELTA_OP_DATA:
+		delta->remaining = delta_u32(f);
+		break;
+	case DELTA_OP_ADD:
+		delta->base_offset = delta_u64(f);
+		delta->remaining = delta_u32(&f[8]);
+		break;
+	}
+
+	if (delta->remaining > 0 && delta_grow(delta, delta->remaining))
+	{
+		delta->state = DELTA_STATE_BYTES;
+	}
+}
+
+static void delta_start_op(delta_t *delta, uint8_t op)
+{
+	delta->op = op;
+	delta->field_used = 0;
+	delta->remaining = 0;
+	delta->state = DELTA_STATE_FIELD;
+
+	switch (op)
+	{
+	case DELTA_OP_END:
+		delta->state = DELTA_STATE_END;
+		delta->done = delta->produced == delta->size;
+		if (!delta->done)
+		{
+			delta_fail(delta, "ended before the announced size");
+		}
+		break;
+	case DELTA_OP_COPY:
+	case DELTA_OP_ADD:
+		delta->field_size = 12;
+		break;
+	case DELTA_OP_DATA:
+		delta->field_size = 4;
+		break;
+	default:
+		delta_fail(delta, "unknown operation");
+		break;
+	}
+}
+
+int delta_open(delta_t *delta, const char *base, const char *path, uint8_t *out)
+{
+	if (strlen(path) >= sizeof(delta->path) || atomic_file_temp(delta->temp, sizeof(delta->temp), path) != 0)
+	{
+		return -1;
+	}
+
+	delta->base_fd = open(base, O_RDONLY | O_CLOEXEC);
+	if (delta->base_fd < 0)
+	{
+		csp_print("Base file '%s' not found\n", base);
+		return -1;
+	}
+
+	// Checked here rather than when the header arrives, which happens on the receiving thread
+	delta->out = out;
+	if (delta_base_checksum(delta) != 0)
+	{
+		csp_print("Base file '%s' cannot be read\n", base);
+		close(delta->base_fd);
+		return -1;
+	}
+
+	delta->fd = open(delta->temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (delta->fd < 0)
+	{
+		close(delta->base_fd);
+		return -1;
+	}
+
+	strcpy(delta->path, path);
+	delta->size = 0;
+	delta->produced = 0;
+	delta->done = false;
+	delta->error = false;
+	delta->out_used = 0;
+	delta->op = DELTA_OP_HEADER;
+	delta->state = DELTA_STATE_FIELD;
+	delta->field_used = 0;
+	delta->field_size = 16;
+	delta->remaining = 0;
+	return 0;
+}
+
+int delta_feed(delta_t *delta, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+	size_t pos = 0;
+
+	while (pos < len && !delta->error)
+	{
+		switch (delta->state)
+		{
+		case DELTA_STATE_FIELD:
+		{
+			size_t n = delta->field_size - delta->field_used;
+			n = n < len - pos ? n : len - pos;
+			memcpy(&delta->field[delta->field_used], &src[pos], n);
+			delta->field_used += n;
+			pos += n;
+			if (delta->field_used == delta->field_size)
+			{
+				delta_field_done(delta);
+			}
+			break;
+		}
+		case DELTA_STATE_OP:
+			delta_start_op(delta, src[pos++]);
+			break;
+		case DELTA_STATE_BYTES:
+		{
+			size_t n = delta->remaining < len - pos ? delta->remaining : len - pos;
+			if (delta->op == DELTA_OP_ADD)
+			{
+				delta_add(delta, &src[pos], n);
+			}
+			else
+			{
+				delta_data(delta, &src[pos], n);
+			}
+			pos += n;
+			delta->remaining -= n;
+			if (delta->remaining == 0)
+			{
+				delta->state = DELTA_STATE_OP;
+			}
+			break;
+		}
+		case DELTA_STATE_END:
+			delta_fail(delta, "data after END");
+			break;
+		}
+	}
+	return delta->error ? -1 : 0;
+}
+
+int delta_close(delta_t *delta, bool complete)
+{
+	int ret = 0;
+
+	delta_flush(delta);
+
+	if (complete && (!delta->done || delta->error || atomic_file_commit(delta->fd, delta->temp, delta->path) != 0))
+	{
+		ret = -1;
+	}
+
+	close(delta->fd);
+	close(delta->base_fd);
+	if (!complete || ret != 0)
+	{
+		// Rebuilt from the start when the upload is resumed
+		unlink(delta->temp);
+	}
+	delta->out = NULL;
+	delta->fd = -1;
+	delta->base_fd = -1;
+	return ret;
+}
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fec.h"
+#include "gf256.h"
+
+/* Coefficient of source packet i in repair packet j */
+static uint8_t fec_coef(uint32_t j, uint32_t i)
+{
+	return gf256_inv((255 - j) ^ i);
+}
+
+/* Bytes of payload in packet seq, the last one may be short */
+static size_t fec_packet_len(const fec_t *fec, uint32_t seq)
+{
+	uint64_t start = (uint64_t)seq * fec->symbol_size;
+	return fec->size - start < fec->symbol_size ? fec->size - start : fec->symbol_size;
+}
+
+/* Source packets of a block, fewer for the last one */
+static uint32_t fec_block_len(const fec_t *fec, uint32_t block)
+{
+	uint32_t first = block * fec->source;
+	return fec->packets - first < fec->source ? fec->packets - first : fec->source;
+}
+
+/* Positions in the block of the source packets not received yet */
+static uint32_t fec_missing(const fec_t *fec, const resume_map_t *map, uint32_t block, uint8_t *out, uint32_t max)
+{
+	uint32_t first = block * fec->source;
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < fec_block_len(fec, block); i++)
+	{
+		if (!resume_map_contains(map, first + i))
+		{
+			if (count < max)
+			{
+				out[count] = i;
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+bool fec_supported(uint32_t source, uint32_t repair, uint32_t symbol_size, uint64_t size)
+{
+	return source != 0 && repair != 0 && repair <= FEC_MAX_REPAIR && source + repair <= FEC_MAX_SYMBOLS &&
+		   symbol_size != 0 && symbol_size <= FEC_MAX_SYMBOL_SIZE && size != 0;
+}
+
+int fec_open(fec_t *fec, uint8_t *mem, uint32_t source, uint32_t repair, uint32_t symbol_size, uint64_t size)
+{
+	memset(fec, 0, sizeof(*fec));
+	if (!fec_supported(source, repair, symbol_size, size))
+	{
+		return -1;
+	}
+
+	fec->source = source;
+	fec->repair = repair;
+	fec->symbol_size = symbol_size;
+	fec->size = size;
+	fec->packets = (size + symbol_size - 1) / symbol_size;
+	for (int i = 0; i < FEC_WINDOW_BLOCKS; i++)
+	{
+		fec->blocks[i].block = FEC_NO_BLOCK;
+		fec->blocks[i].symbols = &mem[i * FEC_MAX_REPAIR * FEC_MAX_SYMBOL_SIZE];
+	}
+	fec->scratch = &mem[FEC_WINDOW_BLOCKS * FEC_MAX_REPAIR * FEC_MAX_SYMBOL_SIZE];
+	return 0;
+}
+
+void fec_close(fec_t *fec)
+{
+	fec->source = 0;
+}
+
+fec_block_t *fec_add_repair(fec_t *fec, const resume_map_t *map, uint32_t seq, const void *data, size_t len)
+{
+	uint32_t n = seq & ~FEC_REPAIR_FLAG;
+	uint8_t missing[FEC_MAX_REPAIR];
+
+	if (!fec_enabled(fec) || len != fec->symbol_size)
+	{
+		return NULL;
+	}
+
+	uint32_t b = n / fec->repair;
+	uint32_t j = n % fec->repair;
+	if (b >= (fec->packets + fec->source - 1) / fec->source)
+	{
+		return NULL;
+	}
+
+	// A block is replaced by the one a window later, its repairs arrive in order
+	fec_block_t *block = &fec->blocks[b % FEC_WINDOW_BLOCKS];
+	if (block->block != b)
+	{
+		block->block = b;
+		block->done = false;
+		block->count = 0;
+	}
+	if (block->done || memchr(block->index, j, block->count) != NULL)
+	{
+		return NULL;
+	}
+
+	memcpy(&block->symbols[block->count * fec->symbol_size], data, len);
+	block->index[block->count++] = j;
+
+	uint32_t lost = fec_missing(fec, map, b, missing, sizeof(missing));
+	if (lost == 0)
+	{
+		block->done = true;
+		return NULL;
+	}
+	return lost <= block->count ? block : NULL;
+}
+
+/* Invert an n x n matrix in place, Gauss-Jordan */
+static int fec_invert(uint8_t m[FEC_MAX_REPAIR][FEC_MAX_REPAIR], uint32_t n)
+{
+	uint8_t inv[FEC_MAX_REPAIR][FEC_MAX_REPAIR] = {{0}};
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		inv[i][i] = 1;
+	}
+
+	for (uint32_t col = 0; col < n; col++)
+	{
+		uint32_t pivot = col;
+		while (pivot < n && m[pivot][col] == 0)
+		{
+			pivot++;
+		}
+		if (pivot == n)
+		{
+			return -1;
+		}
+		if (pivot != col)
+		{
+			uint8_t t[FEC_MAX_REPAIR];
+			memcpy(t, m[col], sizeof(t));
+			memcpy(m[col], m[pivot], sizeof(t));
+			memcpy(m[pivot], t, sizeof(t));
+			memcpy(t, inv[col], sizeof(t));
+			memcpy(inv[col], inv[pivot], sizeof(t));
+			memcpy(inv[pivot], t, sizeof(t));
+		}
+
+		uint8_t scale = gf256_inv(m[col][col]);
+		for (uint32_t k = 0; k < n; k++)
+		{
+			m[col][k] = gf256_mul(m[col][k], scale);
+			inv[col][k] = gf256_mul(inv[col][k], scale);
+		}
+		for (uint32_t row = 0; row < n; row++)
+		{
+			uint8_t f = m[row][col];
+			if (row == col || f == 0)
+			{
+				continue;
+			}
+			for (uint32_t k = 0; k < n; k++)
+			{
+				m[row][k] ^= gf256_mul(f, m[col][k]);
+				inv[row][k] ^= gf256_mul(f, inv[col][k]);
+			}
+		}
+	}
+
+	memcpy(m, inv, sizeof(inv));
+	return 0;
+}
+
+static int fec_read(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+	while (len > 0)
+	{
+		ssize_t n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+int fec_decode(fec_t *fec, fec_block_t *block, const resume_map_t *map, int fd, fec_deliver_t deliver, void *ctx)
+{
+	uint8_t missing[FEC_MAX_REPAIR];
+	uint8_t m[FEC_MAX_REPAIR][FEC_MAX_REPAIR] = {{0}};
+	uint32_t first = block->block * fec->source;
+	uint32_t size = fec->symbol_size;
+
+	uint32_t lost = fec_missing(fec, map, block->block, missing, sizeof(missing));
+	if (lost > block->count)
+	{
+		return 0;
+	}
+
+	// Take the received packets out of the first repairs, leaving only the lost ones in them
+	for (uint32_t i = 0; i < fec_block_len(fec, block->block); i++)
+	{
+		if (!resume_map_contains(map, first + i))
+		{
+			continue;
+		}
+		size_t len = fec_packet_len(fec, first + i);
+		memset(&fec->scratch[len], 0, size - len);
+		if (fec_read(fd, fec->scratch, len, (off_t)(first + i) * size) != 0)
+		{
+			return -1;
+		}
+		for (uint32_t a = 0; a < lost; a++)
+		{
+			gf256_muladd(&block->symbols[a * size], fec->scratch, fec_coef(block->index[a], i), size);
+		}
+	}
+
+	for (uint32_t a = 0; a < lost; a++)
+	{
+		for (uint32_t k = 0; k < lost; k++)
+		{
+			m[a][k] = fec_coef(block->index[a], missing[k]);
+		}
+	}
+	if (fec_invert(m, lost) != 0)
+	{
+		return -1;
+	}
+
+	block->done = true;
+	for (uint32_t k = 0; k < lost; k++)
+	{
+		memset(fec->scratch, 0, size);
+		for (uint32_t a = 0; a < lost; a++)
+		{
+			gf256_muladd(fec->scratch, &block->symbols[a * size], m[k][a], size);
+		}
+		uint32_t seq = first + missing[k];
+		if (deliver(ctx, seq, fec->scratch, fec_packet_len(fec, seq)) != 0)
+		{
+			return -1;
+		}
+	}
+	fec->recovered += lost;
+	return 0;
+}
@@ -0,0 +1,852 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <csp/csp.h>
+
+#include "file_sink.h"
+#include "atomic_file.h"
+#include "crc32.h"
+#include "telemetry.h"
+#include "trace.h"
+
+/* Sink of the session running on this thread */
+static __thread upload_sink_t *bound_sink = NULL;
+/* Part of a striped upload requested by sessions on this thread */
+static __thread upload_sink_ranges_t *bound_ranges = NULL;
+
+/* Wakes the threads waiting for any sink to be opened, opens are rare */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t open_done = PTHREAD_COND_INITIALIZER;
+
+/* Bytes of the payload received without a gap from its start */
+static uint64_t upload_sink_prefix(const upload_sink_t *sink)
+{
+	uint64_t end = (uint64_t)resume_map_prefix(&sink->map) * sink->packet_size;
+	return end < (uint64_t)sink->size ? end : (uint64_t)sink->size;
+}
+
+/* Layout of the memory of a sink, the write-behind blocks first to keep them aligned */
+#define UPLOAD_SINK_MEM_INTERVALS (UPLOAD_SINK_WRITE_BLOCKS * UPLOAD_SINK_BLOCK_SIZE)
+#define UPLOAD_SINK_MEM_SNAPSHOT (UPLOAD_SINK_MEM_INTERVALS + UPLOAD_SINK_MAX_INTERVALS * sizeof(resume_interval_t))
+#define UPLOAD_SINK_SNAPSHOT_INTERVALS (UPLOAD_SINK_WRITE_BLOCKS > 1 ? UPLOAD_SINK_MAX_INTERVALS : 0)
+#define UPLOAD_SINK_MEM_DELTA (UPLOAD_SINK_MEM_SNAPSHOT + UPLOAD_SINK_SNAPSHOT_INTERVALS * sizeof(resume_interval_t))
+#define UPLOAD_SINK_MEM_FEC (UPLOAD_SINK_MEM_DELTA + DELTA_OUT_SIZE)
+#define UPLOAD_SINK_MEM_DECODE_IN (UPLOAD_SINK_MEM_FEC + FEC_MEM_SIZE)
+#define UPLOAD_SINK_MEM_DECODE_OUT (UPLOAD_SINK_MEM_DECODE_IN + DECOMPRESS_IN_SIZE)
+#define UPLOAD_SINK_MEM_END (UPLOAD_SINK_MEM_DECODE_OUT + DECOMPRESS_OUT_SIZE)
+
+size_t upload_sink_mem_size(void)
+{
+	return (UPLOAD_SINK_MEM_END + UPLOAD_SINK_BLOCK_ALIGN - 1) / UPLOAD_SINK_BLOCK_ALIGN * UPLOAD_SINK_BLOCK_ALIGN;
+}
+
+void upload_sink_mem_init(upload_sink_mem_t *mem, uint8_t *base)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->block = base;
+	mem->intervals = (resume_interval_t *)(base + UPLOAD_SINK_MEM_INTERVALS);
+	mem->snapshot = UPLOAD_SINK_SNAPSHOT_INTERVALS ? (resume_interval_t *)(base + UPLOAD_SINK_MEM_SNAPSHOT) : NULL;
+	mem->delta_out = base + UPLOAD_SINK_MEM_DELTA;
+	mem->fec = base + UPLOAD_SINK_MEM_FEC;
+	mem->decoder.in = base + UPLOAD_SINK_MEM_DECODE_IN;
+	mem->decoder.out = base + UPLOAD_SINK_MEM_DECODE_OUT;
+}
+
+/* Start decoding a staged payload into its destination */
+static int upload_sink_open_decoder(upload_sink_t *sink, const char *path, const char *base)
+{
+	delta_t *patch = sink->delta ? &sink->patch : NULL;
+
+	if (patch && delta_open(patch, base, path, sink->mem.delta_out) != 0)
+	{
+		return -1;
+	}
+	if (decompress_open(&sink->decoder, sink->compression, path, patch, &sink->mem.decoder) != 0)
+	{
+		if (patch)
+		{
+			delta_close(patch, false);
+		}
+		return -1;
+	}
+
+	// The decoder state is not saved, a resumed upload is decoded again from the start
+	if (decompress_catch_up(&sink->decoder, sink->fd, upload_sink_prefix(sink)) != 0)
+	{
+		decompress_close(&sink->decoder, false);
+		if (patch)
+		{
+			delta_close(patch, false);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/* The sidecar holds the checkpoint, io_lock held */
+static void upload_sink_stored_locked(upload_sink_t *sink, int res)
+{
+	upload_sink_ckpt_t *ckpt = &sink->ckpt;
+
+	if (res < 0)
+	{
+		sink->io_error = true;
+	}
+	trace_complete(TRACE_CHECKPOINT, 0, ckpt->map.received, ckpt->start_ns);
+	ckpt->state = UPLOAD_SINK_CKPT_IDLE;
+	pthread_cond_broadcast(&sink->io_done);
+}
+
+static void upload_sink_stored(uring_writer_op_t *op, int res)
+{
+	upload_sink_ckpt_t *ckpt = (upload_sink_ckpt_t *)((char *)op - offsetof(upload_sink_ckpt_t, store));
+	upload_sink_t *sink = ckpt->sink;
+
+	pthread_mutex_lock(&sink->io_lock);
+	upload_sink_stored_locked(sink, res);
+	pthread_mutex_unlock(&sink->io_lock);
+}
+
+/* The data of a checkpoint is durable, the sidecar may claim it now, io_lock held */
+static void upload_sink_synced_locked(upload_sink_t *sink, int res)
+{
+	upload_sink_ckpt_t *ckpt = &sink->ckpt;
+
+	if (res < 0 || sink->io_error)
+	{
+		sink->io_error = true;
+		ckpt->state = UPLOAD_SINK_CKPT_IDLE;
+		pthread_cond_broadcast(&sink->io_done);
+	}
+	else
+	{
+		off_t offset = resume_map_header(&ckpt->map, ckpt->header);
+		ckpt->iov[0].iov_base = ckpt->header;
+		ckpt->iov[0].iov_len = sizeof(ckpt->header);
+		ckpt->iov[1].iov_base = ckpt->map.intervals;
+		ckpt->iov[1].iov_len = ckpt->map.count * sizeof(resume_interval_t);
+		ckpt->state = UPLOAD_SINK_CKPT_STORE;
+		if (uring_writer_writev_sync(&ckpt->store, ckpt->map.fd, ckpt->iov, 2, offset) != 0)
+		{
+			ssize_t written = pwritev(ckpt->map.fd, ckpt->iov, 2, offset);
+			upload_sink_stored_locked(sink, written < 0 || fdatasync(ckpt->map.fd) != 0 ? -errno : 0);
+		}
+	}
+}
+
+static void upload_sink_synced(uring_writer_op_t *op, int res)
+{
+	upload_sink_ckpt_t *ckpt = (upload_sink_ckpt_t *)((char *)op - offsetof(upload_sink_ckpt_t, sync));
+	upload_sink_t *sink = ckpt->sink;
+
+	pthread_mutex_lock(&sink->io_lock);
+	upload_sink_synced_locked(sink, res);
+	pthread_mutex_unlock(&sink->io_lock);
+}
+
+/* Start the sync of a checkpoint once the blocks it covers are written, io_lock held */
+static void upload_sink_checkpoint_continue(upload_sink_t *sink)
+{
+	upload_sink_ckpt_t *ckpt = &sink->ckpt;
+
+	if (ckpt->state != UPLOAD_SINK_CKPT_WRITES)
+	{
+		return;
+	}
+	for (int i = 0; i < UPLOAD_SINK_WRITE_BLOCKS; i++)
+	{
+		if (sink->io[i].seq != 0 && sink->io[i].seq <= ckpt->barrier)
+		{
+			return;
+		}
+	}
+	ckpt->state = UPLOAD_SINK_CKPT_SYNC;
+	if (uring_writer_sync(&ckpt->sync, sink->fd) != 0)
+	{
+		// No room on the ring, sync here instead
+		upload_sink_synced_locked(sink, fdatasync(sink->fd) == 0 ? 0 : -errno);
+	}
+}
+
+/* A block reached the staging file, io_lock held */
+static void upload_sink_written_locked(upload_sink_io_t *io, int res)
+{
+	upload_sink_t *sink = io->sink;
+
+	if (res != (int)io->len)
+	{
+		sink->io_error = true;
+	}
+	telemetry_write(upload_stats_now() - io->start_ns);
+	trace_complete(TRACE_WRITE, 0, io->len, io->start_ns);
+	io->seq = 0;
+	upload_sink_checkpoint_continue(sink);
+	pthread_cond_broadcast(&sink->io_done);
+}
+
+/* Runs on the writer thread */
+static void upload_sink_written(uring_writer_op_t *op, int res)
+{
+	upload_sink_io_t *io = (upload_sink_io_t *)op;
+	upload_sink_t *sink = io->sink;
+
+	pthread_mutex_lock(&sink->io_lock);
+	upload_sink_written_locked(io, res);
+	pthread_mutex_unlock(&sink->io_lock);
+}
+
+static void upload_sink_io_init(upload_sink_t *sink)
+{
+	sink->async = UPLOAD_SINK_WRITE_BLOCKS > 1 && uring_writer_enabled();
+	sink->block_index = 0;
+	sink->io_seq = 0;
+	sink->io_error = false;
+	for (int i = 0; i < UPLOAD_SINK_WRITE_BLOCKS; i++)
+	{
+		sink->io[i].op.done = upload_sink_written;
+		sink->io[i].sink = sink;
+		sink->io[i].seq = 0;
+	}
+	sink->ckpt.sync.done = upload_sink_synced;
+	sink->ckpt.store.done = upload_sink_stored;
+	sink->ckpt.sink = sink;
+	sink->ckpt.state = UPLOAD_SINK_CKPT_IDLE;
+
+	// Not every filesystem takes O_DIRECT, those blocks then go through the page cache
+	sink->direct_fd = sink->async ? open(sink->path, O_WRONLY | O_DIRECT | O_CLOEXEC) : -1;
+	pthread_mutex_init(&sink->io_lock, NULL);
+	pthread_cond_init(&sink->io_done, NULL);
+}
+
+int upload_sink_open(upload_sink_t *sink, const char *path, uint32_t mtu, bool resume, upload_compression_t compression, const char *base)
+{
+	struct stat st;
+
+	if (mtu <= DTP_PACKET_HEADER_SIZE || !decompress_supported(compression))
+	{
+		return -1;
+	}
+
+	sink->compression = compression;
+	sink->delta = base != NULL;
+	sink->staged = sink->delta || compression != UPLOAD_COMPRESSION_NONE;
+	if (snprintf(sink->path, sizeof(sink->path), "%s%s", path, UPLOAD_SINK_STAGE_SUFFIX) >= (int)sizeof(sink->path))
+	{
+		return -1;
+	}
+
+	sink->block = sink->mem.block;
+	sink->block_len = 0;
+
+	// Read access lets the decoder catch up from packets that arrived out of order
+	sink->fd = open(sink->path, O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+	if (sink->fd < 0)
+	{
+		return -1;
+	}
+
+	if (fstat(sink->fd, &st) != 0 || resume_map_open(&sink->map, sink->path, resume, sink->mem.intervals, UPLOAD_SINK_MAX_INTERVALS) != 0)
+	{
+		close(sink->fd);
+		sink->fd = -1;
+		return -1;
+	}
+
+	sink->packet_size = mtu - DTP_PACKET_HEADER_SIZE;
+	if (resume && sink->map.packet_size != 0)
+	{
+		// Offsets of the stored packets depend on the MTU of the first session
+		sink->packet_size = sink->map.packet_size;
+	}
+	sink->map.packet_size = sink->packet_size;
+	sink->allocated = st.st_size;
+	sink->size = st.st_size;
+	sink->expected = 0;
+	sink->resume = resume;
+	sink->failed = false;
+	sink->stats = NULL;
+	fec_close(&sink->fec);
+
+	if (sink->staged && upload_sink_open_decoder(sink, path, base) != 0)
+	{
+		resume_map_close(&sink->map, sink->path, false);
+		close(sink->fd);
+		sink->fd = -1;
+		return -1;
+	}
+	pthread_mutex_init(&sink->lock, NULL);
+	upload_sink_io_init(sink);
+	return 0;
+}
+
+/* Reserve space ahead of the write position so the file grows in large extents */
+static void upload_sink_reserve(upload_sink_t *sink, off_t end)
+{
+	if (end <= sink->allocated)
+	{
+		return;
+	}
+
+	off_t target = (end + UPLOAD_SINK_PREALLOC_STEP - 1) / UPLOAD_SINK_PREALLOC_STEP * UPLOAD_SINK_PREALLOC_STEP;
+	if (fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, sink->allocated, target - sink->allocated) != 0)
+	{
+		// Filesystem without fallocate support, let the writes extend the file
+		if (errno != EOPNOTSUPP && errno != ENOSYS)
+		{
+			csp_print("fallocate failed: %d\n", errno);
+		}
+	}
+	sink->allocated = target;
+}
+
+void upload_sink_set_size(upload_sink_t *sink, uint64_t size)
+{
+	sink->expected = size;
+	upload_sink_reserve(sink, size);
+}
+
+/* The packet number comes from the link, its offset must stay inside the payload */
+static bool upload_sink_in_range(const upload_sink_t *sink, uint32_t seq, size_t len)
+{
+	uint64_t end = (uint64_t)seq * sink->packet_size + len;
+
+	return end <= (sink->expected != 0 ? sink->expected : UPLOAD_SINK_MAX_SIZE);
+}
+
+/* Hand the buffered packets to the writer thread and continue in a free block */
+static int upload_sink_submit(upload_sink_t *sink)
+{
+	upload_sink_io_t *io = &sink->io[sink->block_index];
+	const uint8_t *buf = &sink->block[sink->block_offset % UPLOAD_SINK_BLOCK_SIZE];
+	int fd = sink->fd;
+
+	// Whole aligned blocks can bypass the page cache
+	if (sink->direct_fd >= 0 && (uintptr_t)buf % UPLOAD_SINK_BLOCK_ALIGN == 0 &&
+		sink->block_offset % UPLOAD_SINK_BLOCK_ALIGN == 0 && sink->block_len % UPLOAD_SINK_BLOCK_ALIGN == 0)
+	{
+		fd = sink->direct_fd;
+	}
+
+	pthread_mutex_lock(&sink->io_lock);
+	if (sink->io_error)
+	{
+		pthread_mutex_unlock(&sink->io_lock);
+		sink->failed = true;
+		return -1;
+	}
+	io->seq = ++sink->io_seq;
+	io->len = sink->block_len;
+	io->start_ns = upload_stats_now();
+	if (uring_writer_write(&io->op, fd, buf, sink->block_len, sink->block_offset) != 0)
+	{
+		// No room on the ring, write the block here instead
+		ssize_t written = pwrite(fd, buf, sink->block_len, sink->block_offset);
+		upload_sink_written_locked(io, written < 0 ? -errno : (int)written);
+	}
+	sink->block_len = 0;
+
+	// Only wait when the disk is behind by every block
+	int free_block = -1;
+	while (1)
+	{
+		for (int i = 0; i < UPLOAD_SINK_WRITE_BLOCKS && free_block < 0; i++)
+		{
+			free_block = sink->io[i].seq == 0 ? i : -1;
+		}
+		if (free_block >= 0)
+		{
+			break;
+		}
+		uring_writer_submit();
+		pthread_cond_wait(&sink->io_done, &sink->io_lock);
+	}
+	pthread_mutex_unlock(&sink->io_lock);
+
+	sink->block_index = free_block;
+	sink->block = &sink->mem.block[free_block * UPLOAD_SINK_BLOCK_SIZE];
+	return 0;
+}
+
+/* Wait until the submitted blocks and a running checkpoint are done */
+static void upload_sink_drain(upload_sink_t *sink)
+{
+	if (!sink->async)
+	{
+		return;
+	}
+
+	uring_writer_submit();
+	pthread_mutex_lock(&sink->io_lock);
+	while (1)
+	{
+		bool busy = sink->ckpt.state != UPLOAD_SINK_CKPT_IDLE;
+		for (int i = 0; i < UPLOAD_SINK_WRITE_BLOCKS; i++)
+		{
+			busy |= sink->io[i].seq != 0;
+		}
+		if (!busy)
+		{
+			break;
+		}
+		pthread_cond_wait(&sink->io_done, &sink->io_lock);
+	}
+	if (sink->io_error)
+	{
+		sink->failed = true;
+	}
+	pthread_mutex_unlock(&sink->io_lock);
+}
+
+/* Write out the buffered packets */
+static int upload_sink_flush(upload_sink_t *sink)
+{
+	if (sink->async && sink->block_len > 0)
+	{
+		return upload_sink_submit(sink);
+	}
+
+	const uint8_t *buf = &sink->block[sink->block_offset % UPLOAD_SINK_BLOCK_SIZE];
+	off_t offset = sink->block_offset;
+	size_t remaining = sink->block_len;
+	uint64_t start_ns = remaining ? upload_stats_now() : 0;
+
+	while (remaining > 0)
+	{
+		ssize_t written = pwrite(sink->fd, buf, remaining, offset);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			// The packets are already marked, keep the sidecar from claiming them
+			sink->failed = true;
+			return -1;
+		}
+		buf += written;
+		offset += written;
+		remaining -= written;
+	}
+	if (start_ns != 0)
+	{
+		telemetry_write(upload_stats_now() - start_ns);
+	}
+	trace_complete(TRACE_WRITE, 0, sink->block_len, start_ns);
+	sink->block_len = 0;
+	return 0;
+}
+
+/*
+ * Write-behind: a packet continuing the buffered range is appended to it
+ * and the range is written out when it reaches the end of an aligned
+ * block. Any other packet first flushes the buffer, so the flash sees
+ * whole blocks while the packets arrive in order.
+ */
+static int upload_sink_store(upload_sink_t *sink, off_t offset, const uint8_t *data, size_t len)
+{
+	while (len > 0)
+	{
+		if (sink->block_len > 0 && offset != sink->block_offset + (off_t)sink->block_len && upload_sink_flush(sink) != 0)
+		{
+			return -1;
+		}
+		if (sink->block_len == 0)
+		{
+			sink->block_offset = offset;
+		}
+
+		size_t pos = sink->block_offset % UPLOAD_SINK_BLOCK_SIZE + sink->block_len;
+		size_t n = UPLOAD_SINK_BLOCK_SIZE - pos < len ? UPLOAD_SINK_BLOCK_SIZE - pos : len;
+		memcpy(&sink->block[pos], data, n);
+		sink->block_len += n;
+		offset += n;
+		data += n;
+		len -= n;
+
+		if (pos + n == UPLOAD_SINK_BLOCK_SIZE && upload_sink_flush(sink) != 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Decode the compressed stream as far as it was received without gaps */
+static int upload_sink_decode(upload_sink_t *sink, off_t offset, const void *data, size_t len)
+{
+	decompress_t *dec = &sink->decoder;
+	uint64_t prefix = upload_sink_prefix(sink);
+
+	// A packet arriving in order is decoded straight from the packet buffer
+	if ((uint64_t)offset == dec->consumed && (uint64_t)offset + len <= prefix && decompress_feed(dec, data, len) != 0)
+	{
+		return -1;
+	}
+
+	// A packet closing a gap releases data that is only in the staging file
+	if (prefix > dec->consumed)
+	{
+		if (upload_sink_flush(sink) != 0)
+		{
+			return -1;
+		}
+		upload_sink_drain(sink);
+	}
+	return decompress_catch_up(dec, sink->fd, prefix);
+}
+
+/*
+ * Checkpoint without waiting: the set is copied as it is now, and written
+ * to the sidecar once the blocks submitted so far are on disk. A checkpoint
+ * still running is left to finish, the next packet tries again.
+ */
+static int upload_sink_checkpoint_start(upload_sink_t *sink)
+{
+	upload_sink_ckpt_t *ckpt = &sink->ckpt;
+	uint64_t start_ns = trace_now();
+
+	if (upload_sink_flush(sink) != 0)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&sink->io_lock);
+	if (ckpt->state == UPLOAD_SINK_CKPT_IDLE && !sink->io_error)
+	{
+		ckpt->map = sink->map;
+		ckpt->map.intervals = sink->mem.snapshot;
+		memcpy(ckpt->map.intervals, sink->map.intervals, sink->map.count * sizeof(resume_interval_t));
+		// The record goes to the slot of the older one, the next checkpoint to the other
+		sink->map.sequence++;
+		ckpt->barrier = sink->io_seq;
+		ckpt->start_ns = start_ns;
+		ckpt->state = UPLOAD_SINK_CKPT_WRITES;
+		sink->map.pending = 0;
+		upload_sink_checkpoint_continue(sink);
+	}
+	int ret = sink->io_error ? -1 : 0;
+	pthread_mutex_unlock(&sink->io_lock);
+
+	if (ret != 0)
+	{
+		sink->failed = true;
+	}
+	return ret;
+}
+
+static int upload_sink_write_locked(upload_sink_t *sink, uint32_t seq, const void *data, size_t len)
+{
+	off_t offset = (off_t)seq * sink->packet_size;
+
+	if (!upload_sink_in_range(sink, seq, len))
+	{
+		errno = EFBIG;
+		return -1;
+	}
+
+	int fresh = resume_map_add(&sink->map, seq);
+	if (fresh <= 0)
+	{
+		return fresh;
+	}
+
+	upload_sink_reserve(sink, offset + len);
+
+	// Checksum the packet while it is still in cache instead of reading the file back
+	sink->map.crc_acc = crc32_acc_add(sink->map.crc_acc, offset, data, len);
+
+	if (upload_sink_store(sink, offset, data, len) != 0)
+	{
+		return -1;
+	}
+
+	if (offset + (off_t)len > sink->size)
+	{
+		sink->size = offset + len;
+	}
+
+	if (sink->staged && upload_sink_decode(sink, offset, data, len) != 0)
+	{
+		return -1;
+	}
+
+	if (sink->stats)
+	{
+		upload_stats_packet(sink->stats, len, resume_map_gaps(&sink->map));
+	}
+
+	if (resume_map_sync_due(&sink->map))
+	{
+		return sink->async ? upload_sink_checkpoint_start(sink) : upload_sink_checkpoint(sink);
+	}
+	return 0;
+}
+
+static int upload_sink_deliver(void *ctx, uint32_t seq, const uint8_t *data, size_t len)
+{
+	return upload_sink_write_locked(ctx, seq, data, len) < 0 ? -1 : 0;
+}
+
+/* Keep a repair packet, and rebuild its block once enough packets of it arrived */
+static int upload_sink_repair_locked(upload_sink_t *sink, uint32_t seq, const void *data, size_t len)
+{
+	fec_block_t *block = fec_add_repair(&sink->fec, &sink->map, seq, data, len);
+	if (block == NULL)
+	{
+		return 0;
+	}
+
+	uint64_t start_ns = trace_now();
+	uint32_t recovered = sink->fec.recovered;
+
+	// The received packets of the block are read back from the staging file
+	if (upload_sink_flush(sink) != 0)
+	{
+		return -1;
+	}
+	upload_sink_drain(sink);
+	int ret = fec_decode(&sink->fec, block, &sink->map, sink->fd, upload_sink_deliver, sink);
+	trace_complete(TRACE_FEC_DECODE, 0, sink->fec.recovered - recovered, start_ns);
+	return ret;
+}
+
+int upload_sink_write(upload_sink_t *sink, uint32_t seq, const void *data, size_t len)
+{
+	pthread_mutex_lock(&sink->lock);
+	int ret = seq & FEC_REPAIR_FLAG ? upload_sink_repair_locked(sink, seq, data, len) : upload_sink_write_locked(sink, seq, data, len);
+	pthread_mutex_unlock(&sink->lock);
+	return ret;
+}
+
+int upload_sink_set_fec(upload_sink_t *sink, uint32_t source, uint32_t repair, uint64_t size)
+{
+	return fec_open(&sink->fec, sink->mem.fec, source, repair, sink->packet_size, size);
+}
+
+uint32_t upload_sink_checksum(const upload_sink_t *sink)
+{
+	return crc32_acc_final(sink->map.crc_acc, sink->size);
+}
+
+void upload_sink_destination(const upload_sink_t *sink, char *path, size_t size)
+{
+	snprintf(path, size, "%.*s", (int)(strlen(sink->path) - strlen(UPLOAD_SINK_STAGE_SUFFIX)), sink->path);
+}
+
+int upload_sink_finish(upload_sink_t *sink)
+{
+	decompress_t *dec = &sink->decoder;
+
+	if (!sink->staged)
+	{
+		return 0;
+	}
+
+	// The patcher only sees the decoded data once it is flushed
+	if (decompress_flush(dec) != 0 || dec->error || !dec->done || dec->consumed != (uint64_t)sink->size)
+	{
+		return -1;
+	}
+	return sink->delta && !sink->patch.done ? -1 : 0;
+}
+
+int upload_sink_checkpoint(upload_sink_t *sink)
+{
+	uint64_t start_ns = trace_now();
+
+	// The sidecar may only claim packets that already reached the disk
+	if (upload_sink_flush(sink) != 0)
+	{
+		return -1;
+	}
+	upload_sink_drain(sink);
+	if (sink->failed || fdatasync(sink->fd) != 0)
+	{
+		return -1;
+	}
+	int ret = resume_map_sync(&sink->map);
+	trace_complete(TRACE_CHECKPOINT, 0, sink->map.received, start_ns);
+	return ret;
+}
+
+int upload_sink_close(upload_sink_t *sink, upload_sink_end_t end)
+{
+	bool done = end != UPLOAD_SINK_KEEP;
+	int ret = 0;
+
+	if (sink->fd < 0)
+	{
+		return -1;
+	}
+
+	if (upload_sink_flush(sink) != 0)
+	{
+		csp_print("Failed to write '%s': %d\n", sink->path, errno);
+	}
+	upload_sink_drain(sink);
+	if (!done && !sink->failed && upload_sink_checkpoint(sink) != 0)
+	{
+		csp_print("Failed to save resume state of '%s'\n", sink->path);
+	}
+	resume_map_close(&sink->map, sink->path, done);
+
+	// Drop the part of the last preallocation step that was never written
+	if (sink->allocated > sink->size && ftruncate(sink->fd, sink->size) != 0)
+	{
+		csp_print("Failed to trim upload file: %d\n", errno);
+	}
+
+	if (sink->staged)
+	{
+		bool commit = end == UPLOAD_SINK_COMMIT;
+		ret |= decompress_close(&sink->decoder, commit);
+		if (sink->delta && delta_close(&sink->patch, commit) != 0)
+		{
+			csp_print("Failed to rebuild '%s' from its delta\n", sink->patch.path);
+			ret = -1;
+		}
+	}
+	else if (end == UPLOAD_SINK_COMMIT)
+	{
+		// The staging file is the new destination
+		char path[PATH_MAX];
+		upload_sink_destination(sink, path, sizeof(path));
+		ret = sink->failed ? -1 : atomic_file_commit(sink->fd, sink->path, path);
+	}
+	close(sink->fd);
+	sink->fd = -1;
+	if (sink->direct_fd >= 0)
+	{
+		close(sink->direct_fd);
+		sink->direct_fd = -1;
+	}
+	sink->block = NULL;
+	pthread_mutex_destroy(&sink->lock);
+	pthread_mutex_destroy(&sink->io_lock);
+	pthread_cond_destroy(&sink->io_done);
+
+	// A committed plain upload was renamed, anything else leaves the staged stream behind
+	if (done && (sink->staged || end == UPLOAD_SINK_DISCARD || ret != 0) && unlink(sink->path) != 0 && errno != ENOENT)
+	{
+		csp_print("Failed to remove '%s': %d\n", sink->path, errno);
+	}
+	return ret;
+}
+
+void upload_sink_prepare(upload_sink_t *sink)
+{
+	atomic_store_explicit(&sink->state, UPLOAD_SINK_OPENING, memory_order_relaxed);
+}
+
+void upload_sink_ready(upload_sink_t *sink, bool ok)
+{
+	pthread_mutex_lock(&open_lock);
+	atomic_store_explicit(&sink->state, ok ? UPLOAD_SINK_READY : UPLOAD_SINK_UNAVAILABLE, memory_order_release);
+	pthread_cond_broadcast(&open_done);
+	pthread_mutex_unlock(&open_lock);
+}
+
+int upload_sink_wait(upload_sink_t *sink)
+{
+	int state = atomic_load_explicit(&sink->state, memory_order_acquire);
+
+	if (state == UPLOAD_SINK_OPENING)
+	{
+		pthread_mutex_lock(&open_lock);
+		while ((state = atomic_load_explicit(&sink->state, memory_order_acquire)) == UPLOAD_SINK_OPENING)
+		{
+			pthread_cond_wait(&open_done, &open_lock);
+		}
+		pthread_mutex_unlock(&open_lock);
+	}
+	return state == UPLOAD_SINK_READY ? 0 : -1;
+}
+
+void upload_sink_bind(upload_sink_t *sink)
+{
+	bound_sink = sink;
+}
+
+void upload_sink_bind_ranges(upload_sink_ranges_t *ranges)
+{
+	bound_ranges = ranges;
+}
+
+/* Set the packets a session requests, libdtp intervals include their end packet */
+static void file_sink_request(dtp_meta_req_t *meta, const resume_interval_t *ranges, uint32_t count)
+{
+	uint32_t max = sizeof(meta->intervals) / sizeof(meta->intervals[0]);
+
+	// Ranges that do not fit are requested in the next round
+	count = count < max ? count : max;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		meta->intervals[i].start = ranges[i].start;
+		meta->intervals[i].end = ranges[i].end == RESUME_MAP_END ? RESUME_MAP_END : ranges[i].end - 1;
+	}
+	meta->nof_intervals = count;
+}
+
+/* Limit the request of a resumed session to the packets that are still missing */
+static void file_sink_on_start(dtp_t *session)
+{
+	dtp_meta_req_t *meta = &session->request_meta;
+
+	// A sink still being opened belongs to a new upload, which requests every packet
+	if (bound_sink == NULL || atomic_load_explicit(&bound_sink->state, memory_order_acquire) != UPLOAD_SINK_READY)
+	{
+		return;
+	}
+
+	if (bound_ranges)
+	{
+		file_sink_request(meta, bound_ranges->ranges, bound_ranges->count);
+		return;
+	}
+
+	if (!bound_sink->resume)
+	{
+		return;
+	}
+
+	resume_interval_t missing[sizeof(meta->intervals) / sizeof(meta->intervals[0])];
+	uint32_t count = resume_map_missing(&bound_sink->map, missing, sizeof(missing) / sizeof(missing[0]));
+	file_sink_request(meta, missing, count);
+
+	csp_print("Resuming '%s', requesting %u missing ranges from packet %u\n", bound_sink->path, count, missing[0].start);
+}
+
+static bool file_sink_on_data_packet(dtp_t *session, csp_packet_t *packet)
+{
+	(void)session;
+
+	if (bound_sink == NULL || packet->length < DTP_PACKET_HEADER_SIZE || upload_sink_wait(bound_sink) != 0)
+	{
+		return false;
+	}
+
+	uint32_t seq = packet->data32[0];
+	uint32_t len = packet->length - DTP_PACKET_HEADER_SIZE;
+	if (upload_sink_write(bound_sink, seq, &packet->data[DTP_PACKET_HEADER_SIZE], len) != 0)
+	{
+		csp_print("Failed to write packet %u: %d\n", seq, errno);
+		return false;
+	}
+
+	if (bound_ranges)
+	{
+		bound_ranges->bytes += len;
+	}
+	return true;
+}
+
+dtp_opt_session_hooks_cfg file_sink_session_hooks = {
+	.on_start = file_sink_on_start,
+	.on_data_packet = file_sink_on_data_packet,
+};
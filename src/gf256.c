@@ -0,0 +1,91 @@
+#include <pthread.h>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "gf256.h"
+
+#define GF256_POLY 0x11D
+
+static uint8_t gf256_exp[512]; // doubled, so a sum of two logs needs no reduction
+static uint8_t gf256_log[256];
+static pthread_once_t gf256_once = PTHREAD_ONCE_INIT;
+
+static void gf256_init(void)
+{
+	unsigned int x = 1;
+	for (int i = 0; i < 255; i++)
+	{
+		gf256_exp[i] = x;
+		gf256_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+		{
+			x ^= GF256_POLY;
+		}
+	}
+	for (int i = 255; i < 512; i++)
+	{
+		gf256_exp[i] = gf256_exp[i - 255];
+	}
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+	pthread_once(&gf256_once, gf256_init);
+	return a && b ? gf256_exp[gf256_log[a] + gf256_log[b]] : 0;
+}
+
+uint8_t gf256_inv(uint8_t a)
+{
+	pthread_once(&gf256_once, gf256_init);
+	return gf256_exp[255 - gf256_log[a]];
+}
+
+/*
+ * c * s = c * (s & 0x0F) ^ c * (s & 0xF0), each half looked up in a table
+ * of 16 products. The vector units do 16 such lookups in one instruction.
+ */
+void gf256_muladd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	size_t i = 0;
+
+	if (c == 0)
+	{
+		return;
+	}
+	for (int n = 0; n < 16; n++)
+	{
+		lo[n] = gf256_mul(c, n);
+		hi[n] = gf256_mul(c, n << 4);
+	}
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t tlo = vld1q_u8(lo), thi = vld1q_u8(hi), mask = vdupq_n_u8(0x0F);
+	for (; i + 16 <= len; i += 16)
+	{
+		uint8x16_t s = vld1q_u8(&src[i]);
+		uint8x16_t p = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(s, mask)), vqtbl1q_u8(thi, vshrq_n_u8(s, 4)));
+		vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&dst[i]), p));
+	}
+#elif defined(__SSSE3__)
+	__m128i tlo = _mm_loadu_si128((const __m128i *)lo), thi = _mm_loadu_si128((const __m128i *)hi);
+	__m128i mask = _mm_set1_epi8(0x0F);
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)),
+								  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&dst[i]), p));
+	}
+#endif
+
+	for (; i < len; i++)
+	{
+		dst[i] ^= lo[src[i] & 0x0F] ^ hi[src[i] >> 4];
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef UPLOAD_CLIENT_ATOMIC_FILE_H
+#define UPLOAD_CLIENT_ATOMIC_FILE_H
+
+#include <stddef.h>
+
+/* A new version of a file is built in <destination>.dtptmp */
+#define ATOMIC_FILE_TEMP_SUFFIX ".dtptmp"
+
+/**
+ * Name of the temporary a new version of path is built in.
+ * @return 0 on success, -1 if the name does not fit in size
+ */
+int atomic_file_temp(char *temp, size_t size, const char *path);
+
+/**
+ * Make the data of fd durable, move temp over path and sync the directory
+ * so the rename survives a reset. Readers of path see either the old or
+ * the complete new file. fd stays open.
+ * @return 0 on success, -1 on failure
+ */
+int atomic_file_commit(int fd, const char *temp, const char *path);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef UPLOAD_CLIENT_CONTENT_INDEX_H
+#define UPLOAD_CLIENT_CONTENT_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define CONTENT_INDEX_HASH_SIZE SHA256_DIGEST_SIZE
+
+/**
+ * Keep an index of received files in dir, one hard link per file named
+ * by the hex SHA-256 of its content. The directory should be on the same
+ * filesystem as the destinations, files elsewhere are copied.
+ * @return 0 on success, -1 if dir cannot be created
+ */
+int content_index_init(const char *dir);
+
+/**
+ * True once content_index_init succeeded
+ */
+bool content_index_enabled(void);
+
+/**
+ * Make dest a file with the given content if the index holds it. The
+ * indexed file is hashed again only if its size, inode or mtime differ
+ * from when it was last hashed, an entry changed in place since then is
+ * dropped.
+ * @return 0 if dest now has the content, -1 if it must be uploaded
+ */
+int content_index_fetch(const uint8_t hash[CONTENT_INDEX_HASH_SIZE], const char *dest);
+
+/**
+ * Add a received file, if its content matches hash.
+ * @return 0 on success, -1 if the file does not match or cannot be linked
+ */
+int content_index_add(const uint8_t hash[CONTENT_INDEX_HASH_SIZE], const char *path);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef UPLOAD_CLIENT_CRC32_H
+#define UPLOAD_CLIENT_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Update a raw CRC-32 (IEEE 802.3, reflected) without pre or post inversion.
+ * Uses the ARMv8 CRC32 instructions when available, slicing-by-8 otherwise.
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+/**
+ * Fold a chunk into an order independent accumulator.
+ * Chunks may be added in any order, each byte range exactly once.
+ * @param acc accumulator, start at 0
+ * @param offset position of the chunk in the file
+ */
+uint32_t crc32_acc_add(uint32_t acc, uint64_t offset, const void *data, size_t len);
+
+/**
+ * Standard CRC-32 of a file of size bytes whose chunks were all added to acc.
+ */
+uint32_t crc32_acc_final(uint32_t acc, uint64_t size);
+
+/**
+ * Standard CRC-32 of a contiguous buffer
+ */
+static inline uint32_t crc32_compute(const void *data, size_t len)
+{
+	return ~crc32_update(0xFFFFFFFF, data, len);
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef UPLOAD_CLIENT_DECOMPRESS_H
+#define UPLOAD_CLIENT_DECOMPRESS_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "delta.h"
+
+/* Encoding of a payload on the link, values of UploadMetadataItem.compression */
+typedef enum
+{
+	UPLOAD_COMPRESSION_NONE = 0,
+	UPLOAD_COMPRESSION_ZSTD = 1, // zstd frames
+	UPLOAD_COMPRESSION_LZ4 = 2,	 // LZ4 frames
+	UPLOAD_COMPRESSION_COUNT,
+} upload_compression_t;
+
+/* Compressed bytes read back per step when catching up with the received prefix */
+#define DECOMPRESS_IN_SIZE (64 * 1024)
+/* Decompressed bytes collected before they are written out */
+#define DECOMPRESS_OUT_SIZE (128 * 1024)
+/* Largest zstd window accepted, frames needing more memory are rejected */
+#define DECOMPRESS_ZSTD_WINDOW_LOG 23
+
+/* Memory a decoder works in, kept from one upload to the next */
+typedef struct
+{
+	uint8_t *in;						 // DECOMPRESS_IN_SIZE
+	uint8_t *out;						 // DECOMPRESS_OUT_SIZE
+	void *ctx[UPLOAD_COMPRESSION_COUNT]; // created by decompress_mem_init, reset for every stream
+} decompress_mem_t;
+
+/*
+ * Streaming decoder writing a payload out to a file, or into a delta
+ * patcher when the payload is a (possibly compressed) delta.
+ */
+typedef struct
+{
+	upload_compression_t type;
+	void *ctx;		   // ZSTD_DCtx or LZ4F_dctx, owned by the decompress_mem_t
+	int fd;			   // decompressed destination, -1 when writing to delta
+	delta_t *delta;
+	uint64_t consumed; // compressed bytes decoded so far
+	uint64_t produced; // decompressed bytes written or buffered
+	bool done;		   // the input ends on a frame boundary
+	bool error;		   // corrupt input or write failure, decoding stopped
+	uint8_t *in;	   // DECOMPRESS_IN_SIZE
+	uint8_t *out;	   // DECOMPRESS_OUT_SIZE
+	size_t out_used;
+	char path[PATH_MAX]; // destination when writing to a file
+	char temp[PATH_MAX]; // output until it is complete, see atomic_file.h
+} decompress_t;
+
+/**
+ * True if support for the encoding is compiled in
+ */
+bool decompress_supported(upload_compression_t type);
+
+/**
+ * Create the contexts of every supported encoding in mem, once at startup.
+ * The buffers of mem are set up by the caller.
+ * @return 0 on success, -1 on failure, with none of them left behind
+ */
+int decompress_mem_init(decompress_mem_t *mem);
+
+/**
+ * Free the contexts created by decompress_mem_init, those not created are NULL.
+ */
+void decompress_mem_free(decompress_mem_t *mem);
+
+/**
+ * Create the temporary the decompressed destination is built in.
+ * @param delta if not NULL, the output is applied to it instead of written to path
+ * @param mem buffers and contexts to decode with, used until the decoder is closed
+ * @return 0 on success, -1 on failure
+ */
+int decompress_open(decompress_t *dec, upload_compression_t type, const char *path, delta_t *delta, decompress_mem_t *mem);
+
+/**
+ * Decode the next len compressed bytes, following on from consumed.
+ * @return 0 on success, -1 on corrupt data or a failed write
+ */
+int decompress_feed(decompress_t *dec, const void *data, size_t len);
+
+/**
+ * Decode compressed bytes from src_fd up to offset end, starting at consumed.
+ * @return 0 on success, -1 on failure
+ */
+int decompress_catch_up(decompress_t *dec, int src_fd, uint64_t end);
+
+/**
+ * Write out the buffered output.
+ * @return 0 on success, -1 on failure
+ */
+int decompress_flush(decompress_t *dec);
+
+/**
+ * Write out the buffered output and close the destination. A complete and
+ * valid output is moved into place, otherwise the temporary is removed.
+ * @param complete the whole compressed payload was fed
+ * @return 0 if the output is complete or complete is false, -1 if the
+ * payload was corrupt, ended in the middle of a frame or could not be
+ * moved into place
+ */
+int decompress_close(decompress_t *dec, bool complete);
+
+#endif
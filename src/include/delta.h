@@ -0,0 +1,78 @@
+#ifndef UPLOAD_CLIENT_DELTA_H
+#define UPLOAD_CLIENT_DELTA_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Delta payload, rebuilding a new file from one already on board.
+ * All integers are little endian.
+ *
+ * Header: "DTPD", u64 size of the new file, u32 CRC-32 of the base file
+ * Followed by operations, each appending to the new file:
+ *   0x01 COPY  u64 base offset, u32 length
+ *   0x02 DATA  u32 length, then length literal bytes
+ *   0x03 ADD   u64 base offset, u32 length, then length bytes that are
+ *              added to the base bytes one by one (bsdiff style)
+ *   0x00 END
+ */
+#define DELTA_MAGIC 0x44505444 // "DTPD"
+#define DELTA_OP_END 0x00
+#define DELTA_OP_COPY 0x01
+#define DELTA_OP_DATA 0x02
+#define DELTA_OP_ADD 0x03
+
+/* Output collected before it is written out */
+#define DELTA_OUT_SIZE (64 * 1024)
+
+/* Streaming patcher, fed the delta payload in order */
+typedef struct
+{
+	int base_fd;
+	uint32_t base_crc; // CRC-32 of the base, taken by delta_open
+	int fd;			   // new file, written to the temporary
+	uint64_t size;	   // size of the new file, from the header
+	uint64_t produced; // bytes of the new file built so far
+	uint8_t state;
+	uint8_t op;
+	uint8_t field[16]; // header or operation arguments being collected
+	size_t field_used;
+	size_t field_size;
+	uint64_t base_offset; // ADD: next base byte
+	uint32_t remaining;	  // DATA and ADD: payload bytes still to come
+	bool done;			  // END was reached and the file has its full size
+	bool error;
+	uint8_t *out; // DELTA_OUT_SIZE, owned by the caller
+	size_t out_used;
+	char path[PATH_MAX]; // destination
+	char temp[PATH_MAX]; // new file until it is complete, see atomic_file.h
+} delta_t;
+
+/**
+ * Open the base file and create the temporary the new file is built in,
+ * <path>.dtptmp.
+ * The base may be the destination itself, it is only replaced on success.
+ * The whole base is read here to checksum it, so the header is checked
+ * without touching the base again.
+ * @param out DELTA_OUT_SIZE bytes to collect output in, used until the patcher is closed
+ * @return 0 on success, -1 on failure
+ */
+int delta_open(delta_t *delta, const char *base, const char *path, uint8_t *out);
+
+/**
+ * Apply the next len bytes of the delta payload.
+ * @return 0 on success, -1 if the payload is invalid or does not match the base
+ */
+int delta_feed(delta_t *delta, const void *data, size_t len);
+
+/**
+ * Close the base and the temporary. If complete and the delta was applied
+ * to its end, the new file is synced and renamed over the destination,
+ * otherwise the temporary is removed.
+ * @return 0 on success or if complete is false, -1 if the new file could not be built
+ */
+int delta_close(delta_t *delta, bool complete);
+
+#endif
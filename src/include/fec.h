@@ -0,0 +1,105 @@
+#ifndef UPLOAD_CLIENT_FEC_H
+#define UPLOAD_CLIENT_FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "resume_map.h"
+
+/*
+ * Systematic Reed-Solomon repair packets over blocks of DTP packets.
+ *
+ * The payload is cut into blocks of K source packets, packet i of block b
+ * is DTP packet b * K + i. For each block the server sends up to R repair
+ * packets after its source packets. Repair j of block b is a DTP data
+ * packet with sequence number FEC_REPAIR_FLAG | (b * R + j) and a full
+ * packet of payload:
+ *
+ *     repair_j = sum over i < K of c(j, i) * source_i,  c(j, i) = 1 / ((255 - j) ^ i)
+ *
+ * in GF(2^8) (see gf256.h), byte by byte. Source packets are zero padded to
+ * the packet size, packets past the end of the payload count as zero. The
+ * coefficients form a Cauchy matrix, so any K of the K + R packets of a
+ * block rebuild it.
+ */
+
+#define FEC_REPAIR_FLAG 0x80000000u
+/* Most repair packets per block */
+#define FEC_MAX_REPAIR 16
+/* K + R is limited by the field size */
+#define FEC_MAX_SYMBOLS 256
+/* Largest packet the repair buffers hold, the largest link MTU */
+#define FEC_MAX_SYMBOL_SIZE 1024
+/* Blocks whose repair packets are kept at once, a striped upload receives several blocks in parallel */
+#define FEC_WINDOW_BLOCKS 4
+
+/* Memory of the decoder, in the reserved memory of an upload */
+#define FEC_MEM_SIZE ((FEC_WINDOW_BLOCKS * FEC_MAX_REPAIR + 1) * FEC_MAX_SYMBOL_SIZE)
+
+#define FEC_NO_BLOCK UINT32_MAX
+
+/* Repair packets received for one block */
+typedef struct
+{
+	uint32_t block; // FEC_NO_BLOCK while the slot is free
+	bool done;		// decoded or complete, later repairs are dropped
+	uint8_t count;
+	uint8_t index[FEC_MAX_REPAIR]; // repair number j of each held packet
+	uint8_t *symbols;			   // count packets of symbol_size bytes
+} fec_block_t;
+
+typedef struct
+{
+	uint32_t source; // K, 0 while FEC is off
+	uint32_t repair; // R
+	uint32_t symbol_size;
+	uint64_t size;	  // payload bytes
+	uint32_t packets; // payload packets
+	uint32_t recovered;
+	fec_block_t blocks[FEC_WINDOW_BLOCKS];
+	uint8_t *scratch; // one packet
+} fec_t;
+
+/* Called for every packet rebuilt by fec_decode */
+typedef int (*fec_deliver_t)(void *ctx, uint32_t seq, const uint8_t *data, size_t len);
+
+/**
+ * True if fec_open takes these parameters
+ */
+bool fec_supported(uint32_t source, uint32_t repair, uint32_t symbol_size, uint64_t size);
+
+/**
+ * Set up the decoder for a payload of size bytes in packets of
+ * symbol_size bytes. mem holds FEC_MEM_SIZE bytes.
+ * @return 0 on success, -1 if the parameters are not supported
+ */
+int fec_open(fec_t *fec, uint8_t *mem, uint32_t source, uint32_t repair, uint32_t symbol_size, uint64_t size);
+
+/**
+ * Turn the decoder off.
+ */
+void fec_close(fec_t *fec);
+
+static inline bool fec_enabled(const fec_t *fec)
+{
+	return fec->source != 0;
+}
+
+/**
+ * Keep a repair packet.
+ * @param seq its DTP sequence number, with FEC_REPAIR_FLAG
+ * @return the block if the packets it holds now suffice to rebuild the
+ * missing source packets, NULL otherwise
+ */
+fec_block_t *fec_add_repair(fec_t *fec, const resume_map_t *map, uint32_t seq, const void *data, size_t len);
+
+/**
+ * Rebuild the missing source packets of a block. The received ones are
+ * read from fd, where they must have been written. Each rebuilt packet is
+ * handed to deliver, which must mark it in map.
+ * @return 0 on success, -1 if reading or deliver failed
+ */
+int fec_decode(fec_t *fec, fec_block_t *block, const resume_map_t *map, int fd, fec_deliver_t deliver, void *ctx);
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef UPLOAD_CLIENT_FILE_SINK_H
+#define UPLOAD_CLIENT_FILE_SINK_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "decompress.h"
+#include "fec.h"
+#include "resume_map.h"
+#include "upload_stats.h"
+#include "uring_writer.h"
+
+#include "dtp/dtp_session.h"
+
+/* DTP data packets start with the 32 bit packet number, followed by the payload */
+#define DTP_PACKET_HEADER_SIZE sizeof(uint32_t)
+
+/* The destination is preallocated in steps of this size as data arrives */
+#define UPLOAD_SINK_PREALLOC_STEP (1024 * 1024)
+
+/* Largest payload accepted when the request does not give its size */
+#define UPLOAD_SINK_MAX_SIZE (4ull * 1024 * 1024 * 1024)
+
+/* Packets are received into <destination>.dtpin, the destination is only replaced once verified */
+#define UPLOAD_SINK_STAGE_SUFFIX ".dtpin"
+
+/* Packets arriving in order are collected and written out in aligned blocks of this size */
+#define UPLOAD_SINK_BLOCK_SIZE (64 * 1024)
+#define UPLOAD_SINK_BLOCK_ALIGN 4096
+
+/* With io_uring one block is filled while the others are being written */
+#ifdef UPLOAD_HAVE_URING
+#define UPLOAD_SINK_WRITE_BLOCKS 4
+#else
+#define UPLOAD_SINK_WRITE_BLOCKS 1
+#endif
+
+/* Most packet ranges one session of a striped upload requests */
+#define UPLOAD_SINK_MAX_RANGES 8
+
+/* Ranges of received packets the resume map of a sink can hold */
+#define UPLOAD_SINK_MAX_INTERVALS 4096
+
+/* Memory a sink works in, reserved once and reused for every upload, see upload_pool.h */
+typedef struct
+{
+	uint8_t *block;				  // write-behind buffers, UPLOAD_SINK_WRITE_BLOCKS * UPLOAD_SINK_BLOCK_SIZE
+	resume_interval_t *intervals; // UPLOAD_SINK_MAX_INTERVALS
+	resume_interval_t *snapshot;  // the same, for a checkpoint in flight, only with io_uring
+	uint8_t *delta_out;			  // DELTA_OUT_SIZE
+	uint8_t *fec;				  // FEC_MEM_SIZE
+	decompress_mem_t decoder;
+} upload_sink_mem_t;
+
+struct upload_sink_s;
+
+/* A write-behind block handed to the io_uring writer */
+typedef struct
+{
+	uring_writer_op_t op;
+	struct upload_sink_s *sink;
+	uint64_t seq; // submission order, 0 while the block is free
+	size_t len;
+	uint64_t start_ns;
+} upload_sink_io_t;
+
+typedef enum
+{
+	UPLOAD_SINK_CKPT_IDLE,
+	UPLOAD_SINK_CKPT_WRITES, // waiting for the blocks submitted before it
+	UPLOAD_SINK_CKPT_SYNC,	 // staging file being synced
+	UPLOAD_SINK_CKPT_STORE,	 // sidecar being written and synced
+} upload_sink_ckpt_state_t;
+
+/* Progress of an open handed to another thread, see upload_sink_prepare */
+typedef enum
+{
+	UPLOAD_SINK_READY,		 // opened, or opened by the caller itself
+	UPLOAD_SINK_OPENING,	 // being opened, packets wait for it
+	UPLOAD_SINK_UNAVAILABLE, // the open failed
+} upload_sink_state_t;
+
+/* Checkpoint running on the io_uring writer while packets keep arriving */
+typedef struct
+{
+	uring_writer_op_t sync;
+	uring_writer_op_t store;
+	struct upload_sink_s *sink;
+	upload_sink_ckpt_state_t state;
+	uint64_t barrier; // blocks up to this seq must be written first
+	resume_map_t map; // the ranges at the time of the checkpoint, in mem.snapshot
+	uint8_t header[RESUME_MAP_HEADER_SIZE];
+	struct iovec iov[2];
+	uint64_t start_ns;
+} upload_sink_ckpt_t;
+
+/*
+ * Destination of a DTP payload. Packets are written at their offset in a
+ * staging file that is renamed over the destination once the upload is
+ * verified. A compressed or delta payload is instead decoded from the
+ * staging file into the destination as the part received without gaps grows.
+ *
+ * With io_uring the blocks and checkpoints are written by the writer
+ * thread, the receiving thread only waits for storage when all blocks are
+ * in flight or a gap in a compressed payload closes.
+ */
+typedef struct upload_sink_s
+{
+	pthread_mutex_t lock; // the sessions of a striped upload write concurrently
+	atomic_int state;	  // upload_sink_state_t
+	int fd;
+	uint32_t packet_size; // payload bytes carried by each full DTP packet
+	off_t allocated;	  // bytes reserved with fallocate
+	off_t size;			  // highest byte written so far
+	uint64_t expected;	  // payload size from the request, 0 if unknown
+	bool resume;		  // continue an earlier session, only request missing packets
+	resume_map_t map;	  // packets already stored in the file
+	bool failed;		  // a write failed, the unsynced part of the map is unreliable
+	upload_stats_t *stats;
+	upload_sink_mem_t mem; // set up once with upload_sink_mem_init
+	uint8_t *block;		  // block being filled, in mem.block
+	off_t block_offset;	  // file offset of the first buffered byte
+	size_t block_len;	  // buffered bytes, contiguous from block_offset
+	bool async;			  // blocks are written through io_uring
+	int direct_fd;		  // staging file opened with O_DIRECT for whole aligned blocks, or -1
+	unsigned int block_index;
+	upload_sink_io_t io[UPLOAD_SINK_WRITE_BLOCKS];
+	uint64_t io_seq;	  // blocks submitted
+	bool io_error;		  // a write or sync on the writer thread failed
+	pthread_mutex_t io_lock; // guards io, io_error and ckpt against the writer thread
+	pthread_cond_t io_done;
+	upload_sink_ckpt_t ckpt;
+	fec_t fec;			  // repair packets, see fec.h
+	upload_compression_t compression;
+	bool delta;			  // the payload rebuilds the destination from a base file
+	bool staged;		  // compressed or delta, decoded from the staging file
+	decompress_t decoder; // only used when staged
+	delta_t patch;		  // only used for delta payloads
+	char path[PATH_MAX];  // staging file the packets are written to
+} upload_sink_t;
+
+/* Packets requested by one session of a striped upload */
+typedef struct
+{
+	resume_interval_t ranges[UPLOAD_SINK_MAX_RANGES];
+	uint32_t count;
+	uint64_t bytes; // payload bytes the session delivered
+} upload_sink_ranges_t;
+
+/* What to do with the staging file when a sink is closed */
+typedef enum
+{
+	UPLOAD_SINK_KEEP,	 // incomplete, keep it and the sidecar to resume later
+	UPLOAD_SINK_COMMIT,	 // complete and verified, move it into place
+	UPLOAD_SINK_DISCARD, // complete but invalid, remove it and keep the old destination
+} upload_sink_end_t;
+
+/* Hooks streaming received DTP packets into the sink bound to the calling thread */
+extern dtp_opt_session_hooks_cfg file_sink_session_hooks;
+
+/**
+ * Bytes of memory one sink needs, a multiple of UPLOAD_SINK_BLOCK_ALIGN
+ */
+size_t upload_sink_mem_size(void);
+
+/**
+ * Lay out the memory of a sink in upload_sink_mem_size() bytes at base,
+ * aligned to UPLOAD_SINK_BLOCK_ALIGN.
+ */
+void upload_sink_mem_init(upload_sink_mem_t *mem, uint8_t *base);
+
+/**
+ * Open the destination file and its resume sidecar. The sink works in
+ * sink->mem, nothing is allocated.
+ * @param mtu DTP MTU used for the session, determines the offset of each packet.
+ * A resumed upload keeps the MTU it was started with, see packet_size.
+ * @param resume keep the data received by an earlier session, otherwise truncate
+ * @param compression encoding of the payload, decoded into path while it arrives
+ * @param base file on board the payload is a delta against, see delta.h, or NULL
+ * @return 0 on success, -1 on failure
+ */
+int upload_sink_open(upload_sink_t *sink, const char *path, uint32_t mtu, bool resume, upload_compression_t compression, const char *base);
+
+/**
+ * Mark the sink as being opened by another thread. Until that thread calls
+ * upload_sink_ready the session hooks hold back packets for it.
+ */
+void upload_sink_prepare(upload_sink_t *sink);
+
+/**
+ * End the open announced with upload_sink_prepare.
+ * @param ok whether upload_sink_open succeeded
+ */
+void upload_sink_ready(upload_sink_t *sink, bool ok);
+
+/**
+ * Wait until the sink is open.
+ * @return 0 once it is, -1 if the open failed
+ */
+int upload_sink_wait(upload_sink_t *sink);
+
+/**
+ * Set the size of the payload from its request and reserve its space up
+ * front. Packets past its end are rejected from then on.
+ */
+void upload_sink_set_size(upload_sink_t *sink, uint64_t size);
+
+/**
+ * Write the payload of packet number seq to its offset in the destination.
+ * Packets that are already stored are skipped, repair packets go to the
+ * FEC decoder. Packets reaching past the payload size, or past
+ * UPLOAD_SINK_MAX_SIZE if it is unknown, are rejected.
+ * @return 0 on success, -1 on failure
+ */
+int upload_sink_write(upload_sink_t *sink, uint32_t seq, const void *data, size_t len);
+
+/**
+ * Rebuild lost packets from the repair packets the server adds to every
+ * block of source packets, see fec.h. Needs the payload size.
+ * @return 0 on success, -1 if the parameters are not supported
+ */
+int upload_sink_set_fec(upload_sink_t *sink, uint32_t source, uint32_t repair, uint64_t size);
+
+/**
+ * Standard CRC-32 of everything written so far, including earlier sessions.
+ * For a compressed payload this covers the data as sent, not the decoded file.
+ */
+uint32_t upload_sink_checksum(const upload_sink_t *sink);
+
+/**
+ * Path of the destination file, the staging file name without its suffix.
+ */
+void upload_sink_destination(const upload_sink_t *sink, char *path, size_t size);
+
+/**
+ * Decode the rest of a fully received payload and check that it is valid:
+ * a compressed payload must end on a frame boundary, a delta must have
+ * rebuilt the whole file. Nothing to do for a plain payload.
+ * @return 0 on success, -1 on failure
+ */
+int upload_sink_finish(upload_sink_t *sink);
+
+/**
+ * Write out the buffered packets and make them durable, then record them
+ * in the resume sidecar.
+ * @return 0 on success, -1 on failure
+ */
+int upload_sink_checkpoint(upload_sink_t *sink);
+
+/**
+ * Write out the buffered packets, release unused preallocated space and
+ * close the staging file. Committing syncs the new file and renames it
+ * over the destination, so a reset leaves either the old or the new file.
+ * @return 0 on success, -1 if the destination could not be replaced
+ */
+int upload_sink_close(upload_sink_t *sink, upload_sink_end_t end);
+
+/**
+ * Bind a sink to the calling thread, the session hooks write into it
+ * until the next call. dtp_client_main runs the hooks on its own thread.
+ */
+void upload_sink_bind(upload_sink_t *sink);
+
+/**
+ * Make the sessions started on the calling thread request only the given
+ * ranges instead of everything missing, and count what they deliver.
+ * NULL restores the default.
+ */
+void upload_sink_bind_ranges(upload_sink_ranges_t *ranges);
+
+#endif
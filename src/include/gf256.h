@@ -0,0 +1,20 @@
+#ifndef UPLOAD_CLIENT_GF256_H
+#define UPLOAD_CLIENT_GF256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Arithmetic in GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D) */
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+
+/* Multiplicative inverse, a must not be 0 */
+uint8_t gf256_inv(uint8_t a);
+
+/**
+ * dst ^= c * src over len bytes. Uses NEON or SSSE3 table lookups when
+ * compiled for them, 16 bytes at a time.
+ */
+void gf256_muladd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef UPLOAD_CLIENT_JOURNAL_H
+#define UPLOAD_CLIENT_JOURNAL_H
+
+#include <stdint.h>
+
+#include "upload_request.h"
+
+/* Uploads the journal tracks at once, older ones are dropped from it */
+#define JOURNAL_MAX_LIVE 4096
+/* The journal is rewritten with only the live uploads once it holds this many records ... */
+#define JOURNAL_COMPACT_RECORDS 1024
+/* ... and at least this many per live upload */
+#define JOURNAL_COMPACT_RATIO 4
+
+/*
+ * Append-only log of accepted uploads. Each record is checksummed, so a
+ * record torn by a reset is found and cut off when the journal is read
+ * back. An upload is live from its ACCEPT record until its DONE record;
+ * a newer upload to the same destination ends the older one.
+ */
+
+/**
+ * Read the journal at path, creating it if needed, and keep it open for
+ * appending. Rewrites it if it holds mostly finished uploads.
+ * @return number of live uploads found, -1 on failure
+ */
+int journal_open(const char *path);
+
+/**
+ * Schedule the live uploads found by journal_open again, as resumed
+ * uploads under their journal ID, as far as contexts and queue room allow.
+ * Those left wait for the next call. Call once the upload pool is running
+ * and again whenever a context is released.
+ */
+void journal_rearm(void);
+
+/**
+ * Record an accepted upload, not synced yet so the reply need not wait
+ * for the disk.
+ * @return its journal ID, 0 if the journal is not open or failed
+ */
+uint32_t journal_accept(const upload_request_t *req);
+
+/**
+ * Sync the uploads recorded since the last call, once for all uploads of
+ * a request after its reply is sent.
+ */
+void journal_sync(void);
+
+/**
+ * Record the packets received so far, not synced.
+ */
+void journal_progress(uint32_t id, uint32_t received);
+
+/**
+ * Record the end of an upload with one of UPLOAD_CLIENT_DTP_RESULT_*.
+ * An upload left incomplete stays live instead, to be resumed.
+ */
+void journal_done(uint32_t id, uint8_t status);
+
+#endif
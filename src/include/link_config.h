@@ -0,0 +1,65 @@
+#ifndef UPLOAD_CLIENT_LINK_CONFIG_H
+#define UPLOAD_CLIENT_LINK_CONFIG_H
+
+#include <stdint.h>
+
+#include "rate_control.h"
+
+/* Line rates used unless set on the command line or through libparam */
+#define LINK_KISS_DEFAULT_BAUD 115200
+#define LINK_CAN_DEFAULT_BITRATE 1000000
+
+/* libparam IDs of the link rates */
+#define LINK_PARAM_ID_KISS_BAUD 300
+#define LINK_PARAM_ID_CAN_BITRATE 301
+
+/* A probed rate is kept if this many pings of this size come back intact */
+#define LINK_PROBE_PINGS 5
+#define LINK_PROBE_SIZE 100
+#define LINK_PROBE_TIMEOUT_MS 500
+/* Time the peer gets to follow a rate change before it is checked */
+#define LINK_PROBE_SETTLE_MS 200
+
+/* Devices of one kind share a rate, at most this many of each */
+#define LINK_MAX_DEVICES 4
+
+/**
+ * Set the rates the interfaces are opened with, 0 keeps the default.
+ * @return 0 on success, -1 if the baud rate is not supported by the UART driver
+ */
+int link_config_init(uint32_t kiss_baud, uint32_t can_bitrate);
+
+/* Current rates, in bits per second */
+uint32_t link_kiss_baud(void);
+uint32_t link_can_bitrate(void);
+
+/**
+ * Register an opened interface, rate changes are applied to it.
+ * @return 0 on success, -1 if there are too many
+ */
+int link_kiss_add(const char *device);
+int link_can_add(const char *device);
+
+/**
+ * Select the link uploads are received on. Its profile is set up now and
+ * again whenever its rate changes.
+ */
+void link_config_primary(rate_link_t link);
+
+/**
+ * Change the rate of all registered devices of a kind. The kiss_baud and
+ * can_bitrate parameters call these when they are set.
+ * @return 0 on success, -1 if the rate is not supported or could not be set
+ */
+int link_set_kiss_baud(uint32_t baud);
+int link_set_can_bitrate(uint32_t bitrate);
+
+/**
+ * Step the primary link up through the standard rates above the current one
+ * and keep the fastest at which pings to server come back intact. The peer
+ * must follow the rate, e.g. by auto-bauding or its own probe.
+ * @return 0 on success, -1 if the server does not answer at the current rate
+ */
+int link_probe(uint16_t server);
+
+#endif
@@ -38,10 +38,48 @@ struct  UploadMetadataItem
    * For larger hashes like SHA-256, you might use the 'bytes' type instead.
    */
   uint32_t checksum;
+  /*
+   * Scheduling class, 0 is the most urgent. Urgent uploads are started
+   * even when the link budget is used up by others.
+   */
+  uint32_t priority;
+  /*
+   * Seconds from the request until the file is needed, 0 for none.
+   */
+  uint32_t deadline;
+  /*
+   * Size of the file in bytes if known, 0 otherwise.
+   */
+  uint64_t size;
+  /*
+   * Encoding of the data on the link, decoded while it is received:
+   * 0 none, 1 zstd frames, 2 LZ4 frames. Checksum and size refer to
+   * the data as sent.
+   */
+  uint32_t compression;
+  /*
+   * Existing file on board the payload is a delta against, empty for a
+   * full upload. The new file is built next to file_location and renamed
+   * over it once complete, so base_location may name file_location itself.
+   */
+  char *base_location;
+  /*
+   * SHA-256 of the file as stored on board, after decoding, empty if
+   * unknown. A file with this content already on board is linked or
+   * copied to file_location instead of being uploaded again.
+   */
+  ProtobufCBinaryData sha256;
+  /*
+   * Forward error correction: the server adds fec_repair repair packets
+   * to every fec_source packets of the payload, see src/include/fec.h.
+   * 0 for none. Needs size.
+   */
+  uint32_t fec_source;
+  uint32_t fec_repair;
 };
 #define UPLOAD_METADATA_ITEM__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&upload_metadata_item__descriptor) \
-    , (char *)protobuf_c_empty_string, 0, 0, 0 }
+    , (char *)protobuf_c_empty_string, 0, 0, 0, 0, 0, 0, 0, (char *)protobuf_c_empty_string, {0,NULL}, 0, 0 }
 
 
 struct  UploadMetadata
@@ -0,0 +1,59 @@
+#ifndef UPLOAD_CLIENT_RATE_CONTROL_H
+#define UPLOAD_CLIENT_RATE_CONTROL_H
+
+#include <stdint.h>
+
+/* Loss ratio (per mille) below which the rate is increased */
+#define RATE_CONTROL_LOSS_LOW 10
+/* Loss ratio (per mille) above which the rate is halved */
+#define RATE_CONTROL_LOSS_HIGH 50
+
+typedef enum
+{
+	RATE_LINK_KISS,
+	RATE_LINK_CAN,
+	RATE_LINK_ZMQ,
+} rate_link_t;
+
+/* Session parameters suited to one kind of link */
+typedef struct
+{
+	uint32_t throughput; // initial rate in bytes per second
+	uint32_t min;
+	uint32_t max;
+	uint32_t step; // additive increase per round
+	uint16_t mtu;
+	uint16_t timeout; // seconds
+} rate_profile_t;
+
+/* Rate of one session, adjusted between rounds */
+typedef struct
+{
+	uint32_t throughput;
+} rate_controller_t;
+
+/**
+ * Select the profile of the link uploads are received on.
+ * @param baudrate line rate of the link in bits per second, 0 for the default
+ */
+void rate_control_init(rate_link_t link, uint32_t baudrate);
+
+/**
+ * Copy of the profile of the configured link. It may change when the link
+ * is reconfigured, take a copy once per decision.
+ */
+rate_profile_t rate_control_profile(void);
+
+/**
+ * Start a session at the rate the last sessions settled on.
+ */
+void rate_control_start(rate_controller_t *rc);
+
+/**
+ * Adapt the rate to the loss seen in the last round, AIMD style.
+ * @param expected packets the round should have delivered
+ * @param lost packets of those still missing after the round
+ */
+void rate_control_update(rate_controller_t *rc, uint32_t expected, uint32_t lost);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef UPLOAD_CLIENT_RESUME_MAP_H
+#define UPLOAD_CLIENT_RESUME_MAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Suffix of the sidecar file stored next to the destination */
+#define RESUME_MAP_SUFFIX ".dtpmap"
+/* The sidecar is rewritten after this many new packets */
+#define RESUME_MAP_SYNC_PACKETS 256
+/* Open ended interval, reaches to the last packet of the payload */
+#define RESUME_MAP_END UINT32_MAX
+/* Each record in the sidecar starts with a header of this size, followed by the intervals */
+#define RESUME_MAP_HEADER_SIZE 24
+
+/* Range of packet numbers [start, end) */
+typedef struct
+{
+	uint32_t start;
+	uint32_t end;
+} resume_interval_t;
+
+/* Sorted, non-overlapping set of received packet ranges */
+typedef struct
+{
+	resume_interval_t *intervals; // owned by the caller
+	uint32_t count;
+	uint32_t capacity;			  // the set never grows beyond it
+	uint32_t received; // packets in the set
+	uint32_t pending;  // packets added since the last sync
+	uint32_t crc_acc;  // CRC-32 accumulator of the received packets
+	uint32_t packet_size; // payload bytes per packet the ranges refer to
+	uint32_t sequence; // records written to the sidecar, each goes to the slot of the older one
+	int fd;			   // sidecar file
+} resume_map_t;
+
+/**
+ * Open the sidecar of a destination file.
+ * @param load keep the ranges stored by an earlier session, otherwise start empty
+ * @param intervals memory for up to capacity ranges, used until the map is closed
+ * @return 0 on success, -1 on failure
+ */
+int resume_map_open(resume_map_t *map, const char *dest_path, bool load, resume_interval_t *intervals, uint32_t capacity);
+
+/**
+ * Mark a packet as received.
+ * @return 1 if the packet is new, 0 if it was already received or would need
+ * a range beyond capacity, in which case it counts as missing, -1 if seq is
+ * RESUME_MAP_END, which is not a packet number
+ */
+int resume_map_add(resume_map_t *map, uint32_t seq);
+
+/**
+ * True if the packet was received
+ */
+bool resume_map_contains(const resume_map_t *map, uint32_t seq);
+
+/**
+ * Packets below the highest received one that are still missing
+ */
+static inline uint32_t resume_map_gaps(const resume_map_t *map)
+{
+	return map->count ? map->intervals[map->count - 1].end - map->received : 0;
+}
+
+/**
+ * Number of packets received without a gap from the first one
+ */
+static inline uint32_t resume_map_prefix(const resume_map_t *map)
+{
+	return map->count && map->intervals[0].start == 0 ? map->intervals[0].end : 0;
+}
+
+/**
+ * True once enough packets were marked since the last sync
+ */
+static inline bool resume_map_sync_due(const resume_map_t *map)
+{
+	return map->pending >= RESUME_MAP_SYNC_PACKETS;
+}
+
+/**
+ * Write the set to the sidecar and fsync it. The sidecar holds two records
+ * and the older one is replaced, so a reset during the write leaves the
+ * newer one to load. The caller must make the data of the marked packets
+ * durable first.
+ * @return 0 on success, -1 on failure
+ */
+int resume_map_sync(resume_map_t *map);
+
+/**
+ * Encode the header of the next record of the set, for writing it
+ * elsewhere than resume_map_sync. The header and then the intervals go to
+ * the returned offset; once they are durable, increment map->sequence.
+ * @return offset of the record in the sidecar
+ */
+off_t resume_map_header(const resume_map_t *map, uint8_t header[RESUME_MAP_HEADER_SIZE]);
+
+/**
+ * Collect the ranges that have not been received. The last range is open
+ * ended, ranges beyond max are merged into the last one returned.
+ * @return number of ranges written to out
+ */
+uint32_t resume_map_missing(const resume_map_t *map, resume_interval_t *out, uint32_t max);
+
+/**
+ * Close the sidecar.
+ * @param remove delete the sidecar, used once the payload is complete
+ */
+void resume_map_close(resume_map_t *map, const char *dest_path, bool remove);
+
+#endif
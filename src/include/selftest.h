@@ -0,0 +1,47 @@
+#ifndef UPLOAD_CLIENT_SELFTEST_H
+#define UPLOAD_CLIENT_SELFTEST_H
+
+#include <stdint.h>
+
+/* Files of the script, one upload each */
+#define SELFTEST_MAX_FILES 32
+/* Default duration: at least this many seconds ... */
+#define SELFTEST_MIN_DURATION 3
+/* ... plus this many times what the files take at the session rate, for losses and rate cuts */
+#define SELFTEST_DURATION_FACTOR 4
+/* Address the self-test reports to and serves from, over the loopback interface */
+#define SELFTEST_ADDRESS 1
+
+/* Impairments of the emulated link */
+typedef struct
+{
+	uint32_t latency_ms; // one way
+	uint32_t loss;		 // packets lost per thousand
+	uint32_t reorder;	 // packets held back behind the next one per thousand
+	uint32_t rate;		 // bytes per second, 0 for no cap beyond the requested throughput
+} selftest_link_t;
+
+/**
+ * Parse a link description such as "latency=250,loss=20,reorder=5,rate=9600",
+ * loss and reorder given per thousand packets. Keys left out keep their value.
+ * @return 0 on success, -1 if it is malformed
+ */
+int selftest_parse_link(selftest_link_t *link, const char *spec);
+
+/**
+ * Replace libdtp with the emulated link and serve the files in dir from it.
+ * Call before the upload pool is started.
+ * @return number of files to upload, -1 on failure
+ */
+int selftest_init(const char *dir, const selftest_link_t *link);
+
+/**
+ * Request every file as an upload to a scratch directory and print the
+ * completion time and rounds of each once all have reported, or after
+ * duration seconds. A duration of 0 is derived from the file sizes, the
+ * session rate and the emulated link.
+ * @return 0 if every file arrived intact, -1 otherwise
+ */
+int selftest_run(unsigned int duration);
+
+#endif
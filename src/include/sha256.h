@@ -0,0 +1,27 @@
+#ifndef UPLOAD_CLIENT_SHA256_H
+#define UPLOAD_CLIENT_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct
+{
+	uint32_t state[8];
+	uint64_t length; // bytes hashed so far
+	uint8_t buf[64];
+	size_t buf_len;
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * SHA-256 of the whole file behind fd, read from its start.
+ * @return 0 on success, -1 on a read error
+ */
+int sha256_file(int fd, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef UPLOAD_CLIENT_STRIPE_H
+#define UPLOAD_CLIENT_STRIPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "upload_pool.h"
+
+/* Servers that can be reached over more than one route */
+#define STRIPE_MAX_SERVERS 8
+/* Routes to one server, including its primary address */
+#define STRIPE_MAX_ROUTES 4
+
+/**
+ * Register another address of a DTP server, reached over a different link.
+ * Uploads from the server are then striped over all of its addresses.
+ * Only called during startup.
+ * @return 0 on success, -1 if the tables are full
+ */
+int stripe_add_route(uint16_t server, uint16_t alias);
+
+/**
+ * Start the threads that run the extra sessions of striped rounds, enough
+ * for max_sessions uploads to stripe at once. None are started without
+ * aliases. Call once the routes are registered.
+ * @return 0 on success, -1 on failure
+ */
+int stripe_start(unsigned int max_sessions);
+
+/**
+ * Number of routes to a server, 1 if it has no aliases
+ */
+unsigned int stripe_routes(uint16_t server);
+
+/**
+ * Fetch the missing packets of an upload in one round, split over all
+ * routes to its server in proportion to the throughput measured on each.
+ * The upload size must be known.
+ * @return true once every packet of the payload was received
+ */
+bool stripe_run(dtp_thread_args_t *opts);
+
+#endif
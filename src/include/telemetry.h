@@ -0,0 +1,67 @@
+#ifndef UPLOAD_CLIENT_TELEMETRY_H
+#define UPLOAD_CLIENT_TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Upload counters published as libparam parameters for ground telemetry.
+ * The hot paths only add to atomic counters, a sampler thread derives the
+ * rate, CSP buffer occupancy and latency percentiles from them once per period.
+ */
+
+/* libparam IDs, after those of link_config.h */
+#define TELEMETRY_PARAM_ID_BYTES 310
+#define TELEMETRY_PARAM_ID_DONE 311
+#define TELEMETRY_PARAM_ID_FAILED 312
+#define TELEMETRY_PARAM_ID_RATE 313
+#define TELEMETRY_PARAM_ID_WRITE_LATENCY 314
+#define TELEMETRY_PARAM_ID_CSP_BUFFERS 315
+#define TELEMETRY_PARAM_ID_RETRANSMITS 316
+
+/* Sampling period of the rate and buffer occupancy */
+#define TELEMETRY_PERIOD_MS 1000
+/* Periods the write latency percentiles are taken over */
+#define TELEMETRY_LATENCY_PERIODS 10
+
+/* Latency histogram buckets: 2^TELEMETRY_HIST_SUB_BITS per power of two up to 2^32 us */
+#define TELEMETRY_HIST_SUB_BITS 4
+#define TELEMETRY_HIST_BUCKETS ((32 - TELEMETRY_HIST_SUB_BITS + 1) << TELEMETRY_HIST_SUB_BITS)
+
+/* Percentiles of write_latency, in microseconds */
+typedef enum
+{
+	TELEMETRY_P50,
+	TELEMETRY_P90,
+	TELEMETRY_P99,
+	TELEMETRY_P999,
+	TELEMETRY_PERCENTILES,
+} telemetry_percentile_t;
+
+/**
+ * Start the sampler thread.
+ * @return 0 on success, -1 on failure
+ */
+int telemetry_start(void);
+
+/**
+ * Count the payload bytes of a stored packet.
+ */
+void telemetry_packet(uint32_t len);
+
+/**
+ * Count a finished session.
+ */
+void telemetry_session(bool ok);
+
+/**
+ * Count a round that requests missing packets again.
+ */
+void telemetry_retransmit(void);
+
+/**
+ * Record the time a block write to a staging file took.
+ */
+void telemetry_write(uint64_t ns);
+
+#endif
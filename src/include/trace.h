@@ -0,0 +1,122 @@
+#ifndef UPLOAD_CLIENT_TRACE_H
+#define UPLOAD_CLIENT_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Events kept per thread, older ones are overwritten. Must be a power of two */
+#define TRACE_RING_EVENTS 4096
+/* Threads that can record events, later ones are not traced */
+#define TRACE_MAX_THREADS 32
+#define TRACE_THREAD_NAME_MAX 16
+
+/* What an event records, see trace_names in trace.c */
+typedef enum
+{
+	TRACE_ACCEPT,	   // a request connection was accepted
+	TRACE_PARSE,	   // decoding a request and scheduling its uploads
+	TRACE_FILE_OPEN,   // opening the staging file and its sidecar
+	TRACE_SESSION,	   // one dtp_client_main call
+	TRACE_ROUND,	   // a round ended, with the packets still missing
+	TRACE_RETRANSMIT,  // counter of packets requested again in the next round
+	TRACE_WRITE,	   // a block written to the staging file
+	TRACE_CHECKPOINT,  // data and sidecar made durable
+	TRACE_FEC_DECODE,  // lost packets rebuilt from repair packets
+	TRACE_EVENT_COUNT,
+} trace_event_t;
+
+/* Chrome trace phases */
+typedef enum
+{
+	TRACE_PHASE_BEGIN = 'B',
+	TRACE_PHASE_END = 'E',
+	TRACE_PHASE_COMPLETE = 'X',
+	TRACE_PHASE_INSTANT = 'i',
+	TRACE_PHASE_COUNTER = 'C',
+} trace_phase_t;
+
+typedef struct
+{
+	uint64_t ts_ns;
+	uint32_t dur_ns; // TRACE_PHASE_COMPLETE only
+	uint8_t event;
+	uint8_t phase;
+	uint16_t arg0;	 // usually the payload ID
+	uint64_t arg1;
+} trace_record_t;
+
+/* Recording is off unless trace_start was called */
+extern atomic_bool trace_enabled;
+
+/**
+ * Start recording. The events are written to path as Chrome trace JSON
+ * (chrome://tracing, Perfetto) on SIGUSR1 and when the process is ended by
+ * SIGINT or SIGTERM. Call before any other thread is started, the signals
+ * are taken by a thread of their own.
+ * @return 0 on success, -1 on failure
+ */
+int trace_start(const char *path);
+
+/**
+ * Name the calling thread in the trace.
+ */
+void trace_thread_name(const char *name);
+
+/**
+ * Append an event to the ring of the calling thread. Never blocks and never
+ * takes a lock, the dump reads the rings while they are written.
+ */
+void trace_record(trace_event_t event, trace_phase_t phase, uint16_t arg0, uint64_t arg1, uint64_t start_ns);
+
+/**
+ * Write every ring to the trace file.
+ * @return 0 on success, -1 on failure
+ */
+int trace_dump(void);
+
+/* Monotonic clock in nanoseconds, 0 while tracing is off */
+uint64_t trace_now(void);
+
+static inline void trace_begin(trace_event_t event, uint16_t arg0, uint64_t arg1)
+{
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+	{
+		trace_record(event, TRACE_PHASE_BEGIN, arg0, arg1, 0);
+	}
+}
+
+static inline void trace_end(trace_event_t event, uint16_t arg0, uint64_t arg1)
+{
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+	{
+		trace_record(event, TRACE_PHASE_END, arg0, arg1, 0);
+	}
+}
+
+/* An event that started at start_ns, taken with trace_now, and ends now */
+static inline void trace_complete(trace_event_t event, uint16_t arg0, uint64_t arg1, uint64_t start_ns)
+{
+	if (start_ns != 0 && atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+	{
+		trace_record(event, TRACE_PHASE_COMPLETE, arg0, arg1, start_ns);
+	}
+}
+
+static inline void trace_instant(trace_event_t event, uint16_t arg0, uint64_t arg1)
+{
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+	{
+		trace_record(event, TRACE_PHASE_INSTANT, arg0, arg1, 0);
+	}
+}
+
+static inline void trace_counter(trace_event_t event, uint16_t arg0, uint64_t value)
+{
+	if (atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+	{
+		trace_record(event, TRACE_PHASE_COUNTER, arg0, value, 0);
+	}
+}
+
+#endif
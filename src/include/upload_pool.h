@@ -0,0 +1,132 @@
+#ifndef UPLOAD_CLIENT_UPLOAD_POOL_H
+#define UPLOAD_CLIENT_UPLOAD_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "content_index.h"
+#include "file_sink.h"
+#include "rate_control.h"
+
+#include "dtp/dtp.h"
+
+/* Default number of DTP sessions that may run at the same time */
+#define UPLOAD_POOL_DEFAULT_SESSIONS 4
+/* Upper bound for the -n option, each session holds a worker thread */
+#define UPLOAD_POOL_MAX_SESSIONS 32
+/* Number of accepted requests that may wait for a session */
+#define UPLOAD_POOL_QUEUE_LENGTH 16
+/* Upper bound for the -q option, each context holds the buffers of one upload */
+#define UPLOAD_POOL_MAX_CONTEXTS 256
+
+/* Rounds of dtp_client_main per upload before it is left for a RESUME request */
+#define UPLOAD_POOL_MAX_ROUNDS 8
+
+// Struct to pass arguments to the DTP client thread
+typedef struct
+{
+	uint32_t server_addr;
+	upload_sink_t sink;
+
+	int color;
+	int resume;
+	uint32_t server;
+	unsigned int throughput;
+	unsigned int timeout;
+	unsigned int payload_id;
+	unsigned int mtu;
+	uint32_t checksum;	// expected CRC-32 of the file, 0 if unknown
+	bool indexed;		// look the file up in the content index under sha256, add it once received
+	bool present;		// placed from the content index by the setup thread, no session needed
+	uint8_t sha256[CONTENT_INDEX_HASH_SIZE];
+	uint16_t requester; // node that receives the completion report
+	uint32_t journal_id; // 0 if the upload is not journaled
+	upload_stats_t *stats;
+	rate_controller_t rate;
+
+	/* Scheduling, see upload_queue.h */
+	uint8_t priority;
+	uint64_t deadline_ns; // monotonic time the file is needed by, 0 for none
+	uint64_t size;		  // expected file size, 0 if unknown
+	uint64_t stored;	  // payload bytes received by earlier rounds, counted by the worker
+	uint64_t remaining;	  // bytes left when last queued or adjusted, the queue never reads the sink
+	uint32_t order;		  // arrival order among equal uploads
+	uint32_t reserved;	  // share of the link held while running
+
+	/* Sink, opened by the setup thread while the upload waits or its session starts */
+	char path[PATH_MAX]; // destination, set while the context is in use
+	char base[PATH_MAX]; // file the payload is a delta against, empty for a full upload
+	upload_compression_t compression;
+	uint32_t fec_source; // packets per FEC block, 0 without repair packets
+	uint32_t fec_repair;
+} dtp_thread_args_t;
+
+/**
+ * Reserve the contexts uploads run in, including the buffers of their sink.
+ * All memory is allocated and touched here, so uploads queued or running
+ * at once are bounded by contexts and take nothing from the heap.
+ * @return 0 on success, -1 on failure
+ */
+int upload_pool_reserve(unsigned int contexts);
+
+/**
+ * True if an upload to path is queued or running. Its sink owns the
+ * staging file and sidecar of path until its context is released.
+ */
+bool upload_pool_busy(const char *path);
+
+/**
+ * True if every context is in use.
+ */
+bool upload_pool_full(void);
+
+/**
+ * Take a free context for a new upload to path, its path is set.
+ * @return the context, or NULL if all are in use or path is busy
+ */
+dtp_thread_args_t *upload_pool_acquire(const char *path);
+
+/**
+ * Return a context once its upload ended and its sink is closed, which
+ * frees its path for the next upload.
+ */
+void upload_pool_release(dtp_thread_args_t *args);
+
+/**
+ * Start the pool of DTP session workers.
+ * @param max_sessions number of sessions that may run concurrently
+ * @return 0 on success, -1 on failure
+ */
+int upload_pool_start(unsigned int max_sessions);
+
+/**
+ * Queue an upload, workers start it once it is first in line and fits in
+ * the link budget. Its sink is opened on the setup thread meanwhile, from
+ * path, base, compression and the FEC parameters; an upload that cannot be
+ * opened is reported as failed. The queue orders it without reading the
+ * sink, a resumed upload counts as if nothing were stored yet until its
+ * first round. On success the pool takes ownership of
+ * args, on failure the caller keeps it.
+ * @return 0 on success, -1 if the queue is full
+ */
+int upload_pool_submit(dtp_thread_args_t *args);
+
+/*
+ * Runs one DTP session: requests the payload from server and hands what
+ * arrives to default_session_hooks until the session ends.
+ * Returns DTP_OK if the session ran to its end.
+ */
+typedef dtp_result (*upload_transport_t)(uint32_t server, uint32_t throughput, uint32_t timeout, uint16_t payload_id, uint16_t mtu, bool resume);
+
+/**
+ * Replace libdtp as the transport of all sessions, for the self-test.
+ * Only called before upload_pool_start.
+ */
+void upload_pool_set_transport(upload_transport_t transport);
+
+/**
+ * Run one DTP session over the current transport.
+ */
+dtp_result upload_pool_session(uint32_t server, uint32_t throughput, uint32_t timeout, uint16_t payload_id, uint16_t mtu, bool resume);
+
+#endif
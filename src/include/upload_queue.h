@@ -0,0 +1,41 @@
+#ifndef UPLOAD_CLIENT_UPLOAD_QUEUE_H
+#define UPLOAD_CLIENT_UPLOAD_QUEUE_H
+
+#include "upload_pool.h"
+
+/* Priority classes, lower runs first */
+#define UPLOAD_PRIORITY_URGENT 0 // started even when the link budget is used up
+#define UPLOAD_PRIORITY_NORMAL 1
+#define UPLOAD_PRIORITY_BULK 2
+
+/**
+ * Add an upload to the queue, ordered by priority class, then deadline,
+ * then the bytes it has left, taken from size and stored at this point.
+ * @return 0 on success, -1 if the queue is full
+ */
+int upload_queue_push(dtp_thread_args_t *job);
+
+/**
+ * True if upload_queue_push would fail for lack of room.
+ */
+bool upload_queue_full(void);
+
+/**
+ * Wait until the first upload in the queue fits in the link budget, then
+ * take it out and reserve its share of the link in job->throughput.
+ */
+dtp_thread_args_t *upload_queue_admit(void);
+
+/**
+ * Move the reservation of a running upload to the rate its controller
+ * chose, limited to what the other sessions leave of the link, and take
+ * its remaining bytes from stored again.
+ */
+void upload_queue_adjust(dtp_thread_args_t *job);
+
+/**
+ * Return the link share of an upload that stopped running.
+ */
+void upload_queue_release(dtp_thread_args_t *job);
+
+#endif
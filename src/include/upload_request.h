@@ -0,0 +1,59 @@
+#ifndef UPLOAD_CLIENT_UPLOAD_REQUEST_H
+#define UPLOAD_CLIENT_UPLOAD_REQUEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+#include "content_index.h"
+#include "decompress.h"
+
+/* Scratch memory for decoding one UploadMetadata request */
+#define UPLOAD_REQUEST_ARENA_SIZE 4096
+/* Most files a single batch request may schedule */
+#define UPLOAD_REQUEST_MAX_ITEMS 32
+
+/* One file to be fetched from a DTP server */
+typedef struct
+{
+	uint32_t server;
+	uint16_t payload_id;
+	bool resume;
+	const char *file_location;
+	uint32_t checksum;	// expected CRC-32, 0 if unknown
+	uint16_t requester; // node that receives the completion report
+	uint8_t priority;	// UPLOAD_PRIORITY_*
+	uint32_t deadline;	// seconds until the file is needed, 0 for none
+	uint64_t size;		// expected size in bytes, 0 if unknown
+	upload_compression_t compression;
+	const char *base_location; // file the payload is a delta against, NULL for a full upload
+	const uint8_t *sha256;	   // CONTENT_INDEX_HASH_SIZE bytes of the decoded file, NULL if unknown
+	uint32_t fec_source;	   // packets per FEC block, 0 without repair packets
+	uint32_t fec_repair;	   // repair packets per block
+	uint32_t journal_id;	   // live journal record of a resumed upload, 0 to journal it here
+} upload_request_t;
+
+/**
+ * Open the destination of a request and queue it for a DTP worker. A file
+ * whose content is in the content index is placed by the setup thread
+ * instead and reported complete without a session. The journal record of
+ * a new upload is synced by journal_sync, after the reply.
+ * @return UPLOAD_CLIENT_DTP_REQUEST_* for the reply
+ */
+int upload_request_schedule(const upload_request_t *req);
+
+/**
+ * Decode a request packet from the control port, schedule the uploads it
+ * names and send the reply on conn. The packet stays owned by the caller.
+ */
+void upload_request_handle(csp_conn_t *conn, const csp_packet_t *packet);
+
+/**
+ * Tell the requester how an upload ended.
+ * @param status one of UPLOAD_CLIENT_DTP_RESULT_*
+ * @param checksum CRC-32 of the received file
+ */
+void upload_request_report(uint16_t requester, uint16_t payload_id, uint8_t status, uint32_t checksum, uint32_t size);
+
+#endif
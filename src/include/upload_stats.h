@@ -0,0 +1,84 @@
+#ifndef UPLOAD_CLIENT_UPLOAD_STATS_H
+#define UPLOAD_CLIENT_UPLOAD_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+/* Sessions tracked at once, queued, active and recently finished */
+#define UPLOAD_STATS_SLOTS 64
+/* Window of the current throughput estimate */
+#define UPLOAD_STATS_RATE_WINDOW_NS 1000000000ull
+
+typedef enum
+{
+	UPLOAD_STATE_FREE = 0,
+	UPLOAD_STATE_QUEUED,
+	UPLOAD_STATE_ACTIVE,
+	UPLOAD_STATE_DONE,
+	UPLOAD_STATE_FAILED,
+} upload_state_t;
+
+/*
+ * Progress of one session. The fields are written by the thread running the
+ * session and read by the status handler, all without taking a lock.
+ */
+typedef struct
+{
+	atomic_uint state;
+	atomic_uint payload_id;
+	atomic_uint server;
+	atomic_uint result;
+	atomic_uint checksum;
+	atomic_ullong bytes;
+	atomic_uint packets;
+	atomic_uint missing;
+	atomic_uint rate;	 // bytes per second over the last window
+	atomic_uint rtt_ms; // session start until the first data packet
+	atomic_ullong queued_ns;
+	atomic_ullong start_ns;
+	atomic_ullong first_ns;
+	atomic_ullong last_ns;
+	atomic_ullong end_ns;
+
+	/* Owned by the session thread */
+	uint64_t window_ns;
+	uint64_t window_bytes;
+} upload_stats_t;
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t upload_stats_now(void);
+
+/**
+ * Claim a slot for a newly queued session, reusing the oldest finished
+ * session when the table is full. Only called from the request thread.
+ * @return the slot, or NULL if every slot belongs to a live session
+ */
+upload_stats_t *upload_stats_claim(uint16_t payload_id, uint16_t server);
+
+/**
+ * The session begins running dtp_client_main
+ */
+void upload_stats_start(upload_stats_t *stats);
+
+/**
+ * Account for a newly stored packet.
+ * @param missing packets below the highest received one still missing
+ */
+void upload_stats_packet(upload_stats_t *stats, uint32_t len, uint32_t missing);
+
+/**
+ * The session ended.
+ * @param result one of UPLOAD_CLIENT_DTP_RESULT_*
+ */
+void upload_stats_finish(upload_stats_t *stats, uint8_t result, uint32_t checksum);
+
+/**
+ * Reply to a STATUS request with a record for every tracked session.
+ */
+void upload_stats_send(csp_conn_t *conn);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef UPLOAD_CLIENT_URING_WRITER_H
+#define UPLOAD_CLIENT_URING_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Submission queue entries of the ring shared by all uploads */
+#define URING_WRITER_ENTRIES 256
+/* Queued operations are submitted once this many have collected */
+#define URING_WRITER_BATCH 8
+/* ... or after this long, so a lone write does not wait for company */
+#define URING_WRITER_FLUSH_US 2000
+
+/*
+ * An operation in flight. Embedded in the state of its owner, done is
+ * called on the completion thread with the result of the operation,
+ * the byte count or a negative errno.
+ */
+typedef struct uring_writer_op_s
+{
+	void (*done)(struct uring_writer_op_s *op, int res);
+} uring_writer_op_t;
+
+/**
+ * Set up the ring and its completion thread. Writes from fixed, up to
+ * size bytes, use it as a registered buffer. Without io_uring support,
+ * compiled in or from the kernel, nothing is started.
+ * @return 0 if the ring is running, -1 if writes stay synchronous
+ */
+int uring_writer_start(void *fixed, size_t size);
+
+/**
+ * True once the ring is running
+ */
+bool uring_writer_enabled(void);
+
+/**
+ * Queue a write of len bytes from buf at offset.
+ * @return 0 on success, -1 if the ring is not running or stays full, done
+ * is not called then
+ */
+int uring_writer_write(uring_writer_op_t *op, int fd, const void *buf, size_t len, off_t offset);
+
+/**
+ * Queue a gathered write at offset followed by an fdatasync of fd, done is
+ * called once for both with the result of the sync. A failed write cancels
+ * the sync.
+ * @return 0 on success, -1 if the ring is not running or stays full, done
+ * is not called then
+ */
+int uring_writer_writev_sync(uring_writer_op_t *op, int fd, const struct iovec *iov, unsigned int count, off_t offset);
+
+/**
+ * Queue an fdatasync of fd.
+ * @return 0 on success, -1 if the ring is not running or stays full, done
+ * is not called then
+ */
+int uring_writer_sync(uring_writer_op_t *op, int fd);
+
+/**
+ * Submit the queued operations now, used before waiting for one of them.
+ */
+void uring_writer_submit(void);
+
+#endif
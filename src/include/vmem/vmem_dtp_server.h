@@ -7,5 +7,19 @@
 #define UPLOAD_CLIENT_DTP_UPLOAD_REQUEST 0
 #define UPLOAD_CLIENT_DTP_RESUME_REQUEST 1
 #define UPLOAD_CLIENT_DTP_STATUS_REQUEST 2
+#define UPLOAD_CLIENT_DTP_BATCH_REQUEST 3
+
+/* Port on the requester that receives completion reports */
+#define UPLOAD_CLIENT_DTP_COMPLETION_PORT 14
+
+#define UPLOAD_CLIENT_DTP_RESULT_FAILED 0
+#define UPLOAD_CLIENT_DTP_RESULT_OK 1
+#define UPLOAD_CLIENT_DTP_RESULT_CHECKSUM 2
+
+/* Status of each file in the reply to a request */
+#define UPLOAD_CLIENT_DTP_REQUEST_REJECTED 0
+#define UPLOAD_CLIENT_DTP_REQUEST_SCHEDULED 1
+#define UPLOAD_CLIENT_DTP_REQUEST_PRESENT 2 // no longer sent, a file in the content index is scheduled and reported complete
+#define UPLOAD_CLIENT_DTP_REQUEST_BUSY 3 // an upload to the same destination is queued or running
 
 #endif
\ No newline at end of file
@@ -0,0 +1,560 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+
+#include "journal.h"
+#include "atomic_file.h"
+#include "crc32.h"
+#include "upload_pool.h"
+#include "upload_queue.h"
+#include "vmem_dtp_server.h"
+
+#define JOURNAL_MAGIC 0x4A505444 // "DTPJ"
+
+typedef enum
+{
+	JOURNAL_ACCEPT = 1,
+	JOURNAL_PROGRESS = 2,
+	JOURNAL_DONE = 3,
+} journal_type_t;
+
+/* Every record starts with this header, the payload follows */
+typedef struct
+{
+	uint32_t magic;
+	uint16_t length; // payload bytes
+	uint8_t type;
+	uint8_t reserved;
+	uint32_t id;
+	uint32_t crc; // CRC-32 of the header with crc 0, then the payload
+} journal_header_t;
+
+/* Payload of JOURNAL_ACCEPT, followed by the destination and base paths */
+typedef struct
+{
+	uint64_t size;
+	int64_t deadline; // wall clock second the file is needed by, 0 for none
+	uint32_t server;
+	uint32_t checksum;
+	uint32_t fec_source;
+	uint32_t fec_repair;
+	uint16_t payload_id;
+	uint16_t requester;
+	uint8_t priority;
+	uint8_t compression;
+	uint8_t has_sha256;
+	uint8_t reserved;
+	uint8_t sha256[CONTENT_INDEX_HASH_SIZE];
+	uint16_t path_len; // with the terminating NUL
+	uint16_t base_len; // with the terminating NUL, 0 for a full upload
+} journal_accept_t;
+
+#define JOURNAL_RECORD_MAX (sizeof(journal_header_t) + sizeof(journal_accept_t) + 2 * PATH_MAX)
+
+/* A live upload, its request is read back from the ACCEPT record when needed */
+typedef struct
+{
+	uint32_t id; // 0 for a free slot
+	uint32_t received;
+	uint64_t path_hash;
+	off_t offset;		// of the ACCEPT record
+	uint32_t next_id;	// next slot in its bucket of journal_by_id, or the free list
+	uint32_t next_path; // next slot in its bucket of journal_by_path
+} journal_live_t;
+
+/* Buckets of the live uploads by ID and by destination, a power of two */
+#define JOURNAL_BUCKETS (2 * JOURNAL_MAX_LIVE)
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *journal_path = NULL;
+static int journal_fd = -1;
+static off_t journal_end = 0;
+static uint32_t journal_records = 0;
+static uint32_t journal_next_id = 1;
+static bool journal_dirty = false; // ACCEPT records appended since the last sync
+static uint8_t journal_buf[JOURNAL_RECORD_MAX];
+
+/* Slots hold live uploads, links and bucket heads are a slot index plus one, 0 ends a chain */
+static journal_live_t journal_live[JOURNAL_MAX_LIVE];
+static unsigned int journal_live_count = 0;
+static unsigned int journal_slots = 0; // slots used so far
+static uint32_t journal_unused = 0;	   // freed slots, linked by next_id
+static uint32_t journal_by_id[JOURNAL_BUCKETS];
+static uint32_t journal_by_path[JOURNAL_BUCKETS];
+
+/* IDs of the uploads found by journal_open not yet scheduled, taken in order by journal_rearm */
+static uint32_t journal_backlog[JOURNAL_MAX_LIVE];
+static unsigned int journal_backlog_head = 0, journal_backlog_count = 0;
+static pthread_mutex_t rearm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t journal_hash(const char *path)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (; *path; path++)
+	{
+		hash = (hash ^ (uint8_t)*path) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static uint32_t journal_crc(journal_header_t header, const void *payload)
+{
+	header.crc = 0;
+	uint32_t crc = crc32_update(0xFFFFFFFF, &header, sizeof(header));
+	return ~crc32_update(crc, payload, header.length);
+}
+
+static journal_live_t *journal_find(uint32_t id)
+{
+	for (uint32_t slot = journal_by_id[id % JOURNAL_BUCKETS]; slot != 0; slot = journal_live[slot - 1].next_id)
+	{
+		if (journal_live[slot - 1].id == id)
+		{
+			return &journal_live[slot - 1];
+		}
+	}
+	return NULL;
+}
+
+static journal_live_t *journal_find_path(uint64_t path_hash)
+{
+	for (uint32_t slot = journal_by_path[path_hash % JOURNAL_BUCKETS]; slot != 0; slot = journal_live[slot - 1].next_path)
+	{
+		if (journal_live[slot - 1].path_hash == path_hash)
+		{
+			return &journal_live[slot - 1];
+		}
+	}
+	return NULL;
+}
+
+static void journal_remove(journal_live_t *live)
+{
+	uint32_t slot = live - journal_live + 1;
+	uint32_t *link = &journal_by_id[live->id % JOURNAL_BUCKETS];
+
+	while (*link != slot)
+	{
+		link = &journal_live[*link - 1].next_id;
+	}
+	*link = live->next_id;
+	link = &journal_by_path[live->path_hash % JOURNAL_BUCKETS];
+	while (*link != slot)
+	{
+		link = &journal_live[*link - 1].next_path;
+	}
+	*link = live->next_path;
+
+	live->id = 0;
+	live->next_id = journal_unused;
+	journal_unused = slot;
+	journal_live_count--;
+}
+
+static int journal_write(int fd, off_t offset, journal_type_t type, uint32_t id, const void *payload, uint16_t length)
+{
+	journal_header_t header = {.magic = JOURNAL_MAGIC, .length = length, .type = type, .id = id};
+	header.crc = journal_crc(header, payload);
+
+	struct iovec iov[2] = {
+		{.iov_base = &header, .iov_len = sizeof(header)},
+		{.iov_base = (void *)payload, .iov_len = length},
+	};
+	return pwritev(fd, iov, 2, offset) == (ssize_t)(sizeof(header) + length) ? 0 : -1;
+}
+
+static int journal_append(journal_type_t type, uint32_t id, const void *payload, uint16_t length)
+{
+	if (journal_write(journal_fd, journal_end, type, id, payload, length) != 0)
+	{
+		csp_print("Failed to write the journal: %s\n", strerror(errno));
+		return -1;
+	}
+	journal_end += sizeof(journal_header_t) + length;
+	journal_records++;
+	return 0;
+}
+
+/* Read the record at offset into journal_buf, returns its length or -1 if it is torn */
+static ssize_t journal_read(int fd, off_t offset)
+{
+	journal_header_t *header = (journal_header_t *)journal_buf;
+
+	if (pread(fd, header, sizeof(*header), offset) != sizeof(*header) || header->magic != JOURNAL_MAGIC ||
+		sizeof(*header) + header->length > sizeof(journal_buf))
+	{
+		return -1;
+	}
+	uint8_t *payload = journal_buf + sizeof(*header);
+	if (pread(fd, payload, header->length, offset + sizeof(*header)) != header->length ||
+		journal_crc(*header, payload) != header->crc)
+	{
+		return -1;
+	}
+	return sizeof(*header) + header->length;
+}
+
+/* Start tracking an upload, a newer one to the same destination ends the older */
+static void journal_track(uint32_t id, uint64_t path_hash, off_t offset)
+{
+	journal_live_t *live = journal_find_path(path_hash);
+	if (live)
+	{
+		journal_remove(live);
+	}
+	if (journal_live_count == JOURNAL_MAX_LIVE)
+	{
+		csp_print("Journal full, forgetting upload %u\n", journal_live[0].id);
+		journal_remove(&journal_live[0]);
+	}
+
+	uint32_t slot = journal_unused;
+	if (slot != 0)
+	{
+		journal_unused = journal_live[slot - 1].next_id;
+	}
+	else
+	{
+		slot = ++journal_slots;
+	}
+	journal_live[slot - 1] = (journal_live_t){
+		.id = id,
+		.path_hash = path_hash,
+		.offset = offset,
+		.next_id = journal_by_id[id % JOURNAL_BUCKETS],
+		.next_path = journal_by_path[path_hash % JOURNAL_BUCKETS],
+	};
+	journal_by_id[id % JOURNAL_BUCKETS] = slot;
+	journal_by_path[path_hash % JOURNAL_BUCKETS] = slot;
+	journal_live_count++;
+}
+
+static void journal_apply(const journal_header_t *header, const uint8_t *payload, off_t offset)
+{
+	journal_live_t *live;
+
+	if (header->id >= journal_next_id)
+	{
+		journal_next_id = header->id + 1;
+	}
+
+	switch (header->type)
+	{
+	case JOURNAL_ACCEPT:
+	{
+		const journal_accept_t *acc = (const journal_accept_t *)payload;
+		if (header->length >= sizeof(*acc) && acc->path_len > 0 &&
+			header->length == sizeof(*acc) + acc->path_len + acc->base_len)
+		{
+			journal_track(header->id, journal_hash((const char *)(acc + 1)), offset);
+		}
+		break;
+	}
+	case JOURNAL_PROGRESS:
+		if ((live = journal_find(header->id)) && header->length == sizeof(uint32_t))
+		{
+			memcpy(&live->received, payload, sizeof(uint32_t));
+		}
+		break;
+	case JOURNAL_DONE:
+		if ((live = journal_find(header->id)))
+		{
+			journal_remove(live);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* Rewrite the journal with only the live uploads, journal_lock held */
+static int journal_compact(void)
+{
+	char temp[PATH_MAX];
+	off_t end = 0;
+
+	if (atomic_file_temp(temp, sizeof(temp), journal_path) != 0)
+	{
+		return -1;
+	}
+	int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	uint32_t records = 0;
+	for (unsigned int i = 0; i < journal_slots; i++)
+	{
+		journal_live_t *live = &journal_live[i];
+		if (live->id == 0)
+		{
+			continue;
+		}
+		ssize_t len = journal_read(journal_fd, live->offset);
+		if (len < 0 || pwrite(fd, journal_buf, len, end) != len)
+		{
+			goto fail;
+		}
+		live->offset = end;
+		end += len;
+		records++;
+		if (live->received)
+		{
+			if (journal_write(fd, end, JOURNAL_PROGRESS, live->id, &live->received, sizeof(live->received)) != 0)
+			{
+				goto fail;
+			}
+			end += sizeof(journal_header_t) + sizeof(live->received);
+			records++;
+		}
+	}
+
+	if (atomic_file_commit(fd, temp, journal_path) != 0)
+	{
+		goto fail;
+	}
+	close(journal_fd);
+	journal_fd = fd;
+	journal_end = end;
+	journal_records = records;
+	return 0;
+
+fail:
+	csp_print("Failed to compact the journal\n");
+	close(fd);
+	unlink(temp);
+	return -1;
+}
+
+static void journal_compact_due(void)
+{
+	if (journal_records >= JOURNAL_COMPACT_RECORDS && journal_records >= JOURNAL_COMPACT_RATIO * journal_live_count)
+	{
+		journal_compact();
+	}
+}
+
+int journal_open(const char *path)
+{
+	journal_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (journal_fd < 0)
+	{
+		csp_print("Cannot open journal '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	journal_path = path;
+
+	ssize_t len;
+	while ((len = journal_read(journal_fd, journal_end)) > 0)
+	{
+		journal_apply((journal_header_t *)journal_buf, journal_buf + sizeof(journal_header_t), journal_end);
+		journal_end += len;
+		journal_records++;
+	}
+
+	// A record torn by a reset ends the journal, the next one goes in its place
+	if (ftruncate(journal_fd, journal_end) != 0)
+	{
+		csp_print("Cannot truncate journal '%s': %s\n", path, strerror(errno));
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	journal_compact_due();
+	for (unsigned int i = 0; i < journal_slots; i++)
+	{
+		if (journal_live[i].id != 0)
+		{
+			journal_backlog[journal_backlog_count++] = journal_live[i].id;
+		}
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	csp_print("Journal '%s': %u records, %u uploads to resume\n", path, journal_records, journal_live_count);
+	return journal_live_count;
+}
+
+void journal_rearm(void)
+{
+	uint8_t record[JOURNAL_RECORD_MAX];
+
+	// One thread places the backlog at a time, the others leave it to that one
+	if (journal_fd < 0 || pthread_mutex_trylock(&rearm_lock) != 0)
+	{
+		return;
+	}
+
+	while (!upload_pool_full() && !upload_queue_full())
+	{
+		// The first upload of the backlog still live, one ended meanwhile is skipped
+		uint32_t id = 0;
+		ssize_t len = -1;
+		pthread_mutex_lock(&journal_lock);
+		while (len < 0 && journal_backlog_count > 0)
+		{
+			id = journal_backlog[journal_backlog_head];
+			journal_live_t *live = journal_find(id);
+			if (live && (len = journal_read(journal_fd, live->offset)) > 0)
+			{
+				memcpy(record, journal_buf, len);
+			}
+			else
+			{
+				journal_backlog_head++;
+				journal_backlog_count--;
+			}
+		}
+		pthread_mutex_unlock(&journal_lock);
+		if (len < 0)
+		{
+			break;
+		}
+
+		const journal_accept_t *acc = (const journal_accept_t *)(record + sizeof(journal_header_t));
+		const char *path = (const char *)(acc + 1);
+		int64_t now = time(NULL);
+		upload_request_t req = {
+			.server = acc->server,
+			.payload_id = acc->payload_id,
+			.resume = true,
+			.file_location = path,
+			.checksum = acc->checksum,
+			.requester = acc->requester,
+			.priority = acc->priority,
+			.deadline = acc->deadline == 0 ? 0 : acc->deadline > now ? acc->deadline - now : 1,
+			.size = acc->size,
+			.compression = acc->compression,
+			.base_location = acc->base_len ? path + acc->path_len : NULL,
+			.sha256 = acc->has_sha256 ? acc->sha256 : NULL,
+			.fec_source = acc->fec_source,
+			.fec_repair = acc->fec_repair,
+			.journal_id = id,
+		};
+		int status = upload_request_schedule(&req);
+		if (status == UPLOAD_CLIENT_DTP_REQUEST_REJECTED && (upload_pool_full() || upload_queue_full()))
+		{
+			// A request took the room meanwhile, retried once a context is released
+			break;
+		}
+		if (status != UPLOAD_CLIENT_DTP_REQUEST_SCHEDULED)
+		{
+			csp_print("Could not resume payload %u, kept for the next start\n", acc->payload_id);
+		}
+
+		pthread_mutex_lock(&journal_lock);
+		journal_backlog_head++;
+		journal_backlog_count--;
+		pthread_mutex_unlock(&journal_lock);
+	}
+
+	pthread_mutex_unlock(&rearm_lock);
+}
+
+uint32_t journal_accept(const upload_request_t *req)
+{
+	uint8_t payload[sizeof(journal_accept_t) + 2 * PATH_MAX];
+	journal_accept_t *acc = (journal_accept_t *)payload;
+	size_t path_len = strlen(req->file_location) + 1;
+	size_t base_len = req->base_location ? strlen(req->base_location) + 1 : 0;
+
+	if (journal_fd < 0 || path_len > PATH_MAX || base_len > PATH_MAX)
+	{
+		return 0;
+	}
+
+	memset(acc, 0, sizeof(*acc));
+	acc->size = req->size;
+	acc->deadline = req->deadline ? time(NULL) + req->deadline : 0;
+	acc->server = req->server;
+	acc->checksum = req->checksum;
+	acc->fec_source = req->fec_source;
+	acc->fec_repair = req->fec_repair;
+	acc->payload_id = req->payload_id;
+	acc->requester = req->requester;
+	acc->priority = req->priority;
+	acc->compression = req->compression;
+	acc->has_sha256 = req->sha256 != NULL;
+	if (req->sha256)
+	{
+		memcpy(acc->sha256, req->sha256, sizeof(acc->sha256));
+	}
+	acc->path_len = path_len;
+	acc->base_len = base_len;
+	memcpy(payload + sizeof(*acc), req->file_location, path_len);
+	if (base_len)
+	{
+		memcpy(payload + sizeof(*acc) + path_len, req->base_location, base_len);
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	uint32_t id = journal_next_id++;
+	off_t offset = journal_end;
+	if (journal_append(JOURNAL_ACCEPT, id, payload, sizeof(*acc) + path_len + base_len) != 0)
+	{
+		id = 0;
+	}
+	else
+	{
+		journal_dirty = true;
+		journal_track(id, journal_hash(req->file_location), offset);
+		journal_compact_due();
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return id;
+}
+
+void journal_sync(void)
+{
+	pthread_mutex_lock(&journal_lock);
+	if (journal_dirty && fdatasync(journal_fd) != 0)
+	{
+		csp_print("Failed to sync the journal: %s\n", strerror(errno));
+	}
+	journal_dirty = false;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_progress(uint32_t id, uint32_t received)
+{
+	if (id == 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	journal_live_t *live = journal_find(id);
+	if (live && live->received != received)
+	{
+		live->received = received;
+		journal_append(JOURNAL_PROGRESS, id, &received, sizeof(received));
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_done(uint32_t id, uint8_t status)
+{
+	if (id == 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	journal_live_t *live = journal_find(id);
+	if (live)
+	{
+		journal_remove(live);
+		// Lost, the upload would be resumed once more, which is harmless
+		journal_append(JOURNAL_DONE, id, &status, sizeof(status));
+		fdatasync(journal_fd);
+		journal_dirty = false;
+		journal_compact_due();
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
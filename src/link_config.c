@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+#include <param/param.h>
+
+#ifdef UPLOAD_HAVE_SOCKETCAN
+#include <libsocketcan.h>
+#endif
+
+#include "link_config.h"
+
+/* Rates the probe steps through, slowest first */
+static const uint32_t link_kiss_rates[] = {115200, 230400, 460800, 921600};
+static const uint32_t link_can_rates[] = {125000, 250000, 500000, 1000000};
+
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static rate_link_t link_primary = RATE_LINK_ZMQ;
+static const char *kiss_devices[LINK_MAX_DEVICES];
+static const char *can_devices[LINK_MAX_DEVICES];
+static unsigned int kiss_count = 0, can_count = 0;
+
+/* Rates in effect, the parameters hold the requested ones while they are applied */
+static uint32_t kiss_baud_current = LINK_KISS_DEFAULT_BAUD;
+static uint32_t can_bitrate_current = LINK_CAN_DEFAULT_BITRATE;
+static uint32_t kiss_baud_value = LINK_KISS_DEFAULT_BAUD;
+static uint32_t can_bitrate_value = LINK_CAN_DEFAULT_BITRATE;
+
+static void link_param_changed(param_t *param, int offset);
+
+PARAM_DEFINE_STATIC_RAM(LINK_PARAM_ID_KISS_BAUD, kiss_baud, PARAM_TYPE_UINT32, -1, 0, PM_CONF, link_param_changed, "bps", &kiss_baud_value, "Baud rate of the KISS UARTs");
+PARAM_DEFINE_STATIC_RAM(LINK_PARAM_ID_CAN_BITRATE, can_bitrate, PARAM_TYPE_UINT32, -1, 0, PM_CONF, link_param_changed, "bps", &can_bitrate_value, "Bitrate of the CAN interfaces");
+
+static speed_t link_termios_speed(uint32_t baud)
+{
+	switch (baud)
+	{
+	case 9600:
+		return B9600;
+	case 19200:
+		return B19200;
+	case 38400:
+		return B38400;
+	case 57600:
+		return B57600;
+	case 115200:
+		return B115200;
+	case 230400:
+		return B230400;
+	case 460800:
+		return B460800;
+	case 500000:
+		return B500000;
+	case 576000:
+		return B576000;
+	case 921600:
+		return B921600;
+	case 1000000:
+		return B1000000;
+	default:
+		return B0;
+	}
+}
+
+/* The line settings belong to the tty, so they also apply to the fd the KISS driver has open */
+static int link_uart_set_speed(const char *device, speed_t speed)
+{
+	struct termios tio;
+	int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		csp_print("Cannot open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	int ret = -1;
+	if (tcgetattr(fd, &tio) == 0 && cfsetispeed(&tio, speed) == 0 && cfsetospeed(&tio, speed) == 0 &&
+		tcsetattr(fd, TCSADRAIN, &tio) == 0)
+	{
+		ret = 0;
+	}
+	else
+	{
+		csp_print("Cannot set the speed of %s: %s\n", device, strerror(errno));
+	}
+	close(fd);
+	return ret;
+}
+
+static int link_can_set(const char *device, uint32_t bitrate)
+{
+#ifdef UPLOAD_HAVE_SOCKETCAN
+	// The bitrate can only be changed while the interface is down
+	if (can_do_stop(device) < 0 || can_set_bitrate(device, bitrate) < 0)
+	{
+		csp_print("Cannot set the bitrate of %s\n", device);
+		can_do_start(device);
+		return -1;
+	}
+	return can_do_start(device) < 0 ? -1 : 0;
+#else
+	(void)bitrate;
+	csp_print("Cannot set the bitrate of %s without libsocketcan\n", device);
+	return -1;
+#endif
+}
+
+int link_config_init(uint32_t kiss_baud, uint32_t can_bitrate)
+{
+	kiss_baud = kiss_baud ? kiss_baud : LINK_KISS_DEFAULT_BAUD;
+	can_bitrate = can_bitrate ? can_bitrate : LINK_CAN_DEFAULT_BITRATE;
+	if (link_termios_speed(kiss_baud) == B0)
+	{
+		return -1;
+	}
+
+	kiss_baud_current = kiss_baud_value = kiss_baud;
+	can_bitrate_current = can_bitrate_value = can_bitrate;
+	return 0;
+}
+
+uint32_t link_kiss_baud(void)
+{
+	return kiss_baud_current;
+}
+
+uint32_t link_can_bitrate(void)
+{
+	return can_bitrate_current;
+}
+
+static int link_add(const char **devices, unsigned int *count, const char *device)
+{
+	pthread_mutex_lock(&link_lock);
+	int ret = -1;
+	if (*count < LINK_MAX_DEVICES)
+	{
+		devices[(*count)++] = device;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&link_lock);
+	return ret;
+}
+
+int link_kiss_add(const char *device)
+{
+	return link_add(kiss_devices, &kiss_count, device);
+}
+
+int link_can_add(const char *device)
+{
+	return link_add(can_devices, &can_count, device);
+}
+
+static void link_profile_update(void)
+{
+	switch (link_primary)
+	{
+	case RATE_LINK_KISS:
+		rate_control_init(RATE_LINK_KISS, kiss_baud_current);
+		break;
+	case RATE_LINK_CAN:
+		rate_control_init(RATE_LINK_CAN, can_bitrate_current);
+		break;
+	default:
+		rate_control_init(link_primary, 0);
+		break;
+	}
+}
+
+void link_config_primary(rate_link_t link)
+{
+	pthread_mutex_lock(&link_lock);
+	link_primary = link;
+	link_profile_update();
+	pthread_mutex_unlock(&link_lock);
+}
+
+int link_set_kiss_baud(uint32_t baud)
+{
+	speed_t speed = link_termios_speed(baud);
+	int ret = 0;
+
+	if (speed == B0)
+	{
+		csp_print("Unsupported baud rate %u\n", baud);
+		return -1;
+	}
+
+	pthread_mutex_lock(&link_lock);
+	for (unsigned int i = 0; i < kiss_count && ret == 0; i++)
+	{
+		ret = link_uart_set_speed(kiss_devices[i], speed);
+	}
+	if (ret == 0)
+	{
+		kiss_baud_current = kiss_baud_value = baud;
+		if (link_primary == RATE_LINK_KISS)
+		{
+			link_profile_update();
+		}
+	}
+	else
+	{
+		// Put the devices changed already back to the old rate
+		for (unsigned int i = 0; i < kiss_count; i++)
+		{
+			link_uart_set_speed(kiss_devices[i], link_termios_speed(kiss_baud_current));
+		}
+	}
+	pthread_mutex_unlock(&link_lock);
+	return ret;
+}
+
+int link_set_can_bitrate(uint32_t bitrate)
+{
+	int ret = 0;
+
+	if (bitrate == 0)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&link_lock);
+	for (unsigned int i = 0; i < can_count && ret == 0; i++)
+	{
+		ret = link_can_set(can_devices[i], bitrate);
+	}
+	if (ret == 0)
+	{
+		can_bitrate_current = can_bitrate_value = bitrate;
+		if (link_primary == RATE_LINK_CAN)
+		{
+			link_profile_update();
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < can_count; i++)
+		{
+			link_can_set(can_devices[i], can_bitrate_current);
+		}
+	}
+	pthread_mutex_unlock(&link_lock);
+	return ret;
+}
+
+/* Runs on the router thread when a parameter is set remotely */
+static void link_param_changed(param_t *param, int offset)
+{
+	(void)offset;
+
+	if (param == &kiss_baud && kiss_baud_value != kiss_baud_current)
+	{
+		if (link_set_kiss_baud(kiss_baud_value) != 0)
+		{
+			kiss_baud_value = kiss_baud_current;
+		}
+	}
+	else if (param == &can_bitrate && can_bitrate_value != can_bitrate_current)
+	{
+		if (link_set_can_bitrate(can_bitrate_value) != 0)
+		{
+			can_bitrate_value = can_bitrate_current;
+		}
+	}
+}
+
+/* CSP pings echo their payload, CRC32 protects it on the way */
+static bool link_probe_check(uint16_t server)
+{
+	for (int i = 0; i < LINK_PROBE_PINGS; i++)
+	{
+		if (csp_ping(server, LINK_PROBE_TIMEOUT_MS, LINK_PROBE_SIZE, CSP_O_CRC32) < 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int link_probe(uint16_t server)
+{
+	const uint32_t *rates;
+	size_t count;
+	int (*set)(uint32_t);
+	uint32_t good;
+
+	switch (link_primary)
+	{
+	case RATE_LINK_KISS:
+		rates = link_kiss_rates;
+		count = sizeof(link_kiss_rates) / sizeof(link_kiss_rates[0]);
+		set = link_set_kiss_baud;
+		good = kiss_baud_current;
+		break;
+	case RATE_LINK_CAN:
+		rates = link_can_rates;
+		count = sizeof(link_can_rates) / sizeof(link_can_rates[0]);
+		set = link_set_can_bitrate;
+		good = can_bitrate_current;
+		break;
+	default:
+		// Nothing to tune on other links
+		return 0;
+	}
+
+	if (!link_probe_check(server))
+	{
+		csp_print("Link probe: server %u does not answer at %u bps\n", server, good);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (rates[i] <= good)
+		{
+			continue;
+		}
+		if (set(rates[i]) != 0)
+		{
+			break;
+		}
+		usleep(LINK_PROBE_SETTLE_MS * 1000);
+		if (!link_probe_check(server))
+		{
+			csp_print("Link probe: %u bps failed\n", rates[i]);
+			set(good);
+			usleep(LINK_PROBE_SETTLE_MS * 1000);
+			break;
+		}
+		good = rates[i];
+	}
+
+	csp_print("Link probe: using %u bps\n", good);
+	return 0;
+}
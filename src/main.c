@@ -2,7 +2,10 @@
  * Copied and edited from: https://github.com/spaceinventor/libcsp/blob/60e4804ea8451e6202ce2c5c5abc0342ad3b55a4/examples/csp_client.c
  */
 
+#define _GNU_SOURCE
 #include <csp/csp_debug.h>
+#include <errno.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -20,85 +23,129 @@
 #include <csp/drivers/can_socketcan.h>
 #include <csp/interfaces/csp_if_zmqhub.h>
 
+#include <param/param_server.h>
+
 #include "vmem_dtp_server.h"
+#include "upload_pool.h"
+#include "upload_request.h"
+#include "rate_control.h"
+#include "file_sink.h"
+#include "stripe.h"
+#include "link_config.h"
+#include "trace.h"
+#include "content_index.h"
+#include "journal.h"
+#include "selftest.h"
+#include "telemetry.h"
 
 #include "dtp/dtp.h"
 #include "dtp/dtp_log.h"
 #include "dtp/dtp_session.h"
 
 #define PORT 13
+/* Wait for the next request on an accepted connection, the connection is closed once none comes */
+#define REQUEST_TIMEOUT_MS 50
 
+/* Hooks libdtp uses for sessions started by dtp_client_main */
 dtp_opt_session_hooks_cfg default_session_hooks;
 extern dtp_opt_session_hooks_cfg apm_session_hooks;
 
 /* This function must be provided in arch specific way */
 int router_start(void);
 
-// file to be sent
+// files the self-test uploads
 const char *file_src = NULL;
 
+/* Router thread placement, -1 leaves it to the scheduler */
+static int router_cpu = -1;
+static int router_priority = -1;
+
+/* Pause after a routing error, so a broken interface cannot make the router spin */
+#define ROUTER_ERROR_BACKOFF_US 10000
+
 void *router_task(void *param)
 {
+	(void)param;
+	trace_thread_name("router");
+
 	while (1)
 	{
-		csp_route_work();
+		// csp_route_work sleeps on the incoming queue until a packet arrives
+		// or its dequeue timeout expires, anything else is an error
+		int error = csp_route_work();
+		if (error != CSP_ERR_NONE && error != CSP_ERR_TIMEDOUT)
+		{
+			usleep(ROUTER_ERROR_BACKOFF_US);
+		}
 	}
 	return NULL;
 }
 
-// IMPLEMENTATION of router_start
-int router_start(void)
+/* Apply the -U and -P options to the router thread attributes */
+static int router_attr_init(pthread_attr_t *attr)
 {
-	pthread_t router_thread;
-	if (pthread_create(&router_thread, NULL, router_task, NULL) != 0)
+	pthread_attr_init(attr);
+
+	if (router_cpu >= 0)
 	{
-		csp_print("Failed to start router thread\n");
-		return -1;
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(router_cpu, &cpus);
+		if (pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus) != 0)
+		{
+			return -1;
+		}
 	}
-	csp_print("Router thread started\n");
+
+	if (router_priority >= 0)
+	{
+		struct sched_param param = {.sched_priority = router_priority};
+		if (pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) != 0 ||
+			pthread_attr_setschedpolicy(attr, SCHED_FIFO) != 0 ||
+			pthread_attr_setschedparam(attr, &param) != 0)
+		{
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
-// Struct to pass arguments to the DTP client thread
-typedef struct
-{
-	uint32_t server_addr;
-	FILE *output_file;
-
-	int color;
-	int resume;
-	uint32_t server;
-	unsigned int throughput;
-	unsigned int timeout;
-	unsigned int payload_id;
-	unsigned int mtu;
-} dtp_thread_args_t;
-
-static void *dtp_client_worker(void *param)
+// IMPLEMENTATION of router_start
+int router_start(void)
 {
-	dtp_thread_args_t *opts = (dtp_thread_args_t *)param;
-	dtp_t *session;
+	pthread_t router_thread;
+	pthread_attr_t attr;
 
-	csp_print("Starting DTP client for payload %u from server %u\n", opts->payload_id, opts->server_addr);
+	if (router_attr_init(&attr) != 0)
+	{
+		csp_print("Invalid router CPU %d or priority %d\n", router_cpu, router_priority);
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
 
-	// Run the DTP client. This will block until the transfer is complete or fails.
-	dtp_result result = dtp_client_main(opts->server, opts->throughput, opts->timeout, opts->payload_id, opts->mtu, opts->resume, &session);
+	int error = pthread_create(&router_thread, &attr, router_task, NULL);
+	pthread_attr_destroy(&attr);
 
-	if (result == DTP_ERR)
+	if (error == EPERM)
 	{
-		csp_print("DTP client failed: %s\n", dtp_strerror(dtp_errno(NULL)));
-		// The on_end hook should be called by libdtp on failure to clean up resources.
+		// SCHED_FIFO needs CAP_SYS_NICE, run with the default policy instead
+		csp_print("No permission for router priority %d, using default scheduling\n", router_priority);
+		router_priority = -1;
+		if (router_attr_init(&attr) == 0)
+		{
+			error = pthread_create(&router_thread, &attr, router_task, NULL);
+		}
+		pthread_attr_destroy(&attr);
 	}
-	else
+
+	if (error != 0)
 	{
-		csp_print("DTP client completed successfully.\n");
-		dtp_release_session(session);
+		csp_print("Failed to start router thread\n");
+		return -1;
 	}
-
-	// Free the thread arguments
-	free(opts);
-
-	pthread_exit(NULL);
+	csp_print("Router thread started\n");
+	return 0;
 }
 
 /* Server port, the port the server listens on for incoming connections from the client. */
@@ -108,9 +155,29 @@ static void *dtp_client_worker(void *param)
 static uint8_t server_address = 0;
 static uint8_t client_address = 0;
 
-/* Test mode, check that server & client can exchange packets */
+/* Self-test over an emulated link instead of serving requests, see selftest.h */
 static bool test_mode = false;
-static unsigned int run_duration_in_sec = 3;
+static unsigned int run_duration_in_sec = 0; // 0 to derive it from the files and the link
+static selftest_link_t test_link = {0};
+
+/* Session limits */
+static unsigned int max_sessions = UPLOAD_POOL_DEFAULT_SESSIONS;
+static unsigned int listen_backlog = 8;
+static unsigned int upload_contexts = 0; // 0 for one per session and queue entry
+
+/* Link rates, 0 for the defaults in link_config.h */
+static uint32_t kiss_baud_opt = 0;
+static uint32_t can_bitrate_opt = 0;
+static bool probe_link = false;
+
+/* Chrome trace of the hot path, written on SIGUSR1 and at exit */
+static const char *trace_file = NULL;
+
+/* Directory of the content index, NULL to upload every file */
+static const char *index_dir = NULL;
+
+/* Journal of accepted uploads, resumed at startup, NULL for none */
+static const char *journal_file = NULL;
 
 enum DeviceType
 {
@@ -120,6 +187,26 @@ enum DeviceType
 	DEVICE_ZMQ,
 };
 
+/* Interfaces given on the command line, the first one is the default route */
+#define MAX_INTERFACES 4
+static struct
+{
+	enum DeviceType type;
+	const char *name;
+	csp_iface_t *iface;
+} interfaces[MAX_INTERFACES];
+static unsigned int interface_count = 0;
+
+/* Additional server addresses given with -S */
+#define MAX_STRIPE_ROUTES (STRIPE_MAX_SERVERS * STRIPE_MAX_ROUTES)
+static struct
+{
+	unsigned int server;
+	unsigned int alias;
+	int iface; // index into interfaces, -1 to leave routing to the table
+} stripe_routes_opt[MAX_STRIPE_ROUTES];
+static unsigned int stripe_route_count = 0;
+
 #define __maybe_unused __attribute__((__unused__))
 
 static struct option long_options[] = {
@@ -145,6 +232,19 @@ static struct option long_options[] = {
 #endif
 	{"interface-address", required_argument, 0, 'a'},
 	{"connect-to", required_argument, 0, 'C'},
+	{"max-sessions", required_argument, 0, 'n'},
+	{"backlog", required_argument, 0, 'b'},
+	{"contexts", required_argument, 0, 'q'},
+	{"router-cpu", required_argument, 0, 'U'},
+	{"router-priority", required_argument, 0, 'P'},
+	{"stripe", required_argument, 0, 'S'},
+	{"kiss-baud", required_argument, 0, 'B'},
+	{"can-bitrate", required_argument, 0, 'r'},
+	{"probe-link", no_argument, 0, 'L'},
+	{"trace", required_argument, 0, 'X'},
+	{"content-index", required_argument, 0, 'D'},
+	{"journal", required_argument, 0, 'J'},
+	{"test-link", required_argument, 0, 'E'},
 	{"test-mode", no_argument, 0, 't'},
 	{"test-mode-with-sec", required_argument, 0, 'T'},
 	{"help", no_argument, 0, 'h'},
@@ -155,15 +255,15 @@ void print_help()
 	csp_print("Usage: csp_client [options]\n");
 	if (CSP_HAVE_LIBSOCKETCAN)
 	{
-		csp_print(" -c <can-device>  set CAN device\n");
+		csp_print(" -c <can-device>  add CAN device\n");
 	}
 	if (1)
 	{
-		csp_print(" -k <kiss-device> set KISS device\n");
+		csp_print(" -k <kiss-device> add KISS device\n");
 	}
 	if (CSP_HAVE_LIBZMQ)
 	{
-		csp_print(" -z <zmq-device>  set ZeroMQ device\n");
+		csp_print(" -z <zmq-device>  add ZeroMQ device\n");
 	}
 	if (CSP_USE_RTABLE)
 	{
@@ -173,44 +273,120 @@ void print_help()
 	{
 		csp_print(" -a <address>     set interface address\n"
 				  " -C <address>     connect to server at address\n"
-				  " -f <file src>	 source of file to be sent\n"
-				  " -t               enable test mode\n"
-				  " -T <duration>    enable test mode with running time in seconds\n"
-				  " -h               print help\n");
+				  " -f <dir>         files the self-test uploads (default example_upload)\n"
+				  " -n <sessions>    maximum number of concurrent uploads\n"
+				  " -b <backlog>     number of pending connections on the request port\n"
+				  " -q <contexts>    uploads that may be queued or running at once, their\n"
+				  "                  memory is reserved at startup (default sessions + %u)\n"
+				  " -U <cpu>         pin the router thread to a CPU\n"
+				  " -P <priority>    run the router thread with SCHED_FIFO priority\n"
+				  " -S <server>:<alias>[@<n>]\n"
+				  "                  stripe uploads from server over its address alias as well,\n"
+				  "                  routed over the n-th interface given (from 0)\n"
+				  " -B <baud>        KISS baud rate (default %u)\n"
+				  " -r <bitrate>     CAN bitrate (default %u)\n"
+				  " -L               probe the first link for the fastest rate the server\n"
+				  "                  given with -C answers at\n"
+				  " -X <file>        trace the request and upload path, write the trace as\n"
+				  "                  Chrome trace JSON to file on SIGUSR1 and at exit\n"
+				  " -D <dir>         keep received files in a content index in dir, requests\n"
+				  "                  for a SHA-256 found there are served from it\n"
+				  " -J <file>        journal accepted uploads in file, unfinished ones are\n"
+				  "                  resumed at the next start\n"
+				  " -t               self-test: upload the files given with -f over an\n"
+				  "                  emulated link, report time and rounds per file\n"
+				  " -T <duration>    self-test, giving up after duration seconds (default:\n"
+				  "                  %d times the files at the session rate or -E rate, plus a\n"
+				  "                  round trip per round and %d s)\n"
+				  " -E <link>        self-test link, e.g. latency=250,loss=20,reorder=5,rate=9600\n"
+				  "                  (ms, per thousand packets, B/s)\n"
+				  " -h               print help\n",
+				  UPLOAD_POOL_QUEUE_LENGTH, LINK_KISS_DEFAULT_BAUD, LINK_CAN_DEFAULT_BITRATE, SELFTEST_DURATION_FACTOR,
+				  SELFTEST_MIN_DURATION);
 	}
 }
 
+/* Queue an interface option, several interfaces may be used at once */
+static void push_interface(enum DeviceType device_type, const char *device_name)
+{
+	if (interface_count == MAX_INTERFACES)
+	{
+		csp_print("At most %d interfaces can be set.\n", MAX_INTERFACES);
+		exit(EXIT_FAILURE);
+	}
+	interfaces[interface_count].type = device_type;
+	interfaces[interface_count].name = device_name;
+	interface_count++;
+}
+
+/* Parse -S <server>:<alias>[@<interface>] */
+static void push_stripe_route(const char *arg)
+{
+	unsigned int server, alias;
+	int iface = -1;
+	int route_end = -1, iface_end = -1;
+
+	// The interface is optional, but whatever follows the alias must be one
+	int fields = sscanf(arg, "%u:%u%n@%d%n", &server, &alias, &route_end, &iface, &iface_end);
+	bool valid = (fields == 2 && arg[route_end] == '\0') || (fields == 3 && arg[iface_end] == '\0');
+	if (!valid)
+	{
+		csp_print("Invalid stripe route '%s'\n", arg);
+		print_help();
+		exit(EXIT_FAILURE);
+	}
+	if (stripe_route_count == MAX_STRIPE_ROUTES)
+	{
+		csp_print("At most %d stripe routes can be set.\n", MAX_STRIPE_ROUTES);
+		exit(EXIT_FAILURE);
+	}
+	stripe_routes_opt[stripe_route_count].server = server;
+	stripe_routes_opt[stripe_route_count].alias = alias;
+	stripe_routes_opt[stripe_route_count].iface = iface;
+	stripe_route_count++;
+}
+
 csp_iface_t *add_interface(enum DeviceType device_type, const char *device_name)
 {
+	// Interface names are kept by CSP, each needs its own
+	static char kiss_names[MAX_INTERFACES][CSP_IFLIST_NAME_MAX + 1];
+	static char can_names[MAX_INTERFACES][CSP_IFLIST_NAME_MAX + 1];
+	static unsigned int kiss_count = 0, can_count = 0;
 	csp_iface_t *default_iface = NULL;
 
 	if (device_type == DEVICE_KISS)
 	{
 		csp_usart_conf_t conf = {
 			.device = device_name,
-			.baudrate = 115200, /* supported on all platforms */
+			.baudrate = link_kiss_baud(),
 			.databits = 8,
 			.stopbits = 1,
 			.paritysetting = 0,
 		};
-		int error = csp_usart_open_and_add_kiss_interface(&conf, CSP_IF_KISS_DEFAULT_NAME, &default_iface);
+		char *name = kiss_names[kiss_count];
+		snprintf(name, sizeof(kiss_names[0]), kiss_count ? "%s%u" : "%s", CSP_IF_KISS_DEFAULT_NAME, kiss_count);
+		kiss_count++;
+		int error = csp_usart_open_and_add_kiss_interface(&conf, name, &default_iface);
 		if (error != CSP_ERR_NONE)
 		{
 			csp_print("failed to add KISS interface [%s], error: %d\n", device_name, error);
 			exit(1);
 		}
-		default_iface->is_default = 1;
+		link_kiss_add(device_name);
 	}
 
 	if (CSP_HAVE_LIBSOCKETCAN && (device_type == DEVICE_CAN))
 	{
-		int error = csp_can_socketcan_open_and_add_interface(device_name, CSP_IF_CAN_DEFAULT_NAME, client_address, 1000000, true, &default_iface);
+		char *name = can_names[can_count];
+		snprintf(name, sizeof(can_names[0]), can_count ? "%s%u" : "%s", CSP_IF_CAN_DEFAULT_NAME, can_count);
+		can_count++;
+		int error = csp_can_socketcan_open_and_add_interface(device_name, name, client_address, link_can_bitrate(), true, &default_iface);
 		if (error != CSP_ERR_NONE)
 		{
 			csp_print("failed to add CAN interface [%s], error: %d\n", device_name, error);
 			exit(1);
 		}
-		default_iface->is_default = 1;
+		link_can_add(device_name);
 	}
 
 	if (CSP_HAVE_LIBZMQ && (device_type == DEVICE_ZMQ))
@@ -221,7 +397,6 @@ csp_iface_t *add_interface(enum DeviceType device_type, const char *device_name)
 			csp_print("failed to add ZMQ interface [%s], error: %d\n", device_name, error);
 			exit(1);
 		}
-		default_iface->is_default = 1;
 	}
 
 	return default_iface;
@@ -231,28 +406,23 @@ csp_iface_t *add_interface(enum DeviceType device_type, const char *device_name)
 int main(int argc, char *argv[])
 {
 
-	const char *device_name = NULL;
-	enum DeviceType device_type = DEVICE_UNKNOWN;
 	const char *rtable __maybe_unused = NULL;
 	csp_iface_t *default_iface;
 	int ret = EXIT_SUCCESS;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, OPTION_c OPTION_z OPTION_R "k:a:C:f:tT:h", long_options, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, OPTION_c OPTION_z OPTION_R "k:a:C:f:n:b:q:U:P:S:B:r:LX:D:J:E:tT:h", long_options, NULL)) != -1)
 	{
 		switch (opt)
 		{
 		case 'c':
-			device_name = optarg;
-			device_type = DEVICE_CAN;
+			push_interface(DEVICE_CAN, optarg);
 			break;
 		case 'k':
-			device_name = optarg;
-			device_type = DEVICE_KISS;
+			push_interface(DEVICE_KISS, optarg);
 			break;
 		case 'z':
-			device_name = optarg;
-			device_type = DEVICE_ZMQ;
+			push_interface(DEVICE_ZMQ, optarg);
 			break;
 		case 'f':
 			file_src = optarg;
@@ -268,6 +438,49 @@ int main(int argc, char *argv[])
 		case 'C':
 			server_address = atoi(optarg);
 			break;
+		case 'n':
+			max_sessions = atoi(optarg);
+			break;
+		case 'b':
+			listen_backlog = atoi(optarg);
+			break;
+		case 'q':
+			upload_contexts = atoi(optarg);
+			break;
+		case 'U':
+			router_cpu = atoi(optarg);
+			break;
+		case 'P':
+			router_priority = atoi(optarg);
+			break;
+		case 'S':
+			push_stripe_route(optarg);
+			break;
+		case 'B':
+			kiss_baud_opt = atoi(optarg);
+			break;
+		case 'r':
+			can_bitrate_opt = atoi(optarg);
+			break;
+		case 'L':
+			probe_link = true;
+			break;
+		case 'X':
+			trace_file = optarg;
+			break;
+		case 'D':
+			index_dir = optarg;
+			break;
+		case 'J':
+			journal_file = optarg;
+			break;
+		case 'E':
+			if (selftest_parse_link(&test_link, optarg) != 0)
+			{
+				csp_print("Invalid test link '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 't':
 			test_mode = true;
 			break;
@@ -285,24 +498,100 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	// Unless one of the interfaces are set, print a message and exit
-	if (device_type == DEVICE_UNKNOWN)
+	// Unless one of the interfaces are set, print a message and exit, the self-test needs none
+	if (interface_count == 0 && !test_mode)
 	{
-		csp_print("One and only one of the interfaces can be set.\n");
+		csp_print("At least one interface must be set.\n");
 		print_help();
 		exit(EXIT_FAILURE);
 	}
 
+	if (max_sessions < 1 || max_sessions > UPLOAD_POOL_MAX_SESSIONS)
+	{
+		csp_print("Number of sessions must be between 1 and %u.\n", UPLOAD_POOL_MAX_SESSIONS);
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen_backlog < 1)
+	{
+		listen_backlog = 1;
+	}
+
+	if (upload_contexts == 0)
+	{
+		upload_contexts = max_sessions + UPLOAD_POOL_QUEUE_LENGTH;
+	}
+	if (upload_contexts > UPLOAD_POOL_MAX_CONTEXTS)
+	{
+		csp_print("Number of upload contexts must be at most %u.\n", UPLOAD_POOL_MAX_CONTEXTS);
+		exit(EXIT_FAILURE);
+	}
+
+	if (link_config_init(kiss_baud_opt, can_bitrate_opt) != 0)
+	{
+		csp_print("Unsupported KISS baud rate %u.\n", kiss_baud_opt);
+		exit(EXIT_FAILURE);
+	}
+
+	if (probe_link && server_address == 0)
+	{
+		csp_print("The link probe needs the server address, set it with -C.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (index_dir && content_index_init(index_dir) != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	if (journal_file && journal_open(journal_file) < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	// Before any thread is started, they must not take the signals meant for the trace
+	if (trace_file && trace_start(trace_file) != 0)
+	{
+		csp_print("Cannot start tracing to '%s'\n", trace_file);
+		exit(EXIT_FAILURE);
+	}
+
 	csp_print("Initialising CSP\n");
 
 	/* Init CSP */
 	csp_init();
 
 	/* Start router */
-	router_start();
+	if (router_start() != 0 || telemetry_start() != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
 
-	/* Add interface(s) */
-	default_iface = add_interface(device_type, device_name);
+	/* Add interface(s), the first one carries the default route */
+	for (unsigned int i = 0; i < interface_count; i++)
+	{
+		interfaces[i].iface = add_interface(interfaces[i].type, interfaces[i].name);
+	}
+	default_iface = interfaces[0].iface;
+	if (default_iface)
+	{
+		default_iface->is_default = 1;
+	}
+
+	/* Pick DTP session parameters that suit the first link, they follow its rate */
+	enum DeviceType device_type = interfaces[0].type;
+	if (device_type == DEVICE_KISS)
+	{
+		link_config_primary(RATE_LINK_KISS);
+	}
+	else if (device_type == DEVICE_CAN)
+	{
+		link_config_primary(RATE_LINK_CAN);
+	}
+	else
+	{
+		link_config_primary(RATE_LINK_ZMQ);
+	}
 
 	/* Setup routing table */
 	if (CSP_USE_RTABLE)
@@ -322,6 +611,29 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* Register the extra routes to servers for striping */
+	for (unsigned int i = 0; i < stripe_route_count; i++)
+	{
+		int n = stripe_routes_opt[i].iface;
+		if (n >= (int)interface_count || stripe_add_route(stripe_routes_opt[i].server, stripe_routes_opt[i].alias) != 0)
+		{
+			csp_print("Cannot stripe over %u:%u\n", stripe_routes_opt[i].server, stripe_routes_opt[i].alias);
+			exit(EXIT_FAILURE);
+		}
+		if (CSP_USE_RTABLE && n >= 0 && interfaces[n].iface)
+		{
+			csp_rtable_set(stripe_routes_opt[i].alias, csp_id_get_host_bits(), interfaces[n].iface, CSP_NO_VIA_ADDRESS);
+		}
+	}
+
+	/* Link rates can be changed at runtime through the kiss_baud and can_bitrate parameters */
+	csp_bind_callback(param_serve, PARAM_PORT_SERVER);
+
+	if (probe_link && link_probe(server_address) != 0)
+	{
+		csp_print("Link probe failed, keeping the configured rate\n");
+	}
+
 	csp_print("Connection table\r\n");
 	csp_conn_print_table();
 
@@ -335,12 +647,32 @@ int main(int argc, char *argv[])
 	}
 
 	/* Start client work */
+	default_session_hooks = file_sink_session_hooks;
+
+	if (test_mode && selftest_init(file_src ? file_src : "example_upload", &test_link) < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	if (upload_pool_reserve(upload_contexts) != 0 || upload_pool_start(max_sessions) != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	// Uploads cut short by the last reset go first, before new requests are taken
+	journal_rearm();
+
 	csp_print("Client started\n");
 
+	if (test_mode)
+	{
+		exit(selftest_run(run_duration_in_sec) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
 	static csp_socket_t sock = {0};
 	sock.opts = CSP_O_RDP;
 	csp_bind(&sock, PORT);
-	csp_listen(&sock, 1); // This allows only one simultaneous connection
+	csp_listen(&sock, listen_backlog);
 
 	csp_conn_t *conn;
 
@@ -351,80 +683,26 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		csp_packet_t *request = csp_read(conn, 50);
-		printf("\t%s - [DEBUG] Reading packet from connection... %s\n", "\x1B[33m", "\x1B[0m");
+		trace_instant(TRACE_ACCEPT, csp_conn_src(conn), 0);
 
-		if (request->length < 5)
+		// Requests sent back to back on one connection are handled in turn, each is answered as soon as it is scheduled
+		csp_packet_t *request = csp_read(conn, REQUEST_TIMEOUT_MS);
+		if (request == NULL)
 		{
-			csp_print("Invalid DTP upload request: too short\n");
+			csp_print("No DTP upload request received\n");
 		}
-		else
+		while (request)
 		{
-			printf("\t%s - [DEBUG] Valid DTP request. %s\n", "\x1B[33m", "\x1B[0m");
-			uint8_t dtp_server_addr = request->data[1];
-			uint16_t payload_id;
-			memcpy(&payload_id, &request->data[2], sizeof(uint16_t));
-			char *file_location = (char *)&request->data[4];
-
-			csp_print("DTP upload request: server %u, payload %u, file '%s'\n", dtp_server_addr, payload_id, file_location);
-
-			FILE *output_file = fopen(file_location, "wb");
-
-			if (output_file == NULL)
-			{
-				csp_print("Error: Could not create file '%s'\n", file_location);
-				csp_packet_t *response = csp_buffer_get(1);
-				if (response)
-				{
-					response->length = 1;
-					response->data[0] = 0; // 0 for failure
-					csp_send(conn, response);
-					csp_buffer_free(response);
-				}
-			}
-			else
-			{
-				csp_print("File '%s' created. Starting transfer.\n", file_location);
-				csp_packet_t *response = csp_buffer_get(1);
-				if (response)
-				{
-					response->length = 1;
-					response->data[0] = 1; // 1 for success
-					csp_send(conn, response);
-					csp_buffer_free(response);
-				}
-
-				dtp_thread_args_t *thread_args = malloc(sizeof(dtp_thread_args_t));
-				if (thread_args == NULL)
-				{
-					csp_print("Failed to allocate memory for thread args\n");
-					fclose(output_file);
-				}
-				else
-				{
-					thread_args->server_addr = dtp_server_addr;
-					thread_args->payload_id = payload_id;
-					thread_args->output_file = output_file;
-
-					pthread_t dtp_thread;
-					if (pthread_create(&dtp_thread, NULL, dtp_client_worker, thread_args) != 0)
-					{
-						csp_print("Failed to start DTP client thread\n");
-						fclose(output_file);
-						free(thread_args);
-					}
-					else
-					{
-						pthread_detach(dtp_thread); // Run thread in the background
-					}
-				}
-			}
+			// An empty packet has no type, upload_request_handle rejects it
+			uint8_t type = request->length ? request->data[0] : 0;
+			trace_begin(TRACE_PARSE, type, request->length);
+			upload_request_handle(conn, request);
+			trace_end(TRACE_PARSE, type, request->length);
+			csp_buffer_free(request);
+			request = csp_read(conn, REQUEST_TIMEOUT_MS);
 		}
-
-		usleep(100000);
-
-		/* Wait for execution to end (ctrl+c) */
-
-		return ret;
+		csp_close(conn);
 	}
-}
\ No newline at end of file
+
+	return ret;
+}
@@ -97,7 +97,7 @@ void   upload_metadata__free_unpacked
   assert(message->base.descriptor == &upload_metadata__descriptor);
   protobuf_c_message_free_unpacked ((ProtobufCMessage*)message, allocator);
 }
-static const ProtobufCFieldDescriptor upload_metadata_item__field_descriptors[4] =
+static const ProtobufCFieldDescriptor upload_metadata_item__field_descriptors[12] =
 {
   {
     "file_location",
@@ -147,17 +147,121 @@ static const ProtobufCFieldDescriptor upload_metadata_item__field_descriptors[4]
     0,             /* flags */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "priority",
+    5,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_UINT32,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, priority),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "deadline",
+    6,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_UINT32,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, deadline),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "size",
+    7,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_UINT64,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, size),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "compression",
+    8,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_UINT32,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, compression),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "base_location",
+    9,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_STRING,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, base_location),
+    NULL,
+    &protobuf_c_empty_string,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "sha256",
+    10,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_BYTES,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, sha256),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "fec_source",
+    11,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_UINT32,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, fec_source),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "fec_repair",
+    12,
+    PROTOBUF_C_LABEL_NONE,
+    PROTOBUF_C_TYPE_UINT32,
+    0,   /* quantifier_offset */
+    offsetof(UploadMetadataItem, fec_repair),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned upload_metadata_item__field_indices_by_name[] = {
+  8,   /* field[8] = base_location */
   3,   /* field[3] = checksum */
+  7,   /* field[7] = compression */
+  5,   /* field[5] = deadline */
   1,   /* field[1] = dtp_server_address */
+  11,   /* field[11] = fec_repair */
+  10,   /* field[10] = fec_source */
   0,   /* field[0] = file_location */
   2,   /* field[2] = payload_id */
+  4,   /* field[4] = priority */
+  9,   /* field[9] = sha256 */
+  6,   /* field[6] = size */
 };
 static const ProtobufCIntRange upload_metadata_item__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 4 }
+  { 0, 12 }
 };
 const ProtobufCMessageDescriptor upload_metadata_item__descriptor =
 {
@@ -167,7 +271,7 @@ const ProtobufCMessageDescriptor upload_metadata_item__descriptor =
   "UploadMetadataItem",
   "",
   sizeof(UploadMetadataItem),
-  4,
+  12,
   upload_metadata_item__field_descriptors,
   upload_metadata_item__field_indices_by_name,
   1,  upload_metadata_item__number_ranges,
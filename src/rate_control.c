@@ -0,0 +1,119 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <csp/csp.h>
+
+#include "rate_control.h"
+
+/* CSP packets larger than a buffer cannot be received */
+#define RATE_CONTROL_MTU_LIMIT (CSP_BUFFER_SIZE)
+
+/*
+ * The profile is replaced at runtime when a link parameter changes, from
+ * the param server thread, while workers read it. Writers and readers
+ * copy it under profile_lock, so a reader always gets one whole profile.
+ */
+static rate_profile_t current_profile = {
+	.throughput = 5000,
+	.min = 500,
+	.max = 10000,
+	.step = 500,
+	.mtu = 200,
+	.timeout = 10,
+};
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Rate the most recent session settled on, new sessions start from it */
+static atomic_uint learned_rate = 0;
+
+static uint16_t rate_control_mtu(uint16_t mtu)
+{
+	return mtu > RATE_CONTROL_MTU_LIMIT ? RATE_CONTROL_MTU_LIMIT : mtu;
+}
+
+void rate_control_init(rate_link_t link, uint32_t baudrate)
+{
+	rate_profile_t profile = rate_control_profile();
+
+	switch (link)
+	{
+	case RATE_LINK_KISS:
+		// 8N1 framing, KISS escaping and radio overhead leave about 80 % of the line rate
+		baudrate = baudrate ? baudrate : 115200;
+		profile.max = baudrate / 10 * 8 / 10;
+		profile.mtu = rate_control_mtu(200);
+		profile.timeout = 10;
+		break;
+	case RATE_LINK_CAN:
+		// CFP fragments carry 8 bytes per frame of about 128 bits on the bus
+		baudrate = baudrate ? baudrate : 1000000;
+		profile.max = baudrate / 16;
+		profile.mtu = rate_control_mtu(256);
+		profile.timeout = 5;
+		break;
+	case RATE_LINK_ZMQ:
+		profile.max = 10 * 1000 * 1000;
+		profile.mtu = rate_control_mtu(1024);
+		profile.timeout = 3;
+		break;
+	}
+
+	// Start at half the link and probe upwards in steps of a twentieth
+	profile.throughput = profile.max / 2;
+	profile.min = profile.max / 50;
+	profile.step = profile.max / 20;
+
+	pthread_mutex_lock(&profile_lock);
+	current_profile = profile;
+	pthread_mutex_unlock(&profile_lock);
+	atomic_store(&learned_rate, 0);
+
+	csp_print("Link profile: %u B/s initial, %u B/s max, MTU %u\n", profile.throughput, profile.max, profile.mtu);
+}
+
+rate_profile_t rate_control_profile(void)
+{
+	pthread_mutex_lock(&profile_lock);
+	rate_profile_t profile = current_profile;
+	pthread_mutex_unlock(&profile_lock);
+	return profile;
+}
+
+void rate_control_start(rate_controller_t *rc)
+{
+	unsigned int rate = atomic_load(&learned_rate);
+
+	rc->throughput = rate ? rate : rate_control_profile().throughput;
+}
+
+void rate_control_update(rate_controller_t *rc, uint32_t expected, uint32_t lost)
+{
+	rate_profile_t profile = rate_control_profile();
+
+	if (expected == 0)
+	{
+		return;
+	}
+
+	uint32_t loss = (uint64_t)lost * 1000 / expected;
+
+	if (loss > RATE_CONTROL_LOSS_HIGH)
+	{
+		rc->throughput /= 2;
+	}
+	else if (loss < RATE_CONTROL_LOSS_LOW)
+	{
+		rc->throughput += profile.step;
+	}
+
+	if (rc->throughput < profile.min)
+	{
+		rc->throughput = profile.min;
+	}
+	if (rc->throughput > profile.max)
+	{
+		rc->throughput = profile.max;
+	}
+
+	atomic_store(&learned_rate, rc->throughput);
+}
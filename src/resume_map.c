@@ -0,0 +1,298 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "resume_map.h"
+
+#define RESUME_MAP_MAGIC 0x52505444 // "DTPR"
+
+/*
+ * On-disk layout: two slots of a header followed by up to capacity
+ * intervals. Each sync writes the slot not holding the newest record, so a
+ * reset in the middle of a write leaves the previous record intact.
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t sequence; // records written to the sidecar, the newest valid slot is loaded
+	uint32_t count;
+	uint32_t crc_acc;
+	uint32_t packet_size;
+	uint32_t check; // FNV-1a of the header with check 0 and of the intervals
+} resume_map_header_t;
+
+static uint32_t resume_map_fnv(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t resume_map_check(resume_map_header_t header, const resume_interval_t *intervals)
+{
+	header.check = 0;
+	uint32_t hash = resume_map_fnv(2166136261u, &header, sizeof(header));
+	return resume_map_fnv(hash, intervals, header.count * sizeof(resume_interval_t));
+}
+
+static off_t resume_map_slot(const resume_map_t *map, uint32_t sequence)
+{
+	return (off_t)(sequence % 2) * (RESUME_MAP_HEADER_SIZE + map->capacity * sizeof(resume_interval_t));
+}
+
+static int resume_map_path(char *out, const char *dest_path)
+{
+	int len = snprintf(out, PATH_MAX, "%s%s", dest_path, RESUME_MAP_SUFFIX);
+	return (len < 0 || len >= PATH_MAX) ? -1 : 0;
+}
+
+/* Read the record in one slot into the intervals, false if it is missing or torn */
+static bool resume_map_read_slot(resume_map_t *map, off_t offset, resume_map_header_t *header)
+{
+	if (pread(map->fd, header, sizeof(*header), offset) != sizeof(*header) || header->magic != RESUME_MAP_MAGIC ||
+		header->count > map->capacity)
+	{
+		return false;
+	}
+
+	ssize_t len = header->count * sizeof(resume_interval_t);
+	return pread(map->fd, map->intervals, len, offset + sizeof(*header)) == len &&
+		   resume_map_check(*header, map->intervals) == header->check;
+}
+
+/* Read the newest stored set, an unreadable sidecar counts as nothing received */
+static void resume_map_load(resume_map_t *map)
+{
+	resume_map_header_t slots[2];
+	bool valid[2];
+
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		valid[i] = resume_map_read_slot(map, resume_map_slot(map, i), &slots[i]);
+	}
+	if (!valid[0] && !valid[1])
+	{
+		return;
+	}
+
+	// The intervals hold what slot 1 left there, slot 0 is read again if it is the newer one
+	uint32_t newest = !valid[0] || (valid[1] && (int32_t)(slots[1].sequence - slots[0].sequence) > 0) ? 1 : 0;
+	if (newest == 0 && !resume_map_read_slot(map, resume_map_slot(map, 0), &slots[0]))
+	{
+		return;
+	}
+	resume_map_header_t header = slots[newest];
+
+	map->sequence = header.sequence;
+	map->count = header.count;
+	map->crc_acc = header.crc_acc;
+	map->packet_size = header.packet_size;
+	for (uint32_t i = 0; i < map->count; i++)
+	{
+		map->received += map->intervals[i].end - map->intervals[i].start;
+	}
+}
+
+int resume_map_open(resume_map_t *map, const char *dest_path, bool load, resume_interval_t *intervals, uint32_t capacity)
+{
+	char path[PATH_MAX];
+
+	memset(map, 0, sizeof(*map));
+	map->intervals = intervals;
+	map->capacity = capacity;
+	if (resume_map_path(path, dest_path) != 0)
+	{
+		return -1;
+	}
+
+	map->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (load ? 0 : O_TRUNC), 0644);
+	if (map->fd < 0)
+	{
+		return -1;
+	}
+
+	if (load)
+	{
+		resume_map_load(map);
+	}
+	return 0;
+}
+
+/* Index of the first range starting after seq */
+static uint32_t resume_map_find(const resume_map_t *map, uint32_t seq)
+{
+	uint32_t lo = 0, hi = map->count;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (map->intervals[mid].start <= seq)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+bool resume_map_contains(const resume_map_t *map, uint32_t seq)
+{
+	uint32_t i = resume_map_find(map, seq);
+	return i > 0 && seq < map->intervals[i - 1].end;
+}
+
+int resume_map_add(resume_map_t *map, uint32_t seq)
+{
+	uint32_t n = map->count;
+
+	// Ranges end one past their last packet, the end of this one would wrap
+	if (seq == RESUME_MAP_END)
+	{
+		return -1;
+	}
+
+	// Packets mostly arrive in order and extend the last range
+	if (n > 0 && map->intervals[n - 1].end == seq)
+	{
+		map->intervals[n - 1].end++;
+		map->received++;
+		map->pending++;
+		return 1;
+	}
+
+	uint32_t lo = resume_map_find(map, seq);
+
+	resume_interval_t *prev = lo > 0 ? &map->intervals[lo - 1] : NULL;
+	resume_interval_t *next = lo < n ? &map->intervals[lo] : NULL;
+
+	if (prev && seq < prev->end)
+	{
+		return 0;
+	}
+
+	bool join_prev = prev && prev->end == seq;
+	bool join_next = next && next->start == seq + 1;
+
+	if (join_prev && join_next)
+	{
+		prev->end = next->end;
+		memmove(next, next + 1, (n - lo - 1) * sizeof(resume_interval_t));
+		map->count--;
+	}
+	else if (join_prev)
+	{
+		prev->end++;
+	}
+	else if (join_next)
+	{
+		next->start--;
+	}
+	else
+	{
+		if (n == map->capacity)
+		{
+			// No room for another range, the packet is requested again once gaps closed
+			return 0;
+		}
+		memmove(&map->intervals[lo + 1], &map->intervals[lo], (n - lo) * sizeof(resume_interval_t));
+		map->intervals[lo].start = seq;
+		map->intervals[lo].end = seq + 1;
+		map->count++;
+	}
+
+	map->received++;
+	map->pending++;
+	return 1;
+}
+
+_Static_assert(sizeof(resume_map_header_t) == RESUME_MAP_HEADER_SIZE, "sidecar header size");
+
+off_t resume_map_header(const resume_map_t *map, uint8_t header[RESUME_MAP_HEADER_SIZE])
+{
+	resume_map_header_t h = {
+		.magic = RESUME_MAP_MAGIC,
+		.sequence = map->sequence + 1,
+		.count = map->count,
+		.crc_acc = map->crc_acc,
+		.packet_size = map->packet_size,
+	};
+	h.check = resume_map_check(h, map->intervals);
+	memcpy(header, &h, sizeof(h));
+	return resume_map_slot(map, h.sequence);
+}
+
+int resume_map_sync(resume_map_t *map)
+{
+	uint8_t header[RESUME_MAP_HEADER_SIZE];
+
+	off_t offset = resume_map_header(map, header);
+	ssize_t len = map->count * sizeof(resume_interval_t);
+	if (pwrite(map->fd, header, sizeof(header), offset) != sizeof(header) ||
+		(len > 0 && pwrite(map->fd, map->intervals, len, offset + sizeof(header)) != len) ||
+		fdatasync(map->fd) != 0)
+	{
+		return -1;
+	}
+
+	map->sequence++;
+	map->pending = 0;
+	return 0;
+}
+
+uint32_t resume_map_missing(const resume_map_t *map, resume_interval_t *out, uint32_t max)
+{
+	uint32_t found = 0;
+	uint32_t next = 0;
+
+	if (max == 0)
+	{
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < map->count; i++)
+	{
+		if (map->intervals[i].start > next)
+		{
+			if (found == max - 1)
+			{
+				// Out of room, request everything from here on
+				break;
+			}
+			out[found].start = next;
+			out[found].end = map->intervals[i].start;
+			found++;
+		}
+		next = map->intervals[i].end;
+	}
+
+	out[found].start = next;
+	out[found].end = RESUME_MAP_END;
+	return found + 1;
+}
+
+void resume_map_close(resume_map_t *map, const char *dest_path, bool remove)
+{
+	char path[PATH_MAX];
+
+	if (map->fd >= 0)
+	{
+		close(map->fd);
+		map->fd = -1;
+	}
+
+	if (remove && resume_map_path(path, dest_path) == 0)
+	{
+		unlink(path);
+	}
+
+	map->count = 0;
+}
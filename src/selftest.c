@@ -0,0 +1,398 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <csp/csp.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+#include "selftest.h"
+#include "crc32.h"
+#include "file_sink.h"
+#include "upload_pool.h"
+#include "upload_request.h"
+#include "upload_stats.h"
+#include "vmem_dtp_server.h"
+
+#include "dtp/dtp_session.h"
+
+extern dtp_opt_session_hooks_cfg default_session_hooks;
+
+/* A file served over the emulated link, its payload ID is its index plus one */
+typedef struct
+{
+	char name[NAME_MAX + 1];
+	uint8_t *data;
+	uint64_t size;
+	uint32_t checksum;
+	atomic_uint rounds;
+	uint64_t start_ns;
+	uint64_t end_ns; // 0 until its completion report arrived
+	int status;
+} selftest_file_t;
+
+static selftest_file_t selftest_files[SELFTEST_MAX_FILES];
+static unsigned int selftest_count = 0;
+static selftest_link_t selftest_link;
+static char selftest_dir[] = "/tmp/upload_selftest.XXXXXX";
+
+/* Uniform in [0, 1000), one generator per session thread */
+static uint32_t selftest_permille(void)
+{
+	static __thread uint64_t state = 0;
+
+	if (state == 0)
+	{
+		state = upload_stats_now() | 1;
+	}
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (state >> 32) % 1000;
+}
+
+static void selftest_sleep_until(uint64_t ns)
+{
+	struct timespec ts = {.tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	{
+	}
+}
+
+static void selftest_deliver(dtp_t *session, const selftest_file_t *file, uint32_t seq, uint32_t payload)
+{
+	csp_packet_t *packet = csp_buffer_get(DTP_PACKET_HEADER_SIZE + payload);
+	if (packet == NULL)
+	{
+		return;
+	}
+
+	uint64_t start = (uint64_t)seq * payload;
+	uint32_t len = file->size - start < payload ? file->size - start : payload;
+	packet->data32[0] = seq;
+	memcpy(&packet->data[DTP_PACKET_HEADER_SIZE], &file->data[start], len);
+	packet->length = DTP_PACKET_HEADER_SIZE + len;
+	default_session_hooks.on_data_packet(session, packet);
+	csp_buffer_free(packet);
+}
+
+/*
+ * Stand-in for dtp_client_main: the server sends the requested intervals
+ * paced at the requested throughput, and the link delays, drops and
+ * reorders them on the way.
+ */
+static dtp_result selftest_session(uint32_t server, uint32_t throughput, uint32_t timeout, uint16_t payload_id, uint16_t mtu, bool resume)
+{
+	dtp_t session;
+	(void)server;
+	(void)timeout;
+	(void)resume;
+
+	if (payload_id == 0 || payload_id > selftest_count || mtu <= DTP_PACKET_HEADER_SIZE || throughput == 0)
+	{
+		return DTP_ERR;
+	}
+	selftest_file_t *file = &selftest_files[payload_id - 1];
+	uint32_t payload = mtu - DTP_PACKET_HEADER_SIZE;
+	uint32_t count = (file->size + payload - 1) / payload;
+	uint32_t rate = selftest_link.rate && selftest_link.rate < throughput ? selftest_link.rate : throughput;
+	atomic_fetch_add(&file->rounds, 1);
+
+	memset(&session, 0, sizeof(session));
+	dtp_meta_req_t *meta = &session.request_meta;
+	meta->throughput = throughput;
+	meta->payload_id = payload_id;
+	meta->mtu = mtu;
+	meta->nof_intervals = 1;
+	meta->intervals[0].start = 0;
+	meta->intervals[0].end = RESUME_MAP_END;
+	if (default_session_hooks.on_start)
+	{
+		default_session_hooks.on_start(&session);
+	}
+
+	// The request travels up and the first packet down
+	uint64_t next = upload_stats_now() + 2 * selftest_link.latency_ms * 1000000ull;
+	uint32_t held = UINT32_MAX;
+	for (unsigned int i = 0; i < meta->nof_intervals; i++)
+	{
+		uint32_t end = meta->intervals[i].end < count ? meta->intervals[i].end : count - 1;
+		for (uint32_t seq = meta->intervals[i].start; seq <= end; seq++)
+		{
+			next += (DTP_PACKET_HEADER_SIZE + payload) * 1000000000ull / rate;
+			selftest_sleep_until(next);
+			if (selftest_permille() < selftest_link.loss)
+			{
+				continue;
+			}
+			if (held == UINT32_MAX && selftest_permille() < selftest_link.reorder)
+			{
+				held = seq;
+				continue;
+			}
+			selftest_deliver(&session, file, seq, payload);
+			if (held != UINT32_MAX)
+			{
+				selftest_deliver(&session, file, held, payload);
+				held = UINT32_MAX;
+			}
+		}
+	}
+	if (held != UINT32_MAX)
+	{
+		selftest_deliver(&session, file, held, payload);
+	}
+
+	if (default_session_hooks.on_end)
+	{
+		default_session_hooks.on_end(&session);
+	}
+	if (default_session_hooks.on_release)
+	{
+		default_session_hooks.on_release(&session);
+	}
+	return DTP_OK;
+}
+
+int selftest_parse_link(selftest_link_t *link, const char *spec)
+{
+	char copy[128];
+	char *save;
+
+	if (strlen(spec) >= sizeof(copy))
+	{
+		return -1;
+	}
+	strcpy(copy, spec);
+
+	for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save))
+	{
+		char key[16];
+		unsigned int value;
+		if (sscanf(item, "%15[^=]=%u", key, &value) != 2)
+		{
+			return -1;
+		}
+		if (strcmp(key, "latency") == 0)
+		{
+			link->latency_ms = value;
+		}
+		else if (strcmp(key, "loss") == 0 && value <= 1000)
+		{
+			link->loss = value;
+		}
+		else if (strcmp(key, "reorder") == 0 && value <= 1000)
+		{
+			link->reorder = value;
+		}
+		else if (strcmp(key, "rate") == 0)
+		{
+			link->rate = value;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int selftest_compare(const void *a, const void *b)
+{
+	return strcmp(((const selftest_file_t *)a)->name, ((const selftest_file_t *)b)->name);
+}
+
+static int selftest_load(selftest_file_t *file, const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+
+	file->data = malloc(st.st_size);
+	if (file->data == NULL || read(fd, file->data, st.st_size) != st.st_size)
+	{
+		free(file->data);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	snprintf(file->name, sizeof(file->name), "%s", name);
+	file->size = st.st_size;
+	file->checksum = crc32_compute(file->data, file->size);
+	return 0;
+}
+
+int selftest_init(const char *dir, const selftest_link_t *link)
+{
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+
+	if (d == NULL)
+	{
+		csp_print("Cannot open self-test files '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+	while ((entry = readdir(d)) != NULL && selftest_count < SELFTEST_MAX_FILES)
+	{
+		if (entry->d_name[0] != '.' && selftest_load(&selftest_files[selftest_count], dir, entry->d_name) == 0)
+		{
+			selftest_count++;
+		}
+	}
+	closedir(d);
+	qsort(selftest_files, selftest_count, sizeof(selftest_files[0]), selftest_compare);
+
+	if (selftest_count == 0 || mkdtemp(selftest_dir) == NULL)
+	{
+		csp_print("No self-test files in '%s'\n", dir);
+		return -1;
+	}
+
+	selftest_link = *link;
+	upload_pool_set_transport(selftest_session);
+	csp_print("Self-test: %u files from '%s', latency %u ms, loss %u/1000, reorder %u/1000, rate %u B/s\n",
+			  selftest_count, dir, link->latency_ms, link->loss, link->reorder, link->rate);
+	return selftest_count;
+}
+
+/* Take the completion reports as the requester would */
+static void selftest_collect(csp_socket_t *sock, uint64_t deadline)
+{
+	unsigned int pending = 0;
+	for (unsigned int i = 0; i < selftest_count; i++)
+	{
+		pending += selftest_files[i].end_ns == 0;
+	}
+
+	while (pending > 0)
+	{
+		uint64_t now = upload_stats_now();
+		if (now >= deadline)
+		{
+			return;
+		}
+
+		csp_conn_t *conn = csp_accept(sock, (deadline - now) / 1000000 + 1);
+		if (conn == NULL)
+		{
+			continue;
+		}
+		csp_packet_t *report = csp_read(conn, 100);
+		if (report && report->length >= 3)
+		{
+			uint16_t payload_id;
+			memcpy(&payload_id, &report->data[1], sizeof(payload_id));
+			if (payload_id >= 1 && payload_id <= selftest_count && selftest_files[payload_id - 1].end_ns == 0)
+			{
+				selftest_files[payload_id - 1].end_ns = upload_stats_now();
+				selftest_files[payload_id - 1].status = report->data[0];
+				pending--;
+			}
+		}
+		if (report)
+		{
+			csp_buffer_free(report);
+		}
+		csp_close(conn);
+	}
+}
+
+/* Time the files should take at most: their bytes at the session rate, capped by the link, plus a round trip per round */
+static unsigned int selftest_duration(void)
+{
+	rate_profile_t profile = rate_control_profile();
+	uint32_t rate = selftest_link.rate && selftest_link.rate < profile.throughput ? selftest_link.rate : profile.throughput;
+	uint64_t bytes = 0;
+
+	for (unsigned int i = 0; i < selftest_count; i++)
+	{
+		bytes += selftest_files[i].size;
+	}
+	uint64_t seconds = SELFTEST_DURATION_FACTOR * bytes / (rate ? rate : 1) + UPLOAD_POOL_MAX_ROUNDS * 2 * selftest_link.latency_ms / 1000;
+	return SELFTEST_MIN_DURATION + (seconds < UINT32_MAX ? seconds : UINT32_MAX);
+}
+
+int selftest_run(unsigned int duration)
+{
+	static csp_socket_t sock = {.opts = CSP_O_RDP};
+	char path[PATH_MAX];
+	int failed = 0;
+
+	csp_if_lo.addr = SELFTEST_ADDRESS;
+	csp_rtable_set(SELFTEST_ADDRESS, csp_id_get_host_bits(), &csp_if_lo, CSP_NO_VIA_ADDRESS);
+	csp_bind(&sock, UPLOAD_CLIENT_DTP_COMPLETION_PORT);
+	csp_listen(&sock, SELFTEST_MAX_FILES);
+
+	if (duration == 0)
+	{
+		duration = selftest_duration();
+		csp_print("Self-test: giving up after %u s\n", duration);
+	}
+
+	uint64_t start = upload_stats_now();
+	for (unsigned int i = 0; i < selftest_count; i++)
+	{
+		selftest_file_t *file = &selftest_files[i];
+		snprintf(path, sizeof(path), "%s/%s", selftest_dir, file->name);
+		upload_request_t req = {
+			.server = SELFTEST_ADDRESS,
+			.payload_id = i + 1,
+			.file_location = path,
+			.checksum = file->checksum,
+			.requester = SELFTEST_ADDRESS,
+			.size = file->size,
+		};
+		file->start_ns = upload_stats_now();
+		if (upload_request_schedule(&req) != UPLOAD_CLIENT_DTP_REQUEST_SCHEDULED)
+		{
+			file->end_ns = file->start_ns;
+			file->status = UPLOAD_CLIENT_DTP_RESULT_FAILED;
+		}
+	}
+
+	selftest_collect(&sock, start + duration * 1000000000ull);
+
+	csp_print("%-24s %10s %8s %10s %6s %12s\n", "file", "bytes", "result", "seconds", "rounds", "B/s");
+	for (unsigned int i = 0; i < selftest_count; i++)
+	{
+		selftest_file_t *file = &selftest_files[i];
+		const char *result = "timeout";
+		double seconds = ((file->end_ns ? file->end_ns : upload_stats_now()) - file->start_ns) / 1e9;
+		if (file->end_ns)
+		{
+			result = file->status == UPLOAD_CLIENT_DTP_RESULT_OK ? "ok" : file->status == UPLOAD_CLIENT_DTP_RESULT_CHECKSUM ? "checksum" : "failed";
+		}
+		bool ok = file->end_ns && file->status == UPLOAD_CLIENT_DTP_RESULT_OK;
+		failed += !ok;
+		csp_print("%-24s %10llu %8s %10.3f %6u %12.0f\n", file->name, (unsigned long long)file->size, result,
+				  seconds, atomic_load(&file->rounds), ok ? file->size / seconds : 0.0);
+
+		snprintf(path, sizeof(path), "%s/%s", selftest_dir, file->name);
+		unlink(path);
+	}
+	csp_print("Self-test: %u of %u files intact after %.3f s\n", selftest_count - failed, selftest_count, (upload_stats_now() - start) / 1e9);
+
+	if (rmdir(selftest_dir) != 0)
+	{
+		csp_print("Unfinished uploads left in '%s'\n", selftest_dir);
+	}
+	return failed ? -1 : 0;
+}
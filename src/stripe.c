@@ -0,0 +1,322 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <csp/csp.h>
+
+#include "stripe.h"
+#include "upload_stats.h"
+#include "trace.h"
+
+#include "dtp/dtp.h"
+
+typedef struct
+{
+	uint16_t server;
+	unsigned int count;
+	struct
+	{
+		uint16_t addr;
+		atomic_uint rate; // bytes per second delivered over the route, 0 until measured
+	} routes[STRIPE_MAX_ROUTES];
+} stripe_group_t;
+
+/* One session of a striped round */
+typedef struct
+{
+	dtp_thread_args_t *opts;
+	uint16_t server;
+	uint32_t throughput;
+	upload_sink_ranges_t ranges;
+	dtp_result result;
+	uint64_t elapsed_ns;
+	bool done; // the helper running it finished, under stripe_lock
+} stripe_session_t;
+
+static stripe_group_t stripe_groups[STRIPE_MAX_SERVERS];
+static unsigned int stripe_group_count = 0;
+
+/* Sessions of striped rounds waiting for a helper thread, each worker queues at most STRIPE_MAX_ROUTES - 1 */
+#define STRIPE_QUEUE_LENGTH (UPLOAD_POOL_MAX_SESSIONS * (STRIPE_MAX_ROUTES - 1))
+static stripe_session_t *stripe_queue[STRIPE_QUEUE_LENGTH];
+static unsigned int stripe_head = 0, stripe_tail = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stripe_done = PTHREAD_COND_INITIALIZER;
+
+static stripe_group_t *stripe_find(uint16_t server)
+{
+	for (unsigned int i = 0; i < stripe_group_count; i++)
+	{
+		if (stripe_groups[i].server == server)
+		{
+			return &stripe_groups[i];
+		}
+	}
+	return NULL;
+}
+
+int stripe_add_route(uint16_t server, uint16_t alias)
+{
+	stripe_group_t *group = stripe_find(server);
+
+	if (group == NULL)
+	{
+		if (stripe_group_count == STRIPE_MAX_SERVERS)
+		{
+			return -1;
+		}
+		group = &stripe_groups[stripe_group_count++];
+		group->server = server;
+		group->count = 1;
+		group->routes[0].addr = server;
+		atomic_init(&group->routes[0].rate, 0);
+	}
+
+	if (group->count == STRIPE_MAX_ROUTES)
+	{
+		return -1;
+	}
+	group->routes[group->count].addr = alias;
+	atomic_init(&group->routes[group->count].rate, 0);
+	group->count++;
+	return 0;
+}
+
+unsigned int stripe_routes(uint16_t server)
+{
+	stripe_group_t *group = stripe_find(server);
+	return group ? group->count : 1;
+}
+
+static void *stripe_session_run(void *param)
+{
+	stripe_session_t *stripe = param;
+	dtp_thread_args_t *opts = stripe->opts;
+
+	upload_sink_bind(&opts->sink);
+	upload_sink_bind_ranges(&stripe->ranges);
+
+	uint64_t start = upload_stats_now();
+	trace_begin(TRACE_SESSION, opts->payload_id, stripe->throughput);
+	stripe->result = upload_pool_session(stripe->server, stripe->throughput, opts->timeout, opts->payload_id, opts->mtu, true);
+	trace_end(TRACE_SESSION, opts->payload_id, stripe->throughput);
+	stripe->elapsed_ns = upload_stats_now() - start;
+
+	upload_sink_bind_ranges(NULL);
+	return NULL;
+}
+
+static void *stripe_helper(void *param)
+{
+	char name[TRACE_THREAD_NAME_MAX];
+
+	snprintf(name, sizeof(name), "stripe %u", (unsigned int)(uintptr_t)param);
+	trace_thread_name(name);
+
+	while (1)
+	{
+		pthread_mutex_lock(&stripe_lock);
+		while (stripe_head == stripe_tail)
+		{
+			pthread_cond_wait(&stripe_work, &stripe_lock);
+		}
+		stripe_session_t *stripe = stripe_queue[stripe_head++ % STRIPE_QUEUE_LENGTH];
+		pthread_mutex_unlock(&stripe_lock);
+
+		stripe_session_run(stripe);
+
+		pthread_mutex_lock(&stripe_lock);
+		stripe->done = true;
+		pthread_cond_broadcast(&stripe_done);
+		pthread_mutex_unlock(&stripe_lock);
+	}
+	return NULL;
+}
+
+int stripe_start(unsigned int max_sessions)
+{
+	unsigned int extra = 0;
+
+	for (unsigned int i = 0; i < stripe_group_count; i++)
+	{
+		extra = stripe_groups[i].count - 1 > extra ? stripe_groups[i].count - 1 : extra;
+	}
+
+	// Enough for every worker to stripe at once, a queued session never waits for another upload
+	for (unsigned int i = 0; i < max_sessions * extra; i++)
+	{
+		pthread_t helper;
+		if (pthread_create(&helper, NULL, stripe_helper, (void *)(uintptr_t)i) != 0)
+		{
+			csp_print("Failed to start stripe thread %u\n", i);
+			return -1;
+		}
+		pthread_detach(helper);
+	}
+	return 0;
+}
+
+/*
+ * Append packets [start, end) to the ranges of a session, merging adjacent
+ * ones. Once its ranges are used up the last session stretches its final
+ * range instead, requesting some packets again rather than leaving any out.
+ * Returns false if the session cannot take the packets.
+ */
+static bool stripe_assign(stripe_session_t *stripe, uint32_t start, uint32_t end, bool last)
+{
+	upload_sink_ranges_t *r = &stripe->ranges;
+
+	if (r->count > 0 && (r->ranges[r->count - 1].end == start || (last && r->count == UPLOAD_SINK_MAX_RANGES)))
+	{
+		r->ranges[r->count - 1].end = end;
+		return true;
+	}
+	if (r->count == UPLOAD_SINK_MAX_RANGES)
+	{
+		return false;
+	}
+	r->ranges[r->count].start = start;
+	r->ranges[r->count].end = end;
+	r->count++;
+	return true;
+}
+
+/* Fold the goodput of a session into the rate of its route, averaged over rounds */
+static void stripe_measure(atomic_uint *rate, const stripe_session_t *stripe)
+{
+	rate_profile_t profile = rate_control_profile();
+
+	if (stripe->ranges.count == 0 || stripe->elapsed_ns == 0)
+	{
+		return;
+	}
+
+	uint32_t measured = stripe->ranges.bytes * 1000000000ull / stripe->elapsed_ns;
+	uint32_t old = atomic_load_explicit(rate, memory_order_relaxed);
+	uint32_t updated = old ? (old + measured) / 2 : measured;
+
+	if (updated < profile.min)
+	{
+		updated = profile.min;
+	}
+	atomic_store_explicit(rate, updated, memory_order_relaxed);
+}
+
+bool stripe_run(dtp_thread_args_t *opts)
+{
+	stripe_group_t *group = stripe_find(opts->server);
+	rate_profile_t profile = rate_control_profile();
+	upload_sink_t *sink = &opts->sink;
+	uint32_t total = (opts->size + sink->packet_size - 1) / sink->packet_size;
+	resume_interval_t missing[STRIPE_MAX_ROUTES * UPLOAD_SINK_MAX_RANGES];
+	stripe_session_t stripes[STRIPE_MAX_ROUTES] = {0};
+	uint32_t weights[STRIPE_MAX_ROUTES];
+	uint64_t weight_sum = 0;
+	uint32_t wanted = 0;
+
+	pthread_mutex_lock(&sink->lock);
+	uint32_t count = resume_map_missing(&sink->map, missing, sizeof(missing) / sizeof(missing[0]));
+	pthread_mutex_unlock(&sink->lock);
+
+	// The size is known, close the open ended range at the last packet
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (missing[i].start >= total)
+		{
+			count = i;
+			break;
+		}
+		if (missing[i].end > total)
+		{
+			missing[i].end = total;
+		}
+		wanted += missing[i].end - missing[i].start;
+	}
+
+	// Routes not measured yet start at the rate of the upload, measured ones
+	// are asked for a step more than they delivered to probe for headroom
+	for (unsigned int i = 0; i < group->count; i++)
+	{
+		uint32_t rate = atomic_load_explicit(&group->routes[i].rate, memory_order_relaxed);
+		weights[i] = rate ? rate : opts->throughput;
+		weight_sum += weights[i];
+		stripes[i].opts = opts;
+		stripes[i].server = group->routes[i].addr;
+		stripes[i].throughput = rate ? rate + profile.step : opts->throughput;
+	}
+
+	// The fastest route comes last, it takes whatever the others could not
+	unsigned int order[STRIPE_MAX_ROUTES];
+	for (unsigned int i = 0; i < group->count; i++)
+	{
+		unsigned int j = i;
+		for (; j > 0 && weights[order[j - 1]] > weights[i]; j--)
+		{
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+
+	// Hand out the missing packets in order, each route a share matching its rate
+	unsigned int route = 0;
+	uint32_t quota = (uint64_t)wanted * weights[order[0]] / weight_sum;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t start = missing[i].start;
+		while (start < missing[i].end)
+		{
+			bool last = route == group->count - 1;
+			uint32_t take = missing[i].end - start;
+			if (!last && take > quota)
+			{
+				take = quota;
+			}
+			if (take == 0 || !stripe_assign(&stripes[order[route]], start, start + take, last))
+			{
+				route++;
+				quota = (uint64_t)wanted * weights[order[route]] / weight_sum;
+				continue;
+			}
+			start += take;
+			quota -= last ? 0 : take;
+		}
+	}
+
+	csp_print("Striping %u packets of payload %u over %u routes\n", wanted, opts->payload_id, group->count);
+
+	// The worker thread runs the first stripe itself, the helper threads the others
+	pthread_mutex_lock(&stripe_lock);
+	for (unsigned int i = 1; i < group->count; i++)
+	{
+		stripes[i].done = stripes[i].ranges.count == 0;
+		if (!stripes[i].done)
+		{
+			stripe_queue[stripe_tail++ % STRIPE_QUEUE_LENGTH] = &stripes[i];
+		}
+	}
+	pthread_cond_broadcast(&stripe_work);
+	pthread_mutex_unlock(&stripe_lock);
+
+	if (stripes[0].ranges.count > 0)
+	{
+		stripe_session_run(&stripes[0]);
+	}
+
+	pthread_mutex_lock(&stripe_lock);
+	for (unsigned int i = 1; i < group->count; i++)
+	{
+		while (!stripes[i].done)
+		{
+			pthread_cond_wait(&stripe_done, &stripe_lock);
+		}
+	}
+	pthread_mutex_unlock(&stripe_lock);
+
+	for (unsigned int i = 0; i < group->count; i++)
+	{
+		stripe_measure(&group->routes[i].rate, &stripes[i]);
+	}
+
+	return resume_map_prefix(&sink->map) >= total;
+}
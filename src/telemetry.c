@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+#include <param/param.h>
+
+#include "telemetry.h"
+#include "upload_stats.h"
+
+/* Written by the hot paths */
+static atomic_ullong telemetry_bytes;
+static atomic_uint telemetry_done;
+static atomic_uint telemetry_failed;
+static atomic_uint telemetry_retransmits;
+static atomic_uint telemetry_hist[TELEMETRY_HIST_BUCKETS];
+
+/* Written by the sampler, read by libparam on other threads */
+static atomic_uint telemetry_rate;
+static atomic_uint telemetry_latency[TELEMETRY_PERCENTILES];
+static atomic_uint telemetry_csp_buffers;
+
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_BYTES, upload_bytes, PARAM_TYPE_UINT64, -1, 0, PM_TELEM | PM_READONLY, NULL, "B", (void *)&telemetry_bytes, "Payload bytes received");
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_DONE, upload_done, PARAM_TYPE_UINT32, -1, 0, PM_TELEM | PM_READONLY, NULL, "", (void *)&telemetry_done, "Uploads completed and verified");
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_FAILED, upload_failed, PARAM_TYPE_UINT32, -1, 0, PM_TELEM | PM_READONLY, NULL, "", (void *)&telemetry_failed, "Uploads rejected, failed or left incomplete");
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_RATE, upload_rate, PARAM_TYPE_UINT32, -1, 0, PM_TELEM | PM_READONLY, NULL, "B/s", (void *)&telemetry_rate, "Payload bytes received over the last second");
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_WRITE_LATENCY, write_latency, PARAM_TYPE_UINT32, TELEMETRY_PERCENTILES, sizeof(uint32_t), PM_TELEM | PM_READONLY, NULL, "us", (void *)telemetry_latency, "Staging block write time, p50 p90 p99 p99.9");
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_CSP_BUFFERS, csp_buffers_used, PARAM_TYPE_UINT32, -1, 0, PM_TELEM | PM_READONLY, NULL, "", (void *)&telemetry_csp_buffers, "CSP buffers in use, queued or held anywhere");
+PARAM_DEFINE_STATIC_RAM(TELEMETRY_PARAM_ID_RETRANSMITS, upload_retransmits, PARAM_TYPE_UINT32, -1, 0, PM_TELEM | PM_READONLY, NULL, "", (void *)&telemetry_retransmits, "Rounds that requested lost packets again");
+
+/* Bucket of a value, exact below 2^SUB_BITS and within 1/2^SUB_BITS above */
+static unsigned int telemetry_bucket(uint32_t v)
+{
+	if (v < (1u << TELEMETRY_HIST_SUB_BITS))
+	{
+		return v;
+	}
+	unsigned int e = 31 - __builtin_clz(v);
+	return ((e - TELEMETRY_HIST_SUB_BITS) << TELEMETRY_HIST_SUB_BITS) + (v >> (e - TELEMETRY_HIST_SUB_BITS));
+}
+
+/* Highest value that falls into a bucket */
+static uint32_t telemetry_bucket_max(unsigned int bucket)
+{
+	if (bucket < (2u << TELEMETRY_HIST_SUB_BITS))
+	{
+		return bucket;
+	}
+	unsigned int shift = (bucket >> TELEMETRY_HIST_SUB_BITS) - 1;
+	uint64_t low = (uint64_t)((bucket & ((1u << TELEMETRY_HIST_SUB_BITS) - 1)) | (1u << TELEMETRY_HIST_SUB_BITS)) << shift;
+	uint64_t high = low + (1ull << shift) - 1;
+	return high > UINT32_MAX ? UINT32_MAX : high;
+}
+
+void telemetry_packet(uint32_t len)
+{
+	atomic_fetch_add_explicit(&telemetry_bytes, len, memory_order_relaxed);
+}
+
+void telemetry_session(bool ok)
+{
+	atomic_fetch_add_explicit(ok ? &telemetry_done : &telemetry_failed, 1, memory_order_relaxed);
+}
+
+void telemetry_retransmit(void)
+{
+	atomic_fetch_add_explicit(&telemetry_retransmits, 1, memory_order_relaxed);
+}
+
+void telemetry_write(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	atomic_fetch_add_explicit(&telemetry_hist[telemetry_bucket(us > UINT32_MAX ? UINT32_MAX : us)], 1, memory_order_relaxed);
+}
+
+/* Percentiles of the writes counted since the last call, kept if there were none */
+static void telemetry_percentiles(void)
+{
+	static const uint32_t permyriad[TELEMETRY_PERCENTILES] = {5000, 9000, 9900, 9990};
+	static uint32_t last[TELEMETRY_HIST_BUCKETS];
+	uint32_t delta[TELEMETRY_HIST_BUCKETS];
+	uint64_t total = 0;
+
+	for (unsigned int i = 0; i < TELEMETRY_HIST_BUCKETS; i++)
+	{
+		uint32_t count = atomic_load_explicit(&telemetry_hist[i], memory_order_relaxed);
+		delta[i] = count - last[i];
+		last[i] = count;
+		total += delta[i];
+	}
+	if (total == 0)
+	{
+		return;
+	}
+
+	unsigned int p = 0;
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < TELEMETRY_HIST_BUCKETS && p < TELEMETRY_PERCENTILES; i++)
+	{
+		seen += delta[i];
+		while (p < TELEMETRY_PERCENTILES && seen * 10000 >= total * permyriad[p])
+		{
+			atomic_store_explicit(&telemetry_latency[p++], telemetry_bucket_max(i), memory_order_relaxed);
+		}
+	}
+}
+
+static void *telemetry_task(void *param)
+{
+	(void)param;
+	uint64_t last_bytes = 0;
+	uint64_t last_ns = upload_stats_now();
+
+	for (unsigned int period = 1;; period++)
+	{
+		usleep(TELEMETRY_PERIOD_MS * 1000);
+
+		uint64_t now = upload_stats_now();
+		uint64_t bytes = atomic_load_explicit(&telemetry_bytes, memory_order_relaxed);
+		atomic_store_explicit(&telemetry_rate, (bytes - last_bytes) * 1000000000ull / (now - last_ns), memory_order_relaxed);
+		last_bytes = bytes;
+		last_ns = now;
+
+		// Occupancy of the buffer pool, libcsp does not expose the depth of the router queue itself
+		int remaining = csp_buffer_remaining();
+		atomic_store_explicit(&telemetry_csp_buffers, remaining < CSP_BUFFER_COUNT ? CSP_BUFFER_COUNT - remaining : 0, memory_order_relaxed);
+
+		if (period % TELEMETRY_LATENCY_PERIODS == 0)
+		{
+			telemetry_percentiles();
+		}
+	}
+	return NULL;
+}
+
+int telemetry_start(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, telemetry_task, NULL) != 0)
+	{
+		csp_print("Failed to start telemetry thread\n");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef UPLOAD_CLIENT_TEST_H
+#define UPLOAD_CLIENT_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Unit tests, one executable per module registered with test() in
+ * meson.build. A failed check ends the test with its line, scratch files
+ * go to the directory the test runs in.
+ */
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while (0)
+
+#endif
@@ -0,0 +1,94 @@
+#include <string.h>
+
+#include "crc32.h"
+#include "test.h"
+
+/* Bitwise CRC-32 as zlib computes it, for comparison */
+static uint32_t reference_crc(const uint8_t *data, size_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < len; i++)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+static void test_vectors(void)
+{
+	CHECK(crc32_compute("123456789", 9) == 0xCBF43926);
+	CHECK(crc32_compute("", 0) == 0);
+	CHECK(crc32_compute("The quick brown fox jumps over the lazy dog", 43) == 0x414FA339);
+}
+
+static void test_update(void)
+{
+	static uint8_t data[70001];
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+
+	// Every length and alignment the wide kernels split into head, body and tail
+	for (size_t start = 0; start < 9; start++)
+	{
+		for (size_t len = 0; len < 80; len++)
+		{
+			CHECK(crc32_compute(data + start, len) == reference_crc(data + start, len));
+		}
+	}
+	CHECK(crc32_compute(data, sizeof(data)) == reference_crc(data, sizeof(data)));
+
+	// Updating in pieces equals one pass
+	uint32_t crc = 0xFFFFFFFF;
+	crc = crc32_update(crc, data, 1000);
+	crc = crc32_update(crc, data + 1000, sizeof(data) - 1000);
+	CHECK(~crc == reference_crc(data, sizeof(data)));
+}
+
+static void test_accumulator(void)
+{
+	static uint8_t data[100003];
+	const size_t packet = 196;
+	const size_t packets = (sizeof(data) + packet - 1) / packet;
+	uint32_t seed = 7;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+
+	// Packets folded in a scrambled order, the last one short
+	uint32_t acc = 0;
+	for (size_t k = 0; k < packets; k++)
+	{
+		size_t i = k * 7919 % packets;
+		size_t len = i == packets - 1 ? sizeof(data) - i * packet : packet;
+		acc = crc32_acc_add(acc, i * packet, data + i * packet, len);
+	}
+	CHECK(crc32_acc_final(acc, sizeof(data)) == reference_crc(data, sizeof(data)));
+
+	// Chunks of any size at any offset
+	acc = crc32_acc_add(0, 5, data + 5, 12345);
+	acc = crc32_acc_add(acc, 0, data, 5);
+	acc = crc32_acc_add(acc, 12350, data + 12350, 1);
+	CHECK(crc32_acc_final(acc, 12351) == reference_crc(data, 12351));
+
+	CHECK(crc32_acc_final(0, 0) == 0);
+}
+
+int main(void)
+{
+	test_vectors();
+	test_update();
+	test_accumulator();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef UPLOAD_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "decompress.h"
+#include "test.h"
+
+#define DEST "test_decompress.dest"
+#define RAW_SIZE (3 * 1024 * 1024 + 17)
+
+/* meson counts a test exiting with this as skipped */
+#define TEST_SKIP 77
+
+static uint8_t raw[RAW_SIZE];
+static uint8_t packed[RAW_SIZE + 65536];
+static uint8_t in[DECOMPRESS_IN_SIZE];
+static uint8_t out[DECOMPRESS_OUT_SIZE];
+static uint8_t back[RAW_SIZE + 1];
+
+static size_t compress(upload_compression_t type)
+{
+	switch (type)
+	{
+#ifdef UPLOAD_HAVE_ZSTD
+	case UPLOAD_COMPRESSION_ZSTD:
+		return ZSTD_compress(packed, sizeof(packed), raw, sizeof(raw), 3);
+#endif
+#ifdef UPLOAD_HAVE_LZ4
+	case UPLOAD_COMPRESSION_LZ4:
+		return LZ4F_compressFrame(packed, sizeof(packed), raw, sizeof(raw), NULL);
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* True if the destination holds exactly raw */
+static bool decoded(void)
+{
+	int fd = open(DEST, O_RDONLY);
+	CHECK(fd >= 0);
+	ssize_t len = read(fd, back, sizeof(back));
+	close(fd);
+	return len == RAW_SIZE && memcmp(back, raw, RAW_SIZE) == 0;
+}
+
+static void test_type(upload_compression_t type, decompress_mem_t *mem)
+{
+	decompress_t dec;
+	size_t len = compress(type);
+	CHECK(len > 0 && len < RAW_SIZE / 4);
+
+	// Fed in packets of an odd size
+	unlink(DEST);
+	CHECK(decompress_open(&dec, type, DEST, NULL, mem) == 0);
+	for (size_t offset = 0; offset < len; offset += 196)
+	{
+		CHECK(decompress_feed(&dec, packed + offset, len - offset < 196 ? len - offset : 196) == 0);
+	}
+	CHECK(dec.done && dec.consumed == len);
+	CHECK(decompress_close(&dec, true) == 0);
+	CHECK(decoded());
+
+	// Half read back from a staging file, then the rest fed
+	int fd = open("test_decompress.stage", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0 && write(fd, packed, len) == (ssize_t)len);
+	unlink(DEST);
+	CHECK(decompress_open(&dec, type, DEST, NULL, mem) == 0);
+	CHECK(decompress_catch_up(&dec, fd, len / 2) == 0 && dec.consumed == len / 2);
+	CHECK(decompress_feed(&dec, packed + len / 2, len - len / 2) == 0);
+	CHECK(decompress_close(&dec, true) == 0);
+	CHECK(decoded());
+	close(fd);
+	unlink("test_decompress.stage");
+
+	// Cut off inside a frame
+	unlink(DEST);
+	CHECK(decompress_open(&dec, type, DEST, NULL, mem) == 0);
+	CHECK(decompress_feed(&dec, packed, len - 10) == 0);
+	CHECK(!dec.done);
+	CHECK(decompress_close(&dec, true) == -1);
+	CHECK(access(DEST, F_OK) != 0);
+
+	// Not a frame, the blocks themselves carry no checksum in LZ4
+	packed[0] ^= 0xFF;
+	CHECK(decompress_open(&dec, type, DEST, NULL, mem) == 0);
+	decompress_feed(&dec, packed, len);
+	CHECK(decompress_close(&dec, true) == -1);
+	CHECK(access(DEST, F_OK) != 0);
+}
+
+int main(void)
+{
+	decompress_mem_t mem = {.in = in, .out = out};
+	bool tested = false;
+
+	// Compressible, with runs that change now and then
+	for (size_t i = 0; i < RAW_SIZE; i++)
+	{
+		raw[i] = "log line: temperature nominal, voltage ok\n"[i % 42] ^ ((i / 9973) & 1 ? (i & 3) : 0);
+	}
+
+	CHECK(decompress_mem_init(&mem) == 0);
+	CHECK(!decompress_supported(UPLOAD_COMPRESSION_COUNT));
+	for (upload_compression_t type = UPLOAD_COMPRESSION_ZSTD; type < UPLOAD_COMPRESSION_COUNT; type++)
+	{
+		if (decompress_supported(type))
+		{
+			test_type(type, &mem);
+			tested = true;
+		}
+	}
+	decompress_mem_free(&mem);
+	return tested ? EXIT_SUCCESS : TEST_SKIP;
+}
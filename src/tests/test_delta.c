@@ -0,0 +1,158 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "delta.h"
+#include "test.h"
+
+#define BASE "test_delta.base"
+#define DEST "test_delta.dest"
+#define BASE_SIZE (1024 * 1024)
+#define LITERAL_SIZE 5000
+#define NEW_SIZE (BASE_SIZE + LITERAL_SIZE)
+
+static uint8_t base[BASE_SIZE];
+static uint8_t expected[NEW_SIZE];
+static uint8_t patch[NEW_SIZE + 1024];
+static uint8_t back[NEW_SIZE + 1];
+static uint8_t out[DELTA_OUT_SIZE];
+
+static uint8_t *put(uint8_t *p, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+	{
+		*p++ = value >> (8 * i);
+	}
+	return p;
+}
+
+static void write_file(const char *path, const void *data, size_t len)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0 && write(fd, data, len) == (ssize_t)len);
+	close(fd);
+}
+
+static bool file_is(const char *path, const void *data, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	CHECK(fd >= 0);
+	ssize_t got = read(fd, back, sizeof(back));
+	close(fd);
+	return got == (ssize_t)len && memcmp(back, data, len) == 0;
+}
+
+/*
+ * The new file is the first half of the base, then literal bytes, then
+ * the second half of the base with 3 added to every byte. Returns the
+ * size of the patch.
+ */
+static size_t build_patch(uint32_t base_crc)
+{
+	uint8_t *p = patch;
+	size_t half = BASE_SIZE / 2;
+
+	p = put(p, DELTA_MAGIC, 4);
+	p = put(p, NEW_SIZE, 8);
+	p = put(p, base_crc, 4);
+	*p++ = DELTA_OP_COPY;
+	p = put(p, 0, 8);
+	p = put(p, half, 4);
+	*p++ = DELTA_OP_DATA;
+	p = put(p, LITERAL_SIZE, 4);
+	memcpy(p, expected + half, LITERAL_SIZE);
+	p += LITERAL_SIZE;
+	*p++ = DELTA_OP_ADD;
+	p = put(p, half, 8);
+	p = put(p, BASE_SIZE - half, 4);
+	memset(p, 3, BASE_SIZE - half);
+	p += BASE_SIZE - half;
+	*p++ = DELTA_OP_END;
+	return p - patch;
+}
+
+static void test_apply(size_t len, size_t chunk)
+{
+	delta_t delta;
+
+	write_file(BASE, base, sizeof(base));
+	CHECK(delta_open(&delta, BASE, DEST, out) == 0);
+	for (size_t offset = 0; offset < len; offset += chunk)
+	{
+		CHECK(delta_feed(&delta, patch + offset, len - offset < chunk ? len - offset : chunk) == 0);
+	}
+	CHECK(delta.done && delta.produced == NEW_SIZE);
+	CHECK(delta_close(&delta, true) == 0);
+	CHECK(file_is(DEST, expected, NEW_SIZE));
+	unlink(DEST);
+}
+
+int main(void)
+{
+	uint32_t x = 1;
+	for (size_t i = 0; i < BASE_SIZE; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		base[i] = x;
+	}
+	memcpy(expected, base, BASE_SIZE / 2);
+	for (size_t i = 0; i < LITERAL_SIZE; i++)
+	{
+		expected[BASE_SIZE / 2 + i] = i;
+	}
+	for (size_t i = BASE_SIZE / 2; i < BASE_SIZE; i++)
+	{
+		expected[i + LITERAL_SIZE] = base[i] + 3;
+	}
+
+	size_t len = build_patch(crc32_compute(base, BASE_SIZE));
+
+	// Whole, in packets and a byte at a time
+	test_apply(len, len);
+	test_apply(len, 196);
+	test_apply(len, 1);
+
+	// The base may be the destination, it is replaced only once the patch is applied
+	delta_t delta;
+	write_file(DEST, base, sizeof(base));
+	CHECK(delta_open(&delta, DEST, DEST, out) == 0);
+	CHECK(delta_feed(&delta, patch, len / 2) == 0);
+	CHECK(delta_close(&delta, false) == 0);
+	CHECK(file_is(DEST, base, BASE_SIZE));
+	CHECK(delta_open(&delta, DEST, DEST, out) == 0);
+	CHECK(delta_feed(&delta, patch, len) == 0);
+	CHECK(delta_close(&delta, true) == 0);
+	CHECK(file_is(DEST, expected, NEW_SIZE));
+
+	// A patch for another base is refused, the destination stays
+	write_file(DEST, base, sizeof(base));
+	build_patch(crc32_compute(base, BASE_SIZE) ^ 1);
+	CHECK(delta_open(&delta, DEST, DEST, out) == 0);
+	CHECK(delta_feed(&delta, patch, 16) == -1);
+	CHECK(delta_close(&delta, true) == -1);
+	CHECK(file_is(DEST, base, BASE_SIZE));
+
+	// Ending early
+	build_patch(crc32_compute(base, BASE_SIZE));
+	CHECK(delta_open(&delta, DEST, DEST, out) == 0);
+	CHECK(delta_feed(&delta, patch, len - 1) == 0);
+	CHECK(!delta.done);
+	CHECK(delta_close(&delta, true) == -1);
+	CHECK(file_is(DEST, base, BASE_SIZE));
+
+	// A copy past the end of the base
+	uint8_t *p = patch + 16;
+	*p++ = DELTA_OP_COPY;
+	p = put(p, BASE_SIZE - 10, 8);
+	p = put(p, 20, 4);
+	CHECK(delta_open(&delta, DEST, DEST, out) == 0);
+	CHECK(delta_feed(&delta, patch, p - patch) == -1);
+	CHECK(delta_close(&delta, true) == -1);
+
+	unlink(DEST);
+	unlink(BASE);
+	return EXIT_SUCCESS;
+}
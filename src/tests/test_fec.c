@@ -0,0 +1,178 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fec.h"
+#include "gf256.h"
+#include "test.h"
+
+#define STAGE "test_fec.stage"
+#define K 32
+#define R FEC_MAX_REPAIR
+#define SYMBOL 200
+#define PACKETS (4 * K + 7) // the last block is short
+#define SIZE (PACKETS * SYMBOL - 37) // and so is its last packet
+
+static uint8_t payload[PACKETS * SYMBOL];
+static uint8_t mem[FEC_MEM_SIZE];
+static resume_interval_t intervals[PACKETS];
+static uint32_t delivered;
+
+/* Multiplication by shift and add, reduced by the field polynomial */
+static uint8_t reference_mul(uint8_t a, uint8_t b)
+{
+	uint8_t p = 0;
+	while (b)
+	{
+		if (b & 1)
+		{
+			p ^= a;
+		}
+		a = (a << 1) ^ (a & 0x80 ? 0x1D : 0);
+		b >>= 1;
+	}
+	return p;
+}
+
+static void test_field(void)
+{
+	for (unsigned int a = 0; a < 256; a++)
+	{
+		for (unsigned int b = 0; b < 256; b++)
+		{
+			CHECK(gf256_mul(a, b) == reference_mul(a, b));
+		}
+		CHECK(a == 0 || gf256_mul(a, gf256_inv(a)) == 1);
+	}
+}
+
+/* The vector body and the byte by byte tail against single products */
+static void test_muladd(void)
+{
+	uint8_t src[100], dst[100], expect[100];
+
+	for (unsigned int c = 0; c < 256; c += 17)
+	{
+		for (size_t len = 0; len <= 64; len++)
+		{
+			for (size_t i = 0; i < sizeof(src); i++)
+			{
+				src[i] = i * 31 + c;
+				dst[i] = expect[i] = i ^ c;
+			}
+			for (size_t i = 0; i < len; i++)
+			{
+				expect[1 + i] ^= reference_mul(c, src[3 + i]);
+			}
+			gf256_muladd(dst + 1, src + 3, c, len);
+			CHECK(memcmp(dst, expect, sizeof(dst)) == 0);
+		}
+	}
+}
+
+/* Repair j of block b, built from the definition in fec.h */
+static void repair(uint32_t b, uint32_t j, uint8_t *out)
+{
+	memset(out, 0, SYMBOL);
+	for (uint32_t i = 0; i < K && b * K + i < PACKETS; i++)
+	{
+		const uint8_t *source = &payload[(b * K + i) * SYMBOL];
+		uint8_t c = gf256_inv((255 - j) ^ i);
+		for (size_t n = 0; n < SYMBOL; n++)
+		{
+			out[n] ^= reference_mul(c, source[n]);
+		}
+	}
+}
+
+static int deliver(void *ctx, uint32_t seq, const uint8_t *data, size_t len)
+{
+	resume_map_t *map = ctx;
+	CHECK(len == (seq == PACKETS - 1 ? SIZE - seq * SYMBOL : SYMBOL));
+	CHECK(memcmp(data, &payload[seq * SYMBOL], len) == 0);
+	CHECK(resume_map_add(map, seq) == 1);
+	delivered++;
+	return 0;
+}
+
+/* True if source packet i of block b is lost, limit of them per block */
+static bool lost(uint32_t b, uint32_t i, uint32_t limit)
+{
+	// Spread differently in every block, the last block loses all it has
+	return (i * 7 + b * 5) % K < limit;
+}
+
+static void test_recover(void)
+{
+	resume_map_t map = {.intervals = intervals, .capacity = PACKETS, .fd = -1};
+	uint8_t packet[SYMBOL];
+	fec_t fec;
+
+	int fd = open(STAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0);
+	CHECK(fec_open(&fec, mem, K, R, SYMBOL, SIZE) == 0);
+
+	// Blocks 0 to 2 lose the most repairs can rebuild, block 3 one more
+	const uint32_t limits[] = {R, R, R, R + 1, K};
+	for (uint32_t b = 0; b < 5; b++)
+	{
+		uint32_t missing = 0;
+		for (uint32_t i = 0; i < K && b * K + i < PACKETS; i++)
+		{
+			uint32_t seq = b * K + i;
+			if (lost(b, i, limits[b]))
+			{
+				missing++;
+				continue;
+			}
+			size_t len = seq == PACKETS - 1 ? SIZE - seq * SYMBOL : SYMBOL;
+			CHECK(pwrite(fd, &payload[seq * SYMBOL], len, (off_t)seq * SYMBOL) == (ssize_t)len);
+			resume_map_add(&map, seq);
+		}
+
+		delivered = 0;
+		for (uint32_t j = 0; j < R; j++)
+		{
+			repair(b, j, packet);
+			fec_block_t *block = fec_add_repair(&fec, &map, FEC_REPAIR_FLAG | (b * R + j), packet, SYMBOL);
+			// Enough once as many repairs as lost packets are held
+			CHECK((block != NULL) == (j + 1 == missing));
+			if (block)
+			{
+				CHECK(fec_decode(&fec, block, &map, fd, deliver, &map) == 0);
+				CHECK(delivered == missing);
+			}
+		}
+		CHECK(delivered == (missing <= R ? missing : 0));
+	}
+	CHECK(fec.recovered == 3 * R + 7);
+
+	// Only the block that lost too many is still missing
+	for (uint32_t seq = 0; seq < PACKETS; seq++)
+	{
+		CHECK(resume_map_contains(&map, seq) == (seq / K != 3 || !lost(3, seq % K, R + 1)));
+	}
+
+	// A repair for a block past the end, or of the wrong size, is dropped
+	CHECK(fec_add_repair(&fec, &map, FEC_REPAIR_FLAG | (5 * R), packet, SYMBOL) == NULL);
+	CHECK(fec_add_repair(&fec, &map, FEC_REPAIR_FLAG | (3 * R), packet, SYMBOL - 1) == NULL);
+
+	fec_close(&fec);
+	close(fd);
+	unlink(STAGE);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(payload); i++)
+	{
+		payload[i] = (i * 2654435761u) >> 13;
+	}
+	CHECK(!fec_supported(K, 0, SYMBOL, SIZE) && !fec_supported(250, 7, SYMBOL, SIZE));
+	CHECK(!fec_supported(K, R + 1, SYMBOL, SIZE) && !fec_supported(K, R, FEC_MAX_SYMBOL_SIZE + 1, SIZE));
+
+	test_field();
+	test_muladd();
+	test_recover();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "journal.h"
+#include "vmem_dtp_server.h"
+#include "test.h"
+
+#define JOURNAL "test_journal.log"
+
+static off_t journal_size(void)
+{
+	struct stat st;
+	CHECK(stat(JOURNAL, &st) == 0);
+	return st.st_size;
+}
+
+static void append_garbage(void)
+{
+	int fd = open(JOURNAL, O_WRONLY | O_APPEND);
+	CHECK(fd >= 0 && write(fd, "DTPJ torn", 9) == 9);
+	close(fd);
+}
+
+/* The journal keeps its state for the process, every start runs in a child of its own */
+static void restart(void (*run)(void))
+{
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0)
+	{
+		run();
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+static void first_start(void)
+{
+	uint8_t sha256[CONTENT_INDEX_HASH_SIZE] = {1};
+	upload_request_t a = {.server = 5, .payload_id = 1, .file_location = "/data/a", .deadline = 100, .sha256 = sha256};
+	upload_request_t b = {.server = 5, .payload_id = 2, .file_location = "/data/b", .base_location = "/data/base"};
+	upload_request_t c = {.server = 5, .payload_id = 3, .file_location = "/data/c"};
+
+	CHECK(journal_open(JOURNAL) == 0);
+	uint32_t id_a = journal_accept(&a);
+	uint32_t id_b = journal_accept(&b);
+	uint32_t id_c = journal_accept(&c);
+	CHECK(id_a != 0 && id_b > id_a && id_c > id_b);
+	journal_sync();
+	journal_progress(id_a, 10);
+	journal_done(id_c, UPLOAD_CLIENT_DTP_RESULT_OK);
+	// Ending it again writes nothing
+	off_t size = journal_size();
+	journal_done(id_c, UPLOAD_CLIENT_DTP_RESULT_OK);
+	CHECK(journal_size() == size);
+}
+
+static void second_start(void)
+{
+	// The torn record is cut off, the next one takes its place
+	off_t torn = journal_size();
+	CHECK(journal_open(JOURNAL) == 2);
+	CHECK(journal_size() < torn);
+
+	upload_request_t d = {.server = 6, .payload_id = 4, .file_location = "/data/d"};
+	CHECK(journal_accept(&d) != 0);
+	journal_sync();
+}
+
+static void third_start(void)
+{
+	CHECK(journal_open(JOURNAL) == 3);
+
+	// Many finished uploads, and a newer upload to b that ends the older
+	for (unsigned int i = 0; i < JOURNAL_COMPACT_RECORDS; i++)
+	{
+		upload_request_t e = {.server = 7, .payload_id = 5, .file_location = "/data/e"};
+		uint32_t id = journal_accept(&e);
+		journal_progress(id, i + 1);
+		journal_done(id, UPLOAD_CLIENT_DTP_RESULT_FAILED);
+	}
+	upload_request_t b = {.server = 8, .payload_id = 6, .file_location = "/data/b"};
+	CHECK(journal_accept(&b) != 0);
+	journal_sync();
+}
+
+static void fourth_start(void)
+{
+	// Compacted down to the three live uploads while they were appended
+	CHECK(journal_size() < 4096);
+	CHECK(journal_open(JOURNAL) == 3);
+}
+
+int main(void)
+{
+	unlink(JOURNAL);
+	restart(first_start);
+	append_garbage();
+	restart(second_start);
+	restart(third_start);
+	restart(fourth_start);
+	unlink(JOURNAL);
+	return EXIT_SUCCESS;
+}
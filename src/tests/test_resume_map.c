@@ -0,0 +1,109 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "resume_map.h"
+#include "test.h"
+
+#define DEST "test_resume_map.bin"
+#define SIDECAR DEST RESUME_MAP_SUFFIX
+
+static void test_merge(void)
+{
+	resume_interval_t intervals[4];
+	resume_interval_t missing[4];
+	resume_map_t map;
+
+	unlink(SIDECAR);
+	CHECK(resume_map_open(&map, DEST, false, intervals, 4) == 0);
+
+	// Packets join the range they touch, a gap filled merges its neighbours
+	CHECK(resume_map_add(&map, 0) == 1);
+	CHECK(resume_map_add(&map, 1) == 1);
+	CHECK(resume_map_add(&map, 5) == 1);
+	CHECK(resume_map_add(&map, 3) == 1);
+	CHECK(map.count == 3);
+	CHECK(resume_map_add(&map, 4) == 1);
+	CHECK(resume_map_add(&map, 2) == 1);
+	CHECK(map.count == 1 && map.intervals[0].start == 0 && map.intervals[0].end == 6);
+	CHECK(resume_map_add(&map, 2) == 0);
+	CHECK(resume_map_add(&map, RESUME_MAP_END) == -1);
+	CHECK(map.received == 6 && resume_map_prefix(&map) == 6 && resume_map_gaps(&map) == 0);
+
+	// A packet that would need a fifth range is left missing
+	CHECK(resume_map_add(&map, 10) == 1);
+	CHECK(resume_map_add(&map, 20) == 1);
+	CHECK(resume_map_add(&map, 30) == 1);
+	CHECK(resume_map_add(&map, 40) == 0);
+	CHECK(!resume_map_contains(&map, 40) && resume_map_contains(&map, 30));
+	CHECK(resume_map_gaps(&map) == 31 - 9);
+
+	// The missing ranges end open, those past max are merged into the last
+	CHECK(resume_map_missing(&map, missing, 4) == 4);
+	CHECK(missing[0].start == 6 && missing[0].end == 10);
+	CHECK(missing[1].start == 11 && missing[1].end == 20);
+	CHECK(missing[2].start == 21 && missing[2].end == 30);
+	CHECK(missing[3].start == 31 && missing[3].end == RESUME_MAP_END);
+	CHECK(resume_map_missing(&map, missing, 2) == 2);
+	CHECK(missing[1].start == 11 && missing[1].end == RESUME_MAP_END);
+
+	resume_map_close(&map, DEST, true);
+	CHECK(access(SIDECAR, F_OK) != 0);
+}
+
+static void test_persist(void)
+{
+	resume_interval_t intervals[16];
+	resume_interval_t loaded[16];
+	resume_map_t map;
+	resume_map_t back;
+
+	unlink(SIDECAR);
+	CHECK(resume_map_open(&map, DEST, false, intervals, 16) == 0);
+	map.packet_size = 200;
+	for (uint32_t seq = 0; seq < 10; seq++)
+	{
+		resume_map_add(&map, seq);
+	}
+	CHECK(resume_map_sync(&map) == 0);
+	CHECK(map.pending == 0);
+	for (uint32_t seq = 20; seq < 30; seq++)
+	{
+		resume_map_add(&map, seq);
+	}
+	CHECK(resume_map_sync(&map) == 0);
+	resume_map_close(&map, DEST, false);
+
+	CHECK(resume_map_open(&back, DEST, true, loaded, 16) == 0);
+	CHECK(back.received == 20 && back.count == 2 && back.packet_size == 200);
+	CHECK(back.intervals[1].start == 20 && back.intervals[1].end == 30);
+	resume_map_close(&back, DEST, false);
+
+	// A reset while the newer record was written leaves the older one
+	int fd = open(SIDECAR, O_WRONLY);
+	CHECK(fd >= 0);
+	off_t newer = (back.sequence % 2) * (RESUME_MAP_HEADER_SIZE + 16 * sizeof(resume_interval_t));
+	CHECK(pwrite(fd, "torn", 4, newer + RESUME_MAP_HEADER_SIZE) == 4);
+	close(fd);
+	CHECK(resume_map_open(&back, DEST, true, loaded, 16) == 0);
+	CHECK(back.received == 10 && back.count == 1);
+
+	// Syncing again replaces the torn record, the good one stays
+	resume_map_add(&back, 10);
+	CHECK(resume_map_sync(&back) == 0);
+	resume_map_close(&back, DEST, false);
+	CHECK(resume_map_open(&back, DEST, true, loaded, 16) == 0);
+	CHECK(back.received == 11 && back.intervals[0].end == 11);
+
+	// Without load the stored ranges are dropped
+	resume_map_close(&back, DEST, false);
+	CHECK(resume_map_open(&back, DEST, false, loaded, 16) == 0);
+	CHECK(back.received == 0 && back.count == 0);
+	resume_map_close(&back, DEST, true);
+}
+
+int main(void)
+{
+	test_merge();
+	test_persist();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#include "rate_control.h"
+#include "upload_queue.h"
+#include "test.h"
+
+static dtp_thread_args_t jobs[UPLOAD_POOL_QUEUE_LENGTH + 1];
+
+static dtp_thread_args_t *job(unsigned int i, uint8_t priority, uint64_t deadline_ns, uint64_t size, uint64_t stored)
+{
+	dtp_thread_args_t *args = &jobs[i];
+	args->payload_id = i;
+	args->priority = priority;
+	args->deadline_ns = deadline_ns;
+	args->size = size;
+	args->stored = stored;
+	args->rate.throughput = 1000;
+	return args;
+}
+
+/* Take the next upload, returning its link share at once */
+static unsigned int next(void)
+{
+	dtp_thread_args_t *args = upload_queue_admit();
+	upload_queue_release(args);
+	return args->payload_id;
+}
+
+static void test_order(void)
+{
+	// Class first, then deadline, then the bytes left, then arrival
+	CHECK(upload_queue_push(job(0, UPLOAD_PRIORITY_BULK, 0, 10, 0)) == 0);
+	CHECK(upload_queue_push(job(1, UPLOAD_PRIORITY_NORMAL, 0, 0, 0)) == 0);
+	CHECK(upload_queue_push(job(2, UPLOAD_PRIORITY_NORMAL, 0, 5000, 0)) == 0);
+	CHECK(upload_queue_push(job(3, UPLOAD_PRIORITY_NORMAL, 0, 5000, 4500)) == 0);
+	CHECK(upload_queue_push(job(4, UPLOAD_PRIORITY_NORMAL, 900, 1000000, 0)) == 0);
+	CHECK(upload_queue_push(job(5, UPLOAD_PRIORITY_NORMAL, 500, 1000000, 0)) == 0);
+	CHECK(upload_queue_push(job(6, UPLOAD_PRIORITY_URGENT, 0, 0, 0)) == 0);
+	CHECK(upload_queue_push(job(7, UPLOAD_PRIORITY_NORMAL, 0, 5000, 0)) == 0);
+
+	static const unsigned int expected[] = {6, 5, 4, 3, 2, 7, 1, 0};
+	for (unsigned int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+	{
+		CHECK(next() == expected[i]);
+	}
+}
+
+static void test_full(void)
+{
+	for (unsigned int i = 0; i < UPLOAD_POOL_QUEUE_LENGTH; i++)
+	{
+		CHECK(!upload_queue_full());
+		// Pushed in reverse, the heap has to sift each one up
+		CHECK(upload_queue_push(job(i, UPLOAD_PRIORITY_NORMAL, 0, 100 * (UPLOAD_POOL_QUEUE_LENGTH - i), 0)) == 0);
+	}
+	CHECK(upload_queue_full());
+	CHECK(upload_queue_push(job(UPLOAD_POOL_QUEUE_LENGTH, UPLOAD_PRIORITY_NORMAL, 0, 0, 0)) == -1);
+	for (unsigned int i = UPLOAD_POOL_QUEUE_LENGTH; i-- > 0;)
+	{
+		CHECK(next() == i);
+	}
+	CHECK(!upload_queue_full());
+}
+
+static void test_budget(void)
+{
+	rate_profile_t profile = rate_control_profile();
+
+	// One session may take the whole link
+	dtp_thread_args_t *first = job(0, UPLOAD_PRIORITY_NORMAL, 0, 100, 0);
+	first->rate.throughput = profile.max;
+	CHECK(upload_queue_push(first) == 0);
+	CHECK(upload_queue_admit() == first && first->reserved == profile.max);
+
+	// An urgent upload is admitted past the budget
+	dtp_thread_args_t *urgent = job(1, UPLOAD_PRIORITY_URGENT, 0, 100, 0);
+	CHECK(upload_queue_push(urgent) == 0);
+	CHECK(upload_queue_admit() == urgent && urgent->reserved == 1000);
+
+	// Adjusting clamps the first to what the urgent one leaves
+	upload_queue_adjust(first);
+	CHECK(first->reserved == profile.max - 1000 && first->throughput == first->reserved);
+
+	// A resumed upload with little left goes before a fresh one of the same size
+	upload_queue_release(urgent);
+	upload_queue_release(first);
+	CHECK(upload_queue_push(job(2, UPLOAD_PRIORITY_NORMAL, 0, 5000, 0)) == 0);
+	CHECK(upload_queue_push(job(3, UPLOAD_PRIORITY_NORMAL, 0, 5000, 4900)) == 0);
+	CHECK(next() == 3);
+	CHECK(next() == 2);
+}
+
+int main(void)
+{
+	rate_control_init(RATE_LINK_ZMQ, 0);
+	test_order();
+	test_full();
+	test_budget();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,289 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+
+#include "trace.h"
+#include "atomic_file.h"
+#include "upload_stats.h"
+
+/*
+ * One ring per thread, only that thread writes to it. A record is filled in
+ * before head is advanced past it, so the dump sees complete records up to
+ * head. A record may be overwritten while the dump copies it, those older
+ * than a full ring behind the head read afterwards are dropped.
+ */
+typedef struct
+{
+	atomic_ullong head; // records ever written
+	atomic_bool owned;	// a live thread writes to this ring
+	char name[TRACE_THREAD_NAME_MAX];
+	trace_record_t records[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+/* Name and argument names of each event in the trace */
+static const struct
+{
+	const char *name;
+	const char *arg0;
+	const char *arg1;
+} trace_names[TRACE_EVENT_COUNT] = {
+	[TRACE_ACCEPT] = {"accept", "source", NULL},
+	[TRACE_PARSE] = {"parse", "type", "length"},
+	[TRACE_FILE_OPEN] = {"file_open", "payload", "resume"},
+	[TRACE_SESSION] = {"session", "payload", "throughput"},
+	[TRACE_ROUND] = {"round", "payload", "missing"},
+	[TRACE_RETRANSMIT] = {"retransmit", "payload", NULL},
+	[TRACE_WRITE] = {"write", NULL, "bytes"},
+	[TRACE_CHECKPOINT] = {"checkpoint", NULL, "packets"},
+	[TRACE_FEC_DECODE] = {"fec_decode", NULL, "packets"},
+};
+
+atomic_bool trace_enabled = false;
+
+static trace_ring_t *trace_rings;
+static const char *trace_path;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local trace_ring_t *trace_ring;
+
+/* Give the ring back when its thread ends, the next new thread continues it */
+static void trace_ring_release(void *ring)
+{
+	atomic_store_explicit(&((trace_ring_t *)ring)->owned, false, memory_order_release);
+}
+
+static trace_ring_t *trace_ring_claim(void)
+{
+	for (int i = 0; i < TRACE_MAX_THREADS; i++)
+	{
+		bool owned = false;
+		if (atomic_compare_exchange_strong(&trace_rings[i].owned, &owned, true))
+		{
+			trace_rings[i].name[0] = '\0';
+			pthread_setspecific(trace_key, &trace_rings[i]);
+			return &trace_rings[i];
+		}
+	}
+	return NULL;
+}
+
+uint64_t trace_now(void)
+{
+	return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? upload_stats_now() : 0;
+}
+
+void trace_thread_name(const char *name)
+{
+	if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed))
+	{
+		return;
+	}
+	if (trace_ring == NULL)
+	{
+		trace_ring = trace_ring_claim();
+	}
+	if (trace_ring)
+	{
+		snprintf(trace_ring->name, sizeof(trace_ring->name), "%s", name);
+	}
+}
+
+void trace_record(trace_event_t event, trace_phase_t phase, uint16_t arg0, uint64_t arg1, uint64_t start_ns)
+{
+	if (trace_ring == NULL && (trace_ring = trace_ring_claim()) == NULL)
+	{
+		return;
+	}
+
+	uint64_t now = upload_stats_now();
+	uint64_t head = atomic_load_explicit(&trace_ring->head, memory_order_relaxed);
+	trace_record_t *rec = &trace_ring->records[head & (TRACE_RING_EVENTS - 1)];
+
+	rec->ts_ns = start_ns ? start_ns : now;
+	rec->dur_ns = start_ns ? now - start_ns : 0;
+	rec->event = event;
+	rec->phase = phase;
+	rec->arg0 = arg0;
+	rec->arg1 = arg1;
+	atomic_store_explicit(&trace_ring->head, head + 1, memory_order_release);
+}
+
+static void trace_write_record(FILE *f, unsigned int tid, const trace_record_t *rec, bool *first)
+{
+	const char *name = trace_names[rec->event].name;
+	const char *arg0 = trace_names[rec->event].arg0;
+	const char *arg1 = trace_names[rec->event].arg1;
+
+	fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"upload\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ".%03u",
+			*first ? "" : ",", name, rec->phase, tid, rec->ts_ns / 1000, (unsigned int)(rec->ts_ns % 1000));
+	*first = false;
+
+	switch (rec->phase)
+	{
+	case TRACE_PHASE_COMPLETE:
+		fprintf(f, ",\"dur\":%u.%03u", rec->dur_ns / 1000, rec->dur_ns % 1000);
+		break;
+	case TRACE_PHASE_INSTANT:
+		fprintf(f, ",\"s\":\"t\"");
+		break;
+	case TRACE_PHASE_COUNTER:
+		// One series per payload
+		fprintf(f, ",\"args\":{\"payload %u\":%" PRIu64 "}}", rec->arg0, rec->arg1);
+		return;
+	default:
+		break;
+	}
+
+	fprintf(f, ",\"args\":{");
+	if (arg0)
+	{
+		fprintf(f, "\"%s\":%u%s", arg0, rec->arg0, arg1 ? "," : "");
+	}
+	if (arg1)
+	{
+		fprintf(f, "\"%s\":%" PRIu64, arg1, rec->arg1);
+	}
+	fprintf(f, "}}");
+}
+
+static void trace_write_ring(FILE *f, unsigned int tid, trace_ring_t *ring, trace_record_t *copy, bool *first)
+{
+	uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t base = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+
+	if (end == 0)
+	{
+		return;
+	}
+
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			*first ? "" : ",", tid, ring->name[0] ? ring->name : "thread");
+	*first = false;
+
+	for (uint64_t i = base; i < end; i++)
+	{
+		copy[i - base] = ring->records[i & (TRACE_RING_EVENTS - 1)];
+	}
+
+	// The writer may have gone round while copying, skip what it overwrote
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t start = base;
+	if (head >= TRACE_RING_EVENTS && head - TRACE_RING_EVENTS + 1 > start)
+	{
+		start = head - TRACE_RING_EVENTS + 1;
+	}
+
+	for (uint64_t i = start; i < end; i++)
+	{
+		trace_write_record(f, tid, &copy[i - base], first);
+	}
+}
+
+int trace_dump(void)
+{
+	char temp[PATH_MAX];
+	bool first = true;
+	int ret = -1;
+
+	if (trace_rings == NULL || atomic_file_temp(temp, sizeof(temp), trace_path) != 0)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&trace_dump_lock);
+	trace_record_t *copy = malloc(TRACE_RING_EVENTS * sizeof(trace_record_t));
+	FILE *f = fopen(temp, "w");
+	if (copy && f)
+	{
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+		for (unsigned int i = 0; i < TRACE_MAX_THREADS; i++)
+		{
+			trace_write_ring(f, i, &trace_rings[i], copy, &first);
+		}
+		fprintf(f, "\n]}\n");
+		if (fflush(f) == 0 && !ferror(f) && atomic_file_commit(fileno(f), temp, trace_path) == 0)
+		{
+			ret = 0;
+		}
+	}
+	if (f)
+	{
+		fclose(f);
+	}
+	if (ret != 0)
+	{
+		unlink(temp);
+		csp_print("Failed to write trace '%s'\n", trace_path);
+	}
+	else
+	{
+		csp_print("Trace written to '%s'\n", trace_path);
+	}
+	free(copy);
+	pthread_mutex_unlock(&trace_dump_lock);
+	return ret;
+}
+
+static void trace_dump_at_exit(void)
+{
+	trace_dump();
+}
+
+/* Takes the signals for the whole process, so dumping runs in a normal thread context */
+static void *trace_signal_task(void *param)
+{
+	sigset_t *signals = param;
+	int sig;
+
+	while (sigwait(signals, &sig) == 0)
+	{
+		if (sig == SIGUSR1)
+		{
+			trace_dump();
+		}
+		else
+		{
+			exit(EXIT_SUCCESS);
+		}
+	}
+	return NULL;
+}
+
+int trace_start(const char *path)
+{
+	static sigset_t signals;
+	pthread_t thread;
+
+	trace_rings = calloc(TRACE_MAX_THREADS, sizeof(trace_ring_t));
+	if (trace_rings == NULL || pthread_key_create(&trace_key, trace_ring_release) != 0)
+	{
+		free(trace_rings);
+		trace_rings = NULL;
+		return -1;
+	}
+	trace_path = path;
+
+	// Threads started later inherit the mask, only the signal thread receives these
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+		pthread_create(&thread, NULL, trace_signal_task, &signals) != 0)
+	{
+		return -1;
+	}
+	pthread_detach(thread);
+
+	atexit(trace_dump_at_exit);
+	atomic_store(&trace_enabled, true);
+	trace_thread_name("main");
+	return 0;
+}
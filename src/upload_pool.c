@@ -0,0 +1,488 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <csp/csp.h>
+
+#include "upload_pool.h"
+#include "journal.h"
+#include "upload_queue.h"
+#include "upload_request.h"
+#include "stripe.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "uring_writer.h"
+#include "vmem_dtp_server.h"
+
+#include "dtp/dtp.h"
+#include "dtp/dtp_session.h"
+
+/* Upload contexts and the sink memory behind them, reserved at startup */
+static dtp_thread_args_t *pool_contexts;
+static dtp_thread_args_t **pool_free;
+static unsigned int pool_size = 0;
+static unsigned int pool_free_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Uploads whose sink the setup thread has yet to open, each context is in it at most once */
+static dtp_thread_args_t *setup_queue[UPLOAD_POOL_MAX_CONTEXTS];
+static unsigned int setup_head = 0, setup_tail = 0;
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t setup_cond = PTHREAD_COND_INITIALIZER;
+
+/* A session of libdtp, the session it leaves behind is released at once */
+static dtp_result dtp_transport(uint32_t server, uint32_t throughput, uint32_t timeout, uint16_t payload_id, uint16_t mtu, bool resume)
+{
+	dtp_t *session;
+
+	dtp_result result = dtp_client_main(server, throughput, timeout, payload_id, mtu, resume, &session);
+	if (result == DTP_OK)
+	{
+		dtp_release_session(session);
+	}
+	return result;
+}
+
+static upload_transport_t pool_transport = dtp_transport;
+
+/* Run one DTP session, returns true if it completed */
+static bool dtp_client_round(dtp_thread_args_t *opts)
+{
+	// With the size known, an upload from a server with several routes is split over all of them
+	if (opts->size != 0 && stripe_routes(opts->server) > 1)
+	{
+		// Splitting the round needs the packets already stored
+		return upload_sink_wait(&opts->sink) == 0 && stripe_run(opts);
+	}
+
+	csp_print("Starting DTP client for payload %u from server %u at %u B/s\n", opts->payload_id, opts->server_addr, opts->throughput);
+
+	// Run the DTP client. This will block until the transfer is complete or fails.
+	trace_begin(TRACE_SESSION, opts->payload_id, opts->throughput);
+	dtp_result result = upload_pool_session(opts->server, opts->throughput, opts->timeout, opts->payload_id, opts->mtu, opts->resume);
+	trace_end(TRACE_SESSION, opts->payload_id, opts->throughput);
+
+	if (result == DTP_ERR)
+	{
+		csp_print("DTP client failed: %s\n", dtp_strerror(dtp_errno(NULL)));
+		// The on_end hook should be called by libdtp on failure to clean up resources.
+		return false;
+	}
+
+	csp_print("DTP client completed successfully.\n");
+	return true;
+}
+
+/* Packets missing below the highest received one, and past it up to the end when the size is known */
+static uint32_t dtp_client_gaps(const dtp_thread_args_t *opts)
+{
+	const resume_map_t *map = &opts->sink.map;
+	uint32_t gaps = resume_map_gaps(map);
+
+	if (opts->size != 0)
+	{
+		uint32_t total = (opts->size + opts->sink.packet_size - 1) / opts->sink.packet_size;
+		uint32_t top = map->count ? map->intervals[map->count - 1].end : 0;
+		gaps += total > top ? total - top : 0;
+	}
+	return gaps;
+}
+
+/*
+ * Fetch the payload in rounds. Every round after the first resumes from the
+ * received ranges, at a rate adapted to the loss of the round before.
+ * Returns true once the whole payload was received.
+ */
+static bool dtp_client_run(dtp_thread_args_t *opts)
+{
+	resume_map_t *map = &opts->sink.map;
+	// A new upload starts out empty while its sink may still be opening
+	uint32_t received = opts->resume ? map->received : 0;
+
+	for (int round = 0; round < UPLOAD_POOL_MAX_ROUNDS; round++)
+	{
+		bool completed = dtp_client_round(opts);
+		if (upload_sink_wait(&opts->sink) != 0)
+		{
+			return false;
+		}
+		uint32_t fresh = map->received - received;
+		received = map->received;
+		opts->stored = (uint64_t)received * opts->sink.packet_size;
+		uint32_t gaps = dtp_client_gaps(opts);
+
+		journal_progress(opts->journal_id, map->received);
+
+		rate_control_update(&opts->rate, fresh + gaps, gaps);
+		trace_instant(TRACE_ROUND, opts->payload_id, gaps);
+		trace_counter(TRACE_RETRANSMIT, opts->payload_id, completed && gaps == 0 ? 0 : gaps);
+
+		if (completed && gaps == 0)
+		{
+			return true;
+		}
+
+		if (fresh == 0)
+		{
+			// The server is not reachable, wait for a RESUME request
+			return false;
+		}
+
+		csp_print("Payload %u: %u packets missing after round %d\n", opts->payload_id, gaps, round + 1);
+		upload_queue_adjust(opts);
+		telemetry_retransmit();
+		opts->resume = 1;
+		opts->sink.resume = true;
+	}
+
+	return false;
+}
+
+static void *dtp_client_worker(void *param)
+{
+	char name[TRACE_THREAD_NAME_MAX];
+
+	snprintf(name, sizeof(name), "worker %u", (unsigned int)(uintptr_t)param);
+	trace_thread_name(name);
+
+	while (1)
+	{
+		dtp_thread_args_t *opts = upload_queue_admit();
+
+		upload_stats_start(opts->stats);
+
+		// A resumed upload requests what its map lacks at the MTU it started with, a new one starts while its
+		// sink opens unless the content index may hold the file
+		bool complete = false;
+		if ((!opts->resume && !opts->indexed) || upload_sink_wait(&opts->sink) == 0)
+		{
+			if (opts->resume)
+			{
+				opts->mtu = opts->sink.packet_size + DTP_PACKET_HEADER_SIZE;
+			}
+			upload_sink_bind(&opts->sink);
+			complete = dtp_client_run(opts);
+			upload_sink_bind(NULL);
+		}
+
+		if (opts->present)
+		{
+			upload_queue_release(opts);
+			upload_stats_finish(opts->stats, UPLOAD_CLIENT_DTP_RESULT_OK, opts->checksum);
+			journal_done(opts->journal_id, UPLOAD_CLIENT_DTP_RESULT_OK);
+			upload_request_report(opts->requester, opts->payload_id, UPLOAD_CLIENT_DTP_RESULT_OK, opts->checksum, opts->size);
+			upload_pool_release(opts);
+			journal_rearm();
+			continue;
+		}
+
+		if (upload_sink_wait(&opts->sink) != 0)
+		{
+			upload_queue_release(opts);
+			upload_stats_finish(opts->stats, UPLOAD_CLIENT_DTP_RESULT_FAILED, 0);
+			journal_done(opts->journal_id, UPLOAD_CLIENT_DTP_RESULT_FAILED);
+			upload_request_report(opts->requester, opts->payload_id, UPLOAD_CLIENT_DTP_RESULT_FAILED, 0, 0);
+			upload_pool_release(opts);
+			journal_rearm();
+			continue;
+		}
+
+		if (opts->sink.fec.recovered)
+		{
+			csp_print("Payload %u: %u packets rebuilt from repair packets\n", opts->payload_id, opts->sink.fec.recovered);
+		}
+
+		uint8_t status = UPLOAD_CLIENT_DTP_RESULT_FAILED;
+		uint32_t checksum = upload_sink_checksum(&opts->sink);
+		uint32_t size = opts->sink.size;
+		if (complete)
+		{
+			status = UPLOAD_CLIENT_DTP_RESULT_OK;
+			if (opts->checksum != 0 && opts->checksum != checksum)
+			{
+				csp_print("Checksum mismatch for payload %u: expected %08x, got %08x\n", opts->payload_id, opts->checksum, checksum);
+				status = UPLOAD_CLIENT_DTP_RESULT_CHECKSUM;
+			}
+			else if (upload_sink_finish(&opts->sink) != 0)
+			{
+				csp_print("Payload %u could not be decoded\n", opts->payload_id);
+				status = UPLOAD_CLIENT_DTP_RESULT_FAILED;
+			}
+		}
+
+		upload_queue_release(opts);
+
+		// Only a verified upload replaces the destination, an incomplete one keeps its resume state
+		upload_sink_end_t end = UPLOAD_SINK_KEEP;
+		if (complete)
+		{
+			end = status == UPLOAD_CLIENT_DTP_RESULT_OK ? UPLOAD_SINK_COMMIT : UPLOAD_SINK_DISCARD;
+		}
+		if (upload_sink_close(&opts->sink, end) != 0 && status == UPLOAD_CLIENT_DTP_RESULT_OK)
+		{
+			status = UPLOAD_CLIENT_DTP_RESULT_FAILED;
+		}
+		upload_stats_finish(opts->stats, status, checksum);
+		if (complete)
+		{
+			journal_done(opts->journal_id, status);
+		}
+
+		upload_request_report(opts->requester, opts->payload_id, status, checksum, size);
+
+		// Hashed after the report, the requester need not wait for it
+		if (status == UPLOAD_CLIENT_DTP_RESULT_OK && opts->indexed)
+		{
+			char path[PATH_MAX];
+			upload_sink_destination(&opts->sink, path, sizeof(path));
+			content_index_add(opts->sha256, path);
+		}
+		upload_pool_release(opts);
+		// The context may take an upload the journal could not place before
+		journal_rearm();
+	}
+
+	return NULL;
+}
+
+int upload_pool_reserve(unsigned int contexts)
+{
+	size_t mem_size = upload_sink_mem_size();
+	uint8_t *memory;
+
+	pool_contexts = calloc(contexts, sizeof(dtp_thread_args_t));
+	pool_free = calloc(contexts, sizeof(dtp_thread_args_t *));
+	memory = aligned_alloc(UPLOAD_SINK_BLOCK_ALIGN, contexts * mem_size);
+	if (pool_contexts == NULL || pool_free == NULL || memory == NULL)
+	{
+		csp_print("Cannot reserve %u upload contexts\n", contexts);
+		free(pool_contexts);
+		free(pool_free);
+		free(memory);
+		return -1;
+	}
+
+	// Touch every page now, so the memory is committed at startup and not by the first uploads
+	memset(memory, 0, contexts * mem_size);
+	for (unsigned int i = 0; i < contexts; i++)
+	{
+		upload_sink_mem_init(&pool_contexts[i].sink.mem, memory + i * mem_size);
+		// Codec contexts too, rather than on the receive path of the first compressed upload
+		if (decompress_mem_init(&pool_contexts[i].sink.mem.decoder) != 0)
+		{
+			csp_print("Cannot create decoder contexts for %u uploads\n", contexts);
+			while (i-- > 0)
+			{
+				decompress_mem_free(&pool_contexts[i].sink.mem.decoder);
+			}
+			free(pool_contexts);
+			free(pool_free);
+			free(memory);
+			pool_contexts = NULL;
+			pool_free = NULL;
+			return -1;
+		}
+		pool_contexts[i].sink.fd = -1;
+		pool_free[i] = &pool_contexts[contexts - 1 - i];
+	}
+	pool_size = contexts;
+	pool_free_count = contexts;
+
+	// Blocks are written from this memory, the ring can pin it once instead of per write
+	uring_writer_start(memory, contexts * mem_size);
+
+	csp_print("Reserved memory for %u uploads, %zu KiB\n", contexts, contexts * (mem_size + sizeof(dtp_thread_args_t)) / 1024);
+	return 0;
+}
+
+/* Context of the upload queued or running for a destination, pool_lock held */
+static dtp_thread_args_t *upload_pool_find(const char *path)
+{
+	for (unsigned int i = 0; i < pool_size; i++)
+	{
+		if (pool_contexts[i].path[0] != '\0' && strcmp(pool_contexts[i].path, path) == 0)
+		{
+			return &pool_contexts[i];
+		}
+	}
+	return NULL;
+}
+
+bool upload_pool_busy(const char *path)
+{
+	pthread_mutex_lock(&pool_lock);
+	bool busy = upload_pool_find(path) != NULL;
+	pthread_mutex_unlock(&pool_lock);
+	return busy;
+}
+
+bool upload_pool_full(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	bool full = pool_free_count == 0;
+	pthread_mutex_unlock(&pool_lock);
+	return full;
+}
+
+dtp_thread_args_t *upload_pool_acquire(const char *path)
+{
+	dtp_thread_args_t *args = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_free_count > 0 && upload_pool_find(path) == NULL)
+	{
+		args = pool_free[--pool_free_count];
+		args->path[0] = '\0';
+		strncat(args->path, path, sizeof(args->path) - 1);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return args;
+}
+
+void upload_pool_release(dtp_thread_args_t *args)
+{
+	pthread_mutex_lock(&pool_lock);
+	args->path[0] = '\0';
+	pool_free[pool_free_count++] = args;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Create the missing directories above path */
+static void upload_pool_mkdirs(const char *path)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+	{
+		*slash = '\0';
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		{
+			return;
+		}
+		*slash = '/';
+	}
+}
+
+/* Open the sink of an upload, its session may already be waiting for the first packet */
+static void upload_pool_open(dtp_thread_args_t *args)
+{
+	upload_sink_t *sink = &args->sink;
+	uint64_t open_ns = trace_now();
+
+	upload_pool_mkdirs(args->path);
+	if (args->indexed && content_index_fetch(args->sha256, args->path) == 0)
+	{
+		csp_print("Payload %u already on board, not uploaded\n", args->payload_id);
+		args->present = true;
+		upload_sink_ready(sink, false);
+		return;
+	}
+
+	bool ok = upload_sink_open(sink, args->path, args->mtu, args->resume, args->compression, args->base[0] ? args->base : NULL) == 0;
+	trace_complete(TRACE_FILE_OPEN, args->payload_id, args->resume, open_ns);
+	if (!ok)
+	{
+		csp_print("Error: Could not create file '%s'\n", args->path);
+	}
+	else if (args->fec_source && upload_sink_set_fec(sink, args->fec_source, args->fec_repair, args->size) != 0)
+	{
+		csp_print("FEC %u+%u not supported for payload %u\n", args->fec_source, args->fec_repair, args->payload_id);
+		upload_sink_close(sink, UPLOAD_SINK_KEEP);
+		ok = false;
+	}
+	else
+	{
+		sink->stats = args->stats;
+		if (args->size != 0)
+		{
+			upload_sink_set_size(sink, args->size);
+		}
+	}
+	upload_sink_ready(sink, ok);
+}
+
+static void *upload_pool_setup(void *param)
+{
+	(void)param;
+	trace_thread_name("setup");
+
+	while (1)
+	{
+		pthread_mutex_lock(&setup_lock);
+		while (setup_head == setup_tail)
+		{
+			pthread_cond_wait(&setup_cond, &setup_lock);
+		}
+		dtp_thread_args_t *args = setup_queue[setup_head++ % UPLOAD_POOL_MAX_CONTEXTS];
+		pthread_mutex_unlock(&setup_lock);
+
+		upload_pool_open(args);
+	}
+	return NULL;
+}
+
+int upload_pool_start(unsigned int max_sessions)
+{
+	pthread_t setup;
+
+	if (pthread_create(&setup, NULL, upload_pool_setup, NULL) != 0)
+	{
+		csp_print("Failed to start setup thread\n");
+		return -1;
+	}
+	pthread_detach(setup);
+
+	for (unsigned int i = 0; i < max_sessions; i++)
+	{
+		pthread_t worker;
+		if (pthread_create(&worker, NULL, dtp_client_worker, (void *)(uintptr_t)i) != 0)
+		{
+			csp_print("Failed to start DTP worker thread %u\n", i);
+			return -1;
+		}
+		pthread_detach(worker);
+	}
+
+	if (stripe_start(max_sessions) != 0)
+	{
+		return -1;
+	}
+
+	csp_print("Started %u DTP session workers\n", max_sessions);
+	return 0;
+}
+
+int upload_pool_submit(dtp_thread_args_t *args)
+{
+	// Queued by what the request says, the setup thread owns the sink until it is ready
+	args->stored = 0;
+	// Marked before a worker can take it, so its session waits for the sink
+	upload_sink_prepare(&args->sink);
+	if (upload_queue_push(args) != 0)
+	{
+		upload_sink_ready(&args->sink, false);
+		return -1;
+	}
+
+	pthread_mutex_lock(&setup_lock);
+	setup_queue[setup_tail++ % UPLOAD_POOL_MAX_CONTEXTS] = args;
+	pthread_cond_signal(&setup_cond);
+	pthread_mutex_unlock(&setup_lock);
+	return 0;
+}
+
+void upload_pool_set_transport(upload_transport_t transport)
+{
+	pool_transport = transport;
+}
+
+dtp_result upload_pool_session(uint32_t server, uint32_t throughput, uint32_t timeout, uint16_t payload_id, uint16_t mtu, bool resume)
+{
+	return pool_transport(server, throughput, timeout, payload_id, mtu, resume);
+}
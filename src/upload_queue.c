@@ -0,0 +1,193 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <csp/csp.h>
+
+#include "upload_queue.h"
+
+/* Binary min-heap of waiting uploads, protected by queue_lock */
+static dtp_thread_args_t *queue_heap[UPLOAD_POOL_QUEUE_LENGTH];
+static unsigned int queue_count = 0;
+static uint32_t queue_order = 0;
+
+/* Sessions admitted and the part of the link they reserved */
+static unsigned int queue_active = 0;
+static uint32_t queue_rate = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Taken once when the job is queued or adjusted, a key that changed inside the heap would break it */
+static uint64_t upload_queue_remaining(const dtp_thread_args_t *job)
+{
+	if (job->size == 0)
+	{
+		return UINT64_MAX;
+	}
+	return job->stored < job->size ? job->size - job->stored : 0;
+}
+
+/* True if a should run before b */
+static bool upload_queue_before(const dtp_thread_args_t *a, const dtp_thread_args_t *b)
+{
+	if (a->priority != b->priority)
+	{
+		return a->priority < b->priority;
+	}
+
+	uint64_t deadline_a = a->deadline_ns ? a->deadline_ns : UINT64_MAX;
+	uint64_t deadline_b = b->deadline_ns ? b->deadline_ns : UINT64_MAX;
+	if (deadline_a != deadline_b)
+	{
+		return deadline_a < deadline_b;
+	}
+
+	if (a->remaining != b->remaining)
+	{
+		return a->remaining < b->remaining;
+	}
+
+	return (int32_t)(a->order - b->order) < 0;
+}
+
+static void upload_queue_swap(unsigned int i, unsigned int j)
+{
+	dtp_thread_args_t *tmp = queue_heap[i];
+	queue_heap[i] = queue_heap[j];
+	queue_heap[j] = tmp;
+}
+
+static dtp_thread_args_t *upload_queue_pop(void)
+{
+	dtp_thread_args_t *top = queue_heap[0];
+	unsigned int i = 0;
+
+	queue_heap[0] = queue_heap[--queue_count];
+	while (1)
+	{
+		unsigned int left = 2 * i + 1, right = left + 1, first = i;
+		if (left < queue_count && upload_queue_before(queue_heap[left], queue_heap[first]))
+		{
+			first = left;
+		}
+		if (right < queue_count && upload_queue_before(queue_heap[right], queue_heap[first]))
+		{
+			first = right;
+		}
+		if (first == i)
+		{
+			break;
+		}
+		upload_queue_swap(i, first);
+		i = first;
+	}
+	return top;
+}
+
+/* Rate the job may run at next to the admitted sessions, 0 if it does not fit */
+static uint32_t upload_queue_share(const dtp_thread_args_t *job)
+{
+	rate_profile_t profile = rate_control_profile();
+	uint32_t wanted = job->rate.throughput;
+
+	if (job->priority == UPLOAD_PRIORITY_URGENT || queue_active == 0)
+	{
+		return wanted;
+	}
+
+	uint32_t free = queue_rate < profile.max ? profile.max - queue_rate : 0;
+	if (free < profile.min)
+	{
+		return 0;
+	}
+	return wanted < free ? wanted : free;
+}
+
+int upload_queue_push(dtp_thread_args_t *job)
+{
+	pthread_mutex_lock(&queue_lock);
+	if (queue_count == UPLOAD_POOL_QUEUE_LENGTH)
+	{
+		pthread_mutex_unlock(&queue_lock);
+		return -1;
+	}
+
+	job->order = queue_order++;
+	job->remaining = upload_queue_remaining(job);
+	unsigned int i = queue_count++;
+	queue_heap[i] = job;
+	while (i > 0 && upload_queue_before(queue_heap[i], queue_heap[(i - 1) / 2]))
+	{
+		upload_queue_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+bool upload_queue_full(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	bool full = queue_count == UPLOAD_POOL_QUEUE_LENGTH;
+	pthread_mutex_unlock(&queue_lock);
+	return full;
+}
+
+dtp_thread_args_t *upload_queue_admit(void)
+{
+	uint32_t share;
+
+	pthread_mutex_lock(&queue_lock);
+	while (queue_count == 0 || (share = upload_queue_share(queue_heap[0])) == 0)
+	{
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	}
+
+	dtp_thread_args_t *job = upload_queue_pop();
+	job->reserved = share;
+	job->throughput = share;
+	queue_active++;
+	queue_rate += share;
+	pthread_mutex_unlock(&queue_lock);
+	return job;
+}
+
+void upload_queue_adjust(dtp_thread_args_t *job)
+{
+	rate_profile_t profile = rate_control_profile();
+
+	pthread_mutex_lock(&queue_lock);
+	job->remaining = upload_queue_remaining(job);
+	queue_rate -= job->reserved;
+
+	uint32_t rate = job->rate.throughput;
+	if (job->priority != UPLOAD_PRIORITY_URGENT)
+	{
+		uint32_t free = queue_rate < profile.max ? profile.max - queue_rate : 0;
+		if (free < profile.min)
+		{
+			free = profile.min;
+		}
+		rate = rate < free ? rate : free;
+	}
+
+	job->reserved = rate;
+	job->throughput = rate;
+	queue_rate += rate;
+
+	// A smaller reservation may let a waiting upload in
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void upload_queue_release(dtp_thread_args_t *job)
+{
+	pthread_mutex_lock(&queue_lock);
+	queue_active--;
+	queue_rate -= job->reserved;
+	job->reserved = 0;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,299 @@
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <csp/csp.h>
+
+#include "upload_request.h"
+#include "journal.h"
+#include "upload_pool.h"
+#include "upload_queue.h"
+#include "upload_stats.h"
+#include "vmem_dtp_server.h"
+#include "uploadmetadata.pb-c.h"
+
+/* Bump allocator handed to protobuf-c, everything is dropped at once */
+typedef struct
+{
+	alignas(max_align_t) uint8_t buf[UPLOAD_REQUEST_ARENA_SIZE];
+	size_t used;
+} upload_arena_t;
+
+static void *upload_arena_alloc(void *allocator_data, size_t size)
+{
+	upload_arena_t *arena = allocator_data;
+	size_t start = (arena->used + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+	if (start + size > sizeof(arena->buf))
+	{
+		return NULL;
+	}
+	arena->used = start + size;
+	return &arena->buf[start];
+}
+
+static void upload_arena_free(void *allocator_data, void *pointer)
+{
+	(void)allocator_data;
+	(void)pointer;
+}
+
+/* Send a reply on the request connection */
+static void send_response(csp_conn_t *conn, const uint8_t *data, uint16_t length)
+{
+	csp_packet_t *response = csp_buffer_get(length);
+	if (response)
+	{
+		memcpy(response->data, data, length);
+		response->length = length;
+		csp_send(conn, response); // csp_send takes ownership of the buffer
+	}
+}
+
+int upload_request_schedule(const upload_request_t *req)
+{
+	csp_print("DTP %s request: server %u, payload %u, file '%s'\n", req->resume ? "resume" : "upload", req->server, req->payload_id, req->file_location);
+
+	// A second upload to the same destination would write the same staging file and sidecar
+	if (upload_pool_busy(req->file_location))
+	{
+		csp_print("'%s' is already being uploaded, rejecting payload %u\n", req->file_location, req->payload_id);
+		return UPLOAD_CLIENT_DTP_REQUEST_BUSY;
+	}
+
+	if (!decompress_supported(req->compression))
+	{
+		csp_print("Compression type %u not supported, rejecting payload %u\n", req->compression, req->payload_id);
+		return UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	}
+
+	// The sink is opened after the reply, what would make it fail is checked here
+	rate_profile_t profile = rate_control_profile();
+	size_t path_len = strlen(req->file_location) + strlen(UPLOAD_SINK_STAGE_SUFFIX RESUME_MAP_SUFFIX);
+	if (path_len >= PATH_MAX || (req->base_location && strlen(req->base_location) >= PATH_MAX))
+	{
+		csp_print("File name too long, rejecting payload %u\n", req->payload_id);
+		return UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	}
+	if (req->fec_source && !fec_supported(req->fec_source, req->fec_repair, profile.mtu - DTP_PACKET_HEADER_SIZE, req->size))
+	{
+		csp_print("FEC %u+%u not supported for payload %u\n", req->fec_source, req->fec_repair, req->payload_id);
+		return UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	}
+
+	upload_stats_t *stats = upload_stats_claim(req->payload_id, req->server);
+	if (stats == NULL)
+	{
+		csp_print("Too many sessions in progress, rejecting payload %u\n", req->payload_id);
+		return UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	}
+
+	dtp_thread_args_t *thread_args = upload_pool_acquire(req->file_location);
+	if (thread_args == NULL)
+	{
+		csp_print("All upload contexts in use, rejecting payload %u\n", req->payload_id);
+		upload_stats_finish(stats, UPLOAD_CLIENT_DTP_RESULT_FAILED, 0);
+		return UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	}
+
+	thread_args->base[0] = '\0';
+	if (req->base_location)
+	{
+		strncat(thread_args->base, req->base_location, sizeof(thread_args->base) - 1);
+	}
+	thread_args->compression = req->compression;
+	thread_args->fec_source = req->fec_source;
+	thread_args->fec_repair = req->fec_repair;
+
+	thread_args->server_addr = req->server;
+	thread_args->server = req->server;
+	thread_args->payload_id = req->payload_id;
+	thread_args->resume = req->resume;
+	rate_control_start(&thread_args->rate);
+	thread_args->throughput = thread_args->rate.throughput;
+	thread_args->timeout = profile.timeout;
+	thread_args->mtu = profile.mtu; // a resumed upload keeps its first MTU once its sink is open
+	thread_args->checksum = req->checksum;
+	// Looked up in the content index by the setup thread, hashing and copying a file would hold up the reply
+	thread_args->indexed = req->sha256 && content_index_enabled();
+	thread_args->present = false;
+	if (thread_args->indexed)
+	{
+		memcpy(thread_args->sha256, req->sha256, CONTENT_INDEX_HASH_SIZE);
+	}
+	thread_args->requester = req->requester;
+	thread_args->stats = stats;
+	thread_args->priority = req->priority;
+	thread_args->deadline_ns = req->deadline ? upload_stats_now() + req->deadline * 1000000000ull : 0;
+	thread_args->size = req->size;
+	thread_args->reserved = 0;
+	// A resumed upload keeps the record it was read from, which stays live if it cannot be queued
+	thread_args->journal_id = req->journal_id ? req->journal_id : journal_accept(req);
+
+	if (upload_pool_submit(thread_args) != 0)
+	{
+		csp_print("Upload queue full, rejecting payload %u\n", req->payload_id);
+		if (req->journal_id == 0)
+		{
+			journal_done(thread_args->journal_id, UPLOAD_CLIENT_DTP_RESULT_FAILED);
+		}
+		upload_stats_finish(stats, UPLOAD_CLIENT_DTP_RESULT_FAILED, 0);
+		upload_pool_release(thread_args);
+		return UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	}
+
+	return UPLOAD_CLIENT_DTP_REQUEST_SCHEDULED;
+}
+
+/*
+ * Single file request:
+ * [0] type, [1] server, [2..3] payload id, [4..] NUL terminated destination
+ * The reply is one UPLOAD_CLIENT_DTP_REQUEST_* byte.
+ */
+static void upload_request_single(csp_conn_t *conn, const csp_packet_t *packet)
+{
+	uint8_t status = UPLOAD_CLIENT_DTP_REQUEST_REJECTED;
+	upload_request_t req = {
+		.server = packet->data[1],
+		.resume = packet->data[0] == UPLOAD_CLIENT_DTP_RESUME_REQUEST,
+		.requester = csp_conn_src(conn),
+		.priority = UPLOAD_PRIORITY_NORMAL,
+	};
+	memcpy(&req.payload_id, &packet->data[2], sizeof(uint16_t));
+
+	const char *path = (const char *)&packet->data[4];
+	if (memchr(path, '\0', packet->length - 4) == NULL || path[0] == '\0')
+	{
+		csp_print("Invalid DTP upload request: unterminated file name\n");
+	}
+	else
+	{
+		req.file_location = path;
+		status = upload_request_schedule(&req);
+	}
+
+	send_response(conn, &status, 1);
+	journal_sync();
+}
+
+/*
+ * Batch request:
+ * [0] type, [1..] UploadMetadata message
+ * The reply is [0] 1 if no file was rejected, [1] number of files,
+ * followed by one UPLOAD_CLIENT_DTP_REQUEST_* byte per file in request order.
+ */
+static void upload_request_batch(csp_conn_t *conn, const csp_packet_t *packet)
+{
+	upload_arena_t arena = {.used = 0};
+	ProtobufCAllocator allocator = {
+		.alloc = upload_arena_alloc,
+		.free = upload_arena_free,
+		.allocator_data = &arena,
+	};
+	uint8_t reply[2 + UPLOAD_REQUEST_MAX_ITEMS] = {0};
+
+	UploadMetadata *metadata = upload_metadata__unpack(&allocator, packet->length - 1, &packet->data[1]);
+	if (metadata == NULL || metadata->n_items == 0 || metadata->n_items > UPLOAD_REQUEST_MAX_ITEMS)
+	{
+		csp_print("Invalid DTP batch request\n");
+		send_response(conn, reply, 2);
+		return;
+	}
+
+	reply[0] = 1;
+	reply[1] = metadata->n_items;
+	for (size_t i = 0; i < metadata->n_items; i++)
+	{
+		const UploadMetadataItem *item = metadata->items[i];
+		upload_request_t req = {
+			.server = item->dtp_server_address,
+			.payload_id = item->payload_id,
+			.file_location = item->file_location,
+			.checksum = item->checksum,
+			.requester = csp_conn_src(conn),
+			.priority = item->priority > UPLOAD_PRIORITY_BULK ? UPLOAD_PRIORITY_BULK : item->priority,
+			.deadline = item->deadline,
+			.size = item->size,
+			.compression = item->compression,
+			.base_location = item->base_location[0] ? item->base_location : NULL,
+			.sha256 = item->sha256.len == CONTENT_INDEX_HASH_SIZE ? item->sha256.data : NULL,
+			.fec_source = item->fec_source,
+			.fec_repair = item->fec_repair,
+		};
+
+		if (item->payload_id > UINT16_MAX || item->file_location[0] == '\0')
+		{
+			csp_print("Invalid DTP batch item %zu\n", i);
+		}
+		else
+		{
+			reply[2 + i] = upload_request_schedule(&req);
+		}
+		reply[0] &= reply[2 + i] == UPLOAD_CLIENT_DTP_REQUEST_SCHEDULED;
+	}
+
+	send_response(conn, reply, 2 + metadata->n_items);
+	journal_sync();
+}
+
+/*
+ * Completion report, sent on a new connection once a session ends:
+ * [0] status, [1..2] payload id, [3..6] CRC-32 of the file, [7..10] size
+ */
+void upload_request_report(uint16_t requester, uint16_t payload_id, uint8_t status, uint32_t checksum, uint32_t size)
+{
+	csp_conn_t *conn = csp_connect(CSP_PRIO_NORM, requester, UPLOAD_CLIENT_DTP_COMPLETION_PORT, 1000, CSP_O_RDP);
+	if (conn == NULL)
+	{
+		csp_print("Failed to report completion of payload %u to %u\n", payload_id, requester);
+		return;
+	}
+
+	uint8_t report[11];
+	report[0] = status;
+	memcpy(&report[1], &payload_id, sizeof(payload_id));
+	memcpy(&report[3], &checksum, sizeof(checksum));
+	memcpy(&report[7], &size, sizeof(size));
+	send_response(conn, report, sizeof(report));
+	csp_close(conn);
+}
+
+void upload_request_handle(csp_conn_t *conn, const csp_packet_t *packet)
+{
+	if (packet->length < 1)
+	{
+		csp_print("Invalid DTP upload request: too short\n");
+		return;
+	}
+
+	switch (packet->data[0])
+	{
+	case UPLOAD_CLIENT_DTP_UPLOAD_REQUEST:
+	case UPLOAD_CLIENT_DTP_RESUME_REQUEST:
+		if (packet->length < 5)
+		{
+			csp_print("Invalid DTP upload request: too short\n");
+			break;
+		}
+		upload_request_single(conn, packet);
+		break;
+	case UPLOAD_CLIENT_DTP_BATCH_REQUEST:
+		if (packet->length < 2)
+		{
+			csp_print("Invalid DTP batch request: too short\n");
+			break;
+		}
+		upload_request_batch(conn, packet);
+		break;
+	case UPLOAD_CLIENT_DTP_STATUS_REQUEST:
+		upload_stats_send(conn);
+		break;
+	default:
+	{
+		static const uint8_t failure = 0;
+		csp_print("Unsupported DTP request type %u\n", packet->data[0]);
+		send_response(conn, &failure, 1);
+		break;
+	}
+	}
+}
@@ -0,0 +1,217 @@
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+
+#include "upload_stats.h"
+#include "telemetry.h"
+#include "vmem_dtp_server.h"
+
+/* Size of one session record in a STATUS reply */
+#define UPLOAD_STATS_RECORD_SIZE 40
+
+static upload_stats_t stats_table[UPLOAD_STATS_SLOTS];
+
+uint64_t upload_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+upload_stats_t *upload_stats_claim(uint16_t payload_id, uint16_t server)
+{
+	upload_stats_t *slot = NULL;
+	uint64_t oldest = UINT64_MAX;
+
+	for (int i = 0; i < UPLOAD_STATS_SLOTS; i++)
+	{
+		unsigned int state = atomic_load_explicit(&stats_table[i].state, memory_order_acquire);
+		if (state == UPLOAD_STATE_FREE)
+		{
+			slot = &stats_table[i];
+			break;
+		}
+		uint64_t end = atomic_load_explicit(&stats_table[i].end_ns, memory_order_relaxed);
+		if ((state == UPLOAD_STATE_DONE || state == UPLOAD_STATE_FAILED) && end < oldest)
+		{
+			slot = &stats_table[i];
+			oldest = end;
+		}
+	}
+
+	if (slot == NULL)
+	{
+		return NULL;
+	}
+
+	atomic_store_explicit(&slot->payload_id, payload_id, memory_order_relaxed);
+	atomic_store_explicit(&slot->server, server, memory_order_relaxed);
+	atomic_store_explicit(&slot->result, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->checksum, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->packets, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->missing, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->rate, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->rtt_ms, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->queued_ns, upload_stats_now(), memory_order_relaxed);
+	atomic_store_explicit(&slot->start_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->first_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->last_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->end_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&slot->state, UPLOAD_STATE_QUEUED, memory_order_release);
+	return slot;
+}
+
+void upload_stats_start(upload_stats_t *stats)
+{
+	uint64_t now = upload_stats_now();
+	stats->window_ns = now;
+	stats->window_bytes = 0;
+	atomic_store_explicit(&stats->start_ns, now, memory_order_relaxed);
+	atomic_store_explicit(&stats->first_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->state, UPLOAD_STATE_ACTIVE, memory_order_release);
+}
+
+void upload_stats_packet(upload_stats_t *stats, uint32_t len, uint32_t missing)
+{
+	uint64_t now = upload_stats_now();
+
+	if (atomic_load_explicit(&stats->first_ns, memory_order_relaxed) == 0)
+	{
+		uint64_t start = atomic_load_explicit(&stats->start_ns, memory_order_relaxed);
+		atomic_store_explicit(&stats->first_ns, now, memory_order_relaxed);
+		atomic_store_explicit(&stats->rtt_ms, (now - start) / 1000000, memory_order_relaxed);
+		stats->window_ns = now;
+	}
+
+	atomic_fetch_add_explicit(&stats->bytes, len, memory_order_relaxed);
+	telemetry_packet(len);
+	atomic_fetch_add_explicit(&stats->packets, 1, memory_order_relaxed);
+	atomic_store_explicit(&stats->missing, missing, memory_order_relaxed);
+	atomic_store_explicit(&stats->last_ns, now, memory_order_relaxed);
+
+	stats->window_bytes += len;
+	if (now - stats->window_ns >= UPLOAD_STATS_RATE_WINDOW_NS)
+	{
+		uint64_t rate = stats->window_bytes * 1000000000ull / (now - stats->window_ns);
+		atomic_store_explicit(&stats->rate, rate, memory_order_relaxed);
+		stats->window_ns = now;
+		stats->window_bytes = 0;
+	}
+}
+
+void upload_stats_finish(upload_stats_t *stats, uint8_t result, uint32_t checksum)
+{
+	atomic_store_explicit(&stats->result, result, memory_order_relaxed);
+	atomic_store_explicit(&stats->checksum, checksum, memory_order_relaxed);
+	atomic_store_explicit(&stats->rate, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->end_ns, upload_stats_now(), memory_order_relaxed);
+	atomic_store_explicit(&stats->state, result == UPLOAD_CLIENT_DTP_RESULT_OK ? UPLOAD_STATE_DONE : UPLOAD_STATE_FAILED, memory_order_release);
+	telemetry_session(result == UPLOAD_CLIENT_DTP_RESULT_OK);
+}
+
+/*
+ * Session record:
+ * [0..1] payload id, [2] state, [3] result, [4..5] server, [6..7] RTT ms,
+ * [8..15] bytes, [16..19] packets, [20..23] missing packets,
+ * [24..27] current B/s, [28..31] average B/s, [32..35] elapsed ms, [36..39] CRC-32
+ */
+static void upload_stats_pack(const upload_stats_t *stats, unsigned int state, uint64_t now, uint8_t *out)
+{
+	uint16_t payload_id = atomic_load_explicit(&stats->payload_id, memory_order_relaxed);
+	uint16_t server = atomic_load_explicit(&stats->server, memory_order_relaxed);
+	uint32_t rtt = atomic_load_explicit(&stats->rtt_ms, memory_order_relaxed);
+	uint16_t rtt_ms = rtt > UINT16_MAX ? UINT16_MAX : rtt;
+	uint64_t bytes = atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+	uint32_t packets = atomic_load_explicit(&stats->packets, memory_order_relaxed);
+	uint32_t missing = atomic_load_explicit(&stats->missing, memory_order_relaxed);
+	uint32_t rate = atomic_load_explicit(&stats->rate, memory_order_relaxed);
+	uint32_t checksum = atomic_load_explicit(&stats->checksum, memory_order_relaxed);
+	uint64_t start = atomic_load_explicit(&stats->start_ns, memory_order_relaxed);
+	uint64_t first = atomic_load_explicit(&stats->first_ns, memory_order_relaxed);
+	uint64_t last = atomic_load_explicit(&stats->last_ns, memory_order_relaxed);
+	uint64_t end = atomic_load_explicit(&stats->end_ns, memory_order_relaxed);
+
+	uint32_t average = 0;
+	if (first != 0 && last > first)
+	{
+		average = bytes * 1000000000ull / (last - first);
+	}
+
+	uint32_t elapsed_ms = 0;
+	if (start != 0)
+	{
+		elapsed_ms = ((end ? end : now) - start) / 1000000;
+	}
+
+	out[2] = state;
+	out[3] = atomic_load_explicit(&stats->result, memory_order_relaxed);
+	memcpy(&out[0], &payload_id, sizeof(payload_id));
+	memcpy(&out[4], &server, sizeof(server));
+	memcpy(&out[6], &rtt_ms, sizeof(rtt_ms));
+	memcpy(&out[8], &bytes, sizeof(bytes));
+	memcpy(&out[16], &packets, sizeof(packets));
+	memcpy(&out[20], &missing, sizeof(missing));
+	memcpy(&out[24], &rate, sizeof(rate));
+	memcpy(&out[28], &average, sizeof(average));
+	memcpy(&out[32], &elapsed_ms, sizeof(elapsed_ms));
+	memcpy(&out[36], &checksum, sizeof(checksum));
+}
+
+/*
+ * STATUS reply, split over as many packets as needed:
+ * [0] number of records in this packet, [1] 1 if more packets follow,
+ * [2..] session records
+ */
+void upload_stats_send(csp_conn_t *conn)
+{
+	const int per_packet = (CSP_BUFFER_SIZE - 2) / UPLOAD_STATS_RECORD_SIZE;
+	uint64_t now = upload_stats_now();
+	csp_packet_t *packet = NULL;
+
+	for (int i = 0; i < UPLOAD_STATS_SLOTS; i++)
+	{
+		unsigned int state = atomic_load_explicit(&stats_table[i].state, memory_order_acquire);
+		if (state == UPLOAD_STATE_FREE)
+		{
+			continue;
+		}
+
+		if (packet && packet->data[0] == per_packet)
+		{
+			packet->data[1] = 1;
+			csp_send(conn, packet);
+			packet = NULL;
+		}
+
+		if (packet == NULL)
+		{
+			packet = csp_buffer_get(CSP_BUFFER_SIZE);
+			if (packet == NULL)
+			{
+				return;
+			}
+			packet->data[0] = 0;
+			packet->data[1] = 0;
+		}
+
+		upload_stats_pack(&stats_table[i], state, now, &packet->data[2 + packet->data[0] * UPLOAD_STATS_RECORD_SIZE]);
+		packet->data[0]++;
+		packet->length = 2 + packet->data[0] * UPLOAD_STATS_RECORD_SIZE;
+	}
+
+	if (packet == NULL)
+	{
+		// Nothing tracked, still answer with an empty reply
+		packet = csp_buffer_get(2);
+		if (packet == NULL)
+		{
+			return;
+		}
+		packet->data[0] = 0;
+		packet->data[1] = 0;
+		packet->length = 2;
+	}
+	csp_send(conn, packet);
+}
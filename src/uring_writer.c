@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <csp/csp.h>
+
+#ifdef UPLOAD_HAVE_URING
+#include <liburing.h>
+#endif
+
+#include "uring_writer.h"
+
+#ifdef UPLOAD_HAVE_URING
+
+/*
+ * Any thread may queue operations, the submission side of the ring is
+ * guarded by ring_lock. Completions are only reaped by the completion
+ * thread, which needs no lock for it.
+ */
+static struct io_uring ring;
+static bool ring_enabled = false;
+static bool ring_batch = false; // waiting with a timeout does not touch the submission queue
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int ring_queued = 0;
+
+/* Registered buffer, index 0 */
+static const uint8_t *fixed_base = NULL;
+static size_t fixed_size = 0;
+
+static void uring_writer_submit_locked(void)
+{
+	if (ring_queued > 0)
+	{
+		io_uring_submit(&ring);
+		ring_queued = 0;
+	}
+}
+
+/* Next free entry, submitting the queued ones when the ring is full. NULL if it stays full. */
+static struct io_uring_sqe *uring_writer_sqe(void)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+	if (sqe == NULL)
+	{
+		uring_writer_submit_locked();
+		sqe = io_uring_get_sqe(&ring);
+	}
+	return sqe;
+}
+
+static void uring_writer_queued(unsigned int count)
+{
+	ring_queued += count;
+	if (ring_queued >= URING_WRITER_BATCH || !ring_batch)
+	{
+		uring_writer_submit_locked();
+	}
+}
+
+static void *uring_writer_task(void *param)
+{
+	struct __kernel_timespec timeout = {.tv_sec = 0, .tv_nsec = URING_WRITER_FLUSH_US * 1000};
+	(void)param;
+
+	while (1)
+	{
+		struct io_uring_cqe *cqe;
+		int ret = ring_batch ? io_uring_wait_cqe_timeout(&ring, &cqe, &timeout) : io_uring_wait_cqe(&ring, &cqe);
+		if (ret != 0)
+		{
+			// Quiet for a while, push out what is still queued
+			pthread_mutex_lock(&ring_lock);
+			uring_writer_submit_locked();
+			pthread_mutex_unlock(&ring_lock);
+			continue;
+		}
+
+		while (io_uring_peek_cqe(&ring, &cqe) == 0)
+		{
+			uring_writer_op_t *op = io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			if (op)
+			{
+				op->done(op, res);
+			}
+		}
+	}
+	return NULL;
+}
+
+int uring_writer_start(void *fixed, size_t size)
+{
+	pthread_t thread;
+
+	int ret = io_uring_queue_init(URING_WRITER_ENTRIES, &ring, 0);
+	if (ret < 0)
+	{
+		csp_print("io_uring not available (%s), writing synchronously\n", strerror(-ret));
+		return -1;
+	}
+
+	// Older kernels implement the wait timeout with an entry on the submission queue
+	ring_batch = ring.features & IORING_FEAT_EXT_ARG;
+
+	// Registration pins the memory, without it the writes just copy from it
+	struct iovec iov = {.iov_base = fixed, .iov_len = size};
+	if (fixed && io_uring_register_buffers(&ring, &iov, 1) == 0)
+	{
+		fixed_base = fixed;
+		fixed_size = size;
+	}
+
+	if (pthread_create(&thread, NULL, uring_writer_task, NULL) != 0)
+	{
+		io_uring_queue_exit(&ring);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	ring_enabled = true;
+	csp_print("Writing through io_uring%s\n", fixed_base ? " with registered buffers" : "");
+	return 0;
+}
+
+bool uring_writer_enabled(void)
+{
+	return ring_enabled;
+}
+
+int uring_writer_write(uring_writer_op_t *op, int fd, const void *buf, size_t len, off_t offset)
+{
+	if (!ring_enabled)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&ring_lock);
+	struct io_uring_sqe *sqe = uring_writer_sqe();
+	if (sqe == NULL)
+	{
+		pthread_mutex_unlock(&ring_lock);
+		return -1;
+	}
+	const uint8_t *p = buf;
+	if (fixed_base && p >= fixed_base && p + len <= fixed_base + fixed_size)
+	{
+		io_uring_prep_write_fixed(sqe, fd, buf, len, offset, 0);
+	}
+	else
+	{
+		io_uring_prep_write(sqe, fd, buf, len, offset);
+	}
+	io_uring_sqe_set_data(sqe, op);
+	uring_writer_queued(1);
+	pthread_mutex_unlock(&ring_lock);
+	return 0;
+}
+
+int uring_writer_writev_sync(uring_writer_op_t *op, int fd, const struct iovec *iov, unsigned int count, off_t offset)
+{
+	if (!ring_enabled)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&ring_lock);
+	// Both entries must go into the same submission for the link to hold
+	if (io_uring_sq_space_left(&ring) < 2)
+	{
+		uring_writer_submit_locked();
+		if (io_uring_sq_space_left(&ring) < 2)
+		{
+			pthread_mutex_unlock(&ring_lock);
+			return -1;
+		}
+	}
+	struct io_uring_sqe *sqe = uring_writer_sqe();
+	io_uring_prep_writev(sqe, fd, iov, count, offset);
+	io_uring_sqe_set_data(sqe, NULL);
+	sqe->flags |= IOSQE_IO_LINK;
+	sqe = uring_writer_sqe();
+	io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+	io_uring_sqe_set_data(sqe, op);
+	uring_writer_queued(2);
+	pthread_mutex_unlock(&ring_lock);
+	return 0;
+}
+
+int uring_writer_sync(uring_writer_op_t *op, int fd)
+{
+	if (!ring_enabled)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&ring_lock);
+	struct io_uring_sqe *sqe = uring_writer_sqe();
+	if (sqe == NULL)
+	{
+		pthread_mutex_unlock(&ring_lock);
+		return -1;
+	}
+	io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+	io_uring_sqe_set_data(sqe, op);
+	uring_writer_queued(1);
+	pthread_mutex_unlock(&ring_lock);
+	return 0;
+}
+
+void uring_writer_submit(void)
+{
+	if (ring_enabled)
+	{
+		pthread_mutex_lock(&ring_lock);
+		uring_writer_submit_locked();
+		pthread_mutex_unlock(&ring_lock);
+	}
+}
+
+#else
+
+int uring_writer_start(void *fixed, size_t size)
+{
+	(void)fixed;
+	(void)size;
+	return -1;
+}
+
+bool uring_writer_enabled(void)
+{
+	return false;
+}
+
+int uring_writer_write(uring_writer_op_t *op, int fd, const void *buf, size_t len, off_t offset)
+{
+	(void)op;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offset;
+	return -1;
+}
+
+int uring_writer_writev_sync(uring_writer_op_t *op, int fd, const struct iovec *iov, unsigned int count, off_t offset)
+{
+	(void)op;
+	(void)fd;
+	(void)iov;
+	(void)count;
+	(void)offset;
+	return -1;
+}
+
+int uring_writer_sync(uring_writer_op_t *op, int fd)
+{
+	(void)op;
+	(void)fd;
+	return -1;
+}
+
+void uring_writer_submit(void)
+{
+}
+
+#endif